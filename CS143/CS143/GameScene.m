@@ -11,6 +11,9 @@
 
 GameViewController *gameView;
 
+/* Names the sprites of touches that haven't been committed yet */
+#define TENTATIVE_SPRITE_NAME @"tentative"
+
 @interface GameScene ()
 
 @property (weak, nonatomic) GameViewController *gameView;
@@ -18,6 +21,9 @@ GameViewController *gameView;
 @property (strong, nonatomic) UIButton *resetButton;
 @property (strong, nonatomic) UILabel *connectedLabel;
 
+/* Sprites for our touches that haven't been committed yet, by tag */
+@property (strong, nonatomic) NSMutableDictionary *tentativeSprites;
+
 @end
 
 @implementation GameScene
@@ -50,6 +56,7 @@ GameViewController *gameView;
 
 -(void)didMoveToView:(SKView *)view {
     self.gameView = (GameViewController *)[[[[UIApplication sharedApplication] delegate] window] rootViewController];
+    self.tentativeSprites = [[NSMutableDictionary alloc] init];
         
     /* Setup your scene here */
     self.startButton = [UIButton buttonWithType:UIButtonTypeRoundedRect];
@@ -85,16 +92,28 @@ GameViewController *gameView;
         
     for (UITouch *touch in touches) {
         CGPoint location = [touch locationInNode:self];
-        [self.gameView proposeData:location];
+        // drop touches while the group is catching up rather than queue them
+        if (![self.gameView proposeData:location]) {
+            self.alpha = 0.5;
+            return;
+        }
     }
 }
 
--(void)drawTouch:(CGPoint)coors
+// Remove every committed sprite, keeping the ones still waiting on raft
+-(void)clearScene
+{
+    [self removeAllChildren];
+    for (SKNode *sprite in [self.tentativeSprites allValues]) {
+        [self addChild:sprite];
+    }
+}
+
+-(SKSpriteNode *)drawTouch:(CGPoint)coors
 {
     if (coors.x == -1 && coors.y == -1) {
-        // clear the scene
-        [self removeAllChildren];
-        return;
+        [self clearScene];
+        return nil;
     }
     SKSpriteNode *sprite = [SKSpriteNode spriteNodeWithImageNamed:@"Spaceship"];
     
@@ -107,6 +126,7 @@ GameViewController *gameView;
     [sprite runAction:[SKAction repeatActionForever:action]];
     
     [self addChild:sprite];
+    return sprite;
 }
 
 -(void)applyLog:(unsigned char *)entry
@@ -117,6 +137,66 @@ GameViewController *gameView;
     [self drawTouch:CGPointMake(x, y)];
 }
 
+-(void)applyTentativeLog:(unsigned char *)entry tag:(int)tag
+{
+    CGFloat x = *(CGFloat*)entry;
+    CGFloat y = *((CGFloat*)entry + 1);
+    
+    // a reset waits for the commit; it can't be shown without hiding the
+    // sprites it would have to bring back on a rollback
+    if (x == -1 && y == -1)
+        return;
+    
+    // faded until the group agrees on it
+    SKSpriteNode *sprite = [self drawTouch:CGPointMake(x, y)];
+    sprite.alpha = 0.5;
+    sprite.name = TENTATIVE_SPRITE_NAME;
+    self.tentativeSprites[[NSNumber numberWithInt:tag]] = sprite;
+}
+
+-(void)confirmTentativeLog:(int)tag
+{
+    // applyLog: has drawn the committed sprite in its place
+    [self rollbackTentativeLog:tag];
+}
+
+-(void)rollbackTentativeLog:(int)tag
+{
+    NSNumber *key = [NSNumber numberWithInt:tag];
+    [self.tentativeSprites[key] removeFromParent];
+    [self.tentativeSprites removeObjectForKey:key];
+}
+
+
+-(NSData*)snapshot
+{
+    // the game state is just the position of every sprite on screen
+    NSMutableData *data = [[NSMutableData alloc] init];
+    for (SKNode *child in self.children) {
+        // only what the group has agreed on
+        if ([child.name isEqualToString:TENTATIVE_SPRITE_NAME])
+            continue;
+        CGPoint coors = child.position;
+        [data appendBytes:&coors length:sizeof(CGPoint)];
+    }
+    return data;
+}
+
+-(void)restoreSnapshot:(NSData *)snapshot
+{
+    [self clearScene];
+    
+    const CGPoint *coors = [snapshot bytes];
+    for (NSUInteger i = 0; i < [snapshot length] / sizeof(CGPoint); i++) {
+        [self drawTouch:coors[i]];
+    }
+}
+
+
+-(void)canProposeAgain
+{
+    self.alpha = 1.0;
+}
 
 -(void)update:(CFTimeInterval)currentTime {
     /* Called before each frame is rendered */
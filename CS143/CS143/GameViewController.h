@@ -15,6 +15,6 @@
 
 - (void)start_raft;
 
-- (void)proposeData:(CGPoint) point;
+- (BOOL)proposeData:(CGPoint) point;
 
 @end
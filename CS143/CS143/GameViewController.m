@@ -38,9 +38,9 @@
 
 @implementation GameViewController
 
-- (void)proposeData:(CGPoint) point
+- (BOOL)proposeData:(CGPoint) point
 {
-    [self.raftBLE proposeLog:(unsigned char*)&point length:sizeof(CGPoint)];
+    return [self.raftBLE proposeLog:(unsigned char*)&point length:sizeof(CGPoint)];
 }
 
 -(void)start_raft
@@ -65,6 +65,12 @@
     
     // initialize the RaftBLE and delegate
     self.raftBLE = [[RaftBLE alloc] initWithDelegate:self.scene];
+    // entries are a CGPoint
+#if CGFLOAT_IS_DOUBLE
+    [self.raftBLE setEntryLayout:"dd"];
+#else
+    [self.raftBLE setEntryLayout:"ff"];
+#endif
 
     // Present the scene.
     [skView presentScene:self.scene];
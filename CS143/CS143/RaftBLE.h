@@ -8,23 +8,57 @@
 
 #import <Foundation/Foundation.h>
 
-@protocol RaftBLEDelegate
+@protocol RaftBLEDelegate <NSObject>
 
 // The given entry can safely be committed
 - (void) applyLog: (unsigned char*)entry;
 
+// Serialise the state built from every log applied so far
+- (NSData*) snapshot;
+
+// Replace our state with a snapshot taken by another device
+- (void) restoreSnapshot: (NSData*)snapshot;
+
+// A proposal was turned away earlier; proposals will be accepted again
+- (void) canProposeAgain;
+
 // another device started the game
 - (void) gameStarted;
 
 - (void) numConnectedDevicesChanged: (NSUInteger)numConnected;
 
+@optional
+
+// Show an entry proposed on this device before it is committed. Keep it
+// apart from the state applyLog: builds; it is confirmed or rolled back
+// later by its tag. Implementing this turns speculation on
+- (void) applyTentativeLog: (unsigned char*)entry tag:(int)tag;
+
+// The tentative entry committed, and applyLog: has been called with it
+- (void) confirmTentativeLog: (int)tag;
+
+// The tentative entry won't be committed through us, so undo it. Should
+// another device's proposal have carried it, applyLog: still gets it
+- (void) rollbackTentativeLog: (int)tag;
+
 @end
 
 
 @interface RaftBLE : NSObject
 
-// Propose an entry
-- (void) proposeLog: (unsigned char *)data length:(int)len;
+/* Propose an entry. Returns NO if too many earlier entries are still
+ waiting to be committed; the delegate hears canProposeAgain once they are */
+- (BOOL) proposeLog: (unsigned char *)data length:(int)len;
+
+/* As proposeLog:length:, then calls completion with YES once the entry is
+ applied, or NO if a new leader overwrote it or raft can't tell. Entries
+ proposed on a follower are forwarded to the leader, which doesn't report
+ back, so completion is only called for entries proposed on the leader */
+- (BOOL) proposeLog: (unsigned char *)data length:(int)len completion:(void (^)(BOOL committed))completion;
+
+/* Describe the fields of proposed entries so they can be delta encoded.
+ See raft_set_entry_layout */
+- (void) setEntryLayout: (const char *)layout;
 
 /* Set up the raft configuration based on the currently connected devices.
  Start periodic calls to update raft state */
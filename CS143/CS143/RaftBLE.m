@@ -32,6 +32,9 @@
 @property (strong, nonatomic) CBMutableCharacteristic   *proposeCharacteristic;
 /* New device is waiting to join */
 @property (strong, nonatomic) CBMutableCharacteristic   *joinCharacteristic;
+/* Snapshot transfer to a lagging follower */
+@property (strong, nonatomic) CBMutableCharacteristic   *toCentralSnapshotCharacteristic;
+@property (strong, nonatomic) CBMutableCharacteristic   *fromCentralSnapshotCharacteristic;
 
 /* Two way dictionary from UUID to RaftIdx and from RaftIdx to UUID */
 @property (strong, nonatomic)  NSMutableDictionary *PeripheralRaftIdxDict;
@@ -39,6 +42,14 @@
 /* Indices inside of raft nodes that have disconnected and can be reused */
 @property (strong, nonatomic) NSMutableArray *freeIndices;
 
+/* Indices of devices that joined while an earlier membership change was
+ uncommitted, and that raft still has to make learners */
+@property (strong, nonatomic) NSMutableArray *pendingLearners;
+
+/* Proposals made while leader that raft hasn't reported on yet, keyed by
+ log index. Each holds when it was proposed and, optionally, its completion */
+@property (strong, nonatomic) NSMutableDictionary *proposals;
+
 /* Whether or not the raft server has started at this node */
 @property (assign, nonatomic)  BOOL raft_started;
 
@@ -54,8 +65,11 @@ NSMutableDictionary *pPeripheralRaftIdxDict;
 CBPeripheralManager *pPeripheralManager;
 CBMutableCharacteristic *pToCandidateCharacteristic;
 CBMutableCharacteristic *pToCentralCharacteristic;
+CBMutableCharacteristic *pToCentralSnapshotCharacteristic;
+CBMutableCharacteristic *pProposeCharacteristic;
 CBCentralManager      *pCentralManager;
 id<RaftBLEDelegate>   pDelegate;
+NSMutableDictionary *pProposals;
 
 
 #define RAFT_SERVICE_UUID                      @"698C6448-C9A4-4CAC-A30A-D33F3AF25330"
@@ -65,9 +79,18 @@ id<RaftBLEDelegate>   pDelegate;
 #define RAFT_FROM_CANDIDATE_CHAR_UUID          @"85B3A6E5-42AF-4F8F-AECD-50E60A65A521"
 #define RAFT_PROPOSE_CHAR_UUID                 @"6A401949-869B-4DAF-9E75-2FFEF411EDEE"
 #define RAFT_JOIN_CHAR_UUID                    @"2189B982-FD8E-46E1-9BB5-A35996E1FB3D"
+#define RAFT_TO_CENTRAL_SNAPSHOT_CHAR_UUID     @"4C0F1BE8-106E-41FA-BCA7-2A16AA0C3E5B"
+#define RAFT_FROM_CENTRAL_SNAPSHOT_CHAR_UUID   @"94FFEE7E-9805-4C09-87FC-31F314FE13F4"
 
 #define RAFT_PERIODIC_SEC                     0.01
 
+/* Number of applied entries we keep in the log before snapshotting the game */
+#define RAFT_SNAPSHOT_THRESHOLD               100
+
+/* Proposals waiting on a quorum before we turn new ones away. Commits take
+ a few round trips over BLE, so anything deeper is just latency */
+#define RAFT_UNCOMMITTED_LIMIT                32
+
 @implementation RaftBLE
 
 CBCharacteristic *getCharacterisitic(int peer, NSString *charUUID, CBPeripheral **retP)
@@ -94,7 +117,11 @@ int send_requestvote(raft_server_t* raft, int peer, msg_requestvote_t* msg)
         unsigned char uuid[16];
         [[[UIDevice currentDevice] identifierForVendor] getUUIDBytes:uuid];
         memcpy(&msg->uuid, uuid, 16);
-        NSData *dataToWrite = [NSData dataWithBytes:msg length:sizeof(msg_requestvote_t)];
+        unsigned char buf[RAFT_WIRE_MAX];
+        int len = raft_encode_requestvote(raft, peer, msg, buf, RAFT_WIRE_MAX);
+        if (len == 0)
+            return 0;
+        NSData *dataToWrite = [NSData dataWithBytes:buf length:len];
         [p writeValue:dataToWrite forCharacteristic:charac type:CBCharacteristicWriteWithoutResponse];
         return 1;
     }
@@ -106,7 +133,11 @@ int send_requestvote_response(raft_server_t* raft, int peer, msg_requestvote_res
 {
     if(msg->vote_granted == 0) return 1;
     
-    NSData *dataToWrite = [NSData dataWithBytes:msg length:sizeof(msg_requestvote_response_t)];
+    unsigned char buf[RAFT_WIRE_MAX];
+    int len = raft_encode_requestvote_response(raft, peer, msg, buf, RAFT_WIRE_MAX);
+    if (len == 0)
+        return 0;
+    NSData *dataToWrite = [NSData dataWithBytes:buf length:len];
     [pPeripheralManager updateValue:dataToWrite forCharacteristic:pToCandidateCharacteristic onSubscribedCentrals:nil];
     return 1;
 }
@@ -119,17 +150,43 @@ int send_appendentries(raft_server_t* raft, int peer, msg_appendentries_t* msg)
     CBPeripheral *p;
     CBCharacteristic *charac = getCharacterisitic(peer, RAFT_FROM_CENTRAL_CHAR_UUID, &p);
     if (charac) {
-        NSData *dataToWrite = [NSData dataWithBytes:msg length:sizeof(msg_appendentries_t)];
+        unsigned char buf[RAFT_WIRE_MAX];
+        int len = raft_encode_appendentries(raft, peer, msg, buf, RAFT_WIRE_MAX);
+        if (len == 0)
+            return 0;
+        NSData *dataToWrite = [NSData dataWithBytes:buf length:len];
         [p writeValue:dataToWrite forCharacteristic:charac type:CBCharacteristicWriteWithoutResponse];
         return 1;
     }
     return 0;
 }
 
+/* Write the same appendentries to the RAFT_FROM_CENTRAL characteristic of
+ * each peer, encoding it only once */
+int send_appendentries_broadcast(raft_server_t* raft, const int* peers, int npeers, msg_appendentries_t* msg)
+{
+    unsigned char buf[RAFT_WIRE_MAX];
+    int len = raft_encode_appendentries(raft, peers[0], msg, buf, RAFT_WIRE_MAX);
+    if (len == 0)
+        return 0;
+    NSData *dataToWrite = [NSData dataWithBytes:buf length:len];
+    for (int i = 0; i < npeers; i++) {
+        CBPeripheral *p;
+        CBCharacteristic *charac = getCharacterisitic(peers[i], RAFT_FROM_CENTRAL_CHAR_UUID, &p);
+        if (charac)
+            [p writeValue:dataToWrite forCharacteristic:charac type:CBCharacteristicWriteWithoutResponse];
+    }
+    return 1;
+}
+
 /* Write to own RAFT_TO_CENTRAL characteristic */
 int send_appendentries_response(raft_server_t* raft, int peer, msg_appendentries_response_t* msg)
 {
-    NSData *dataToWrite = [NSData dataWithBytes:msg length:sizeof(msg_appendentries_response_t)];
+    unsigned char buf[RAFT_WIRE_MAX];
+    int len = raft_encode_appendentries_response(raft, peer, msg, buf, RAFT_WIRE_MAX);
+    if (len == 0)
+        return 0;
+    NSData *dataToWrite = [NSData dataWithBytes:buf length:len];
     [pPeripheralManager updateValue:dataToWrite forCharacteristic:pToCentralCharacteristic onSubscribedCentrals:nil];
     return 1;
 }
@@ -140,6 +197,103 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
     return 1;
 }
 
+/* Write to RAFT_FROM_CENTRAL_SNAPSHOT characteristic of peer */
+int send_installsnapshot(raft_server_t* raft, int peer, msg_installsnapshot_t* msg)
+{
+    CBPeripheral *p;
+    CBCharacteristic *charac = getCharacterisitic(peer, RAFT_FROM_CENTRAL_SNAPSHOT_CHAR_UUID, &p);
+    if (charac) {
+        unsigned char buf[RAFT_WIRE_MAX];
+        int len = raft_encode_installsnapshot(raft, peer, msg, buf, RAFT_WIRE_MAX);
+        if (len == 0)
+            return 0;
+        NSData *dataToWrite = [NSData dataWithBytes:buf length:len];
+        [p writeValue:dataToWrite forCharacteristic:charac type:CBCharacteristicWriteWithoutResponse];
+        return 1;
+    }
+    return 0;
+}
+
+/* Write to own RAFT_TO_CENTRAL_SNAPSHOT characteristic */
+int send_installsnapshot_response(raft_server_t* raft, int peer, msg_installsnapshot_response_t* msg)
+{
+    unsigned char buf[RAFT_WIRE_MAX];
+    int len = raft_encode_installsnapshot_response(raft, peer, msg, buf, RAFT_WIRE_MAX);
+    if (len == 0)
+        return 0;
+    NSData *dataToWrite = [NSData dataWithBytes:buf length:len];
+    [pPeripheralManager updateValue:dataToWrite forCharacteristic:pToCentralSnapshotCharacteristic onSubscribedCentrals:nil];
+    return 1;
+}
+
+int snapshot_save(raft_server_t* raft, unsigned char** data, int* len)
+{
+    NSData *snapshot = [pDelegate snapshot];
+    *len = (int)[snapshot length];
+    /* raft takes ownership of the buffer */
+    if (!(*data = malloc(*len + 1)))
+        return 0;
+    [snapshot getBytes:*data length:*len];
+    return 1;
+}
+
+int snapshot_load(raft_server_t* raft, unsigned char* data, int len)
+{
+    [pDelegate restoreSnapshot:[NSData dataWithBytes:data length:len]];
+    return 1;
+}
+
+void capacity(raft_server_t* raft)
+{
+    [pDelegate canProposeAgain];
+}
+
+/* Notify on our RAFT_PROPOSE characteristic; only the leader acts on it */
+int send_proposal(raft_server_t* raft, int peer, msg_entry_t* entry)
+{
+    NSData *data = [NSData dataWithBytes:entry length:sizeof(msg_entry_t)];
+    return [pPeripheralManager updateValue:data forCharacteristic:pProposeCharacteristic onSubscribedCentrals:nil];
+}
+
+/* Show a proposal of ours ahead of the cluster agreeing on it */
+void applylog_tentative(raft_server_t* raft, msg_entry_response_t* r, msg_entry_t* entry)
+{
+    [pDelegate applyTentativeLog:entry->data tag:r->id];
+}
+
+/* Log how long the proposal took end to end, and tell whoever made it */
+void entry_done(raft_server_t* raft, msg_entry_response_t* r, int result)
+{
+    if (r->id) {
+        if (result == RAFT_ENTRY_COMMITTED)
+            [pDelegate confirmTentativeLog:r->id];
+        else
+            [pDelegate rollbackTentativeLog:r->id];
+    }
+    
+    NSNumber *key = [NSNumber numberWithLongLong:r->idx];
+    NSArray *proposal = pProposals[key];
+    if (!proposal)
+        return;
+    [pProposals removeObjectForKey:key];
+    
+    NSLog(@"Entry %lld %@ after %.1f ms", r->idx,
+          result == RAFT_ENTRY_COMMITTED ? @"committed" : @"failed",
+          -[proposal[0] timeIntervalSinceNow] * 1000);
+    if ([proposal count] > 1) {
+        void (^completion)(BOOL) = proposal[1];
+        completion(result == RAFT_ENTRY_COMMITTED);
+    }
+}
+
+void node_lagging(raft_server_t* raft, int peer, int lagging)
+{
+    if (lagging)
+        NSLog(@"Peer %d has fallen behind", peer);
+    else
+        NSLog(@"Peer %d has caught up", peer);
+}
+
 #pragma mark - Lifecycle
 - (id) initWithDelegate:(id<RaftBLEDelegate>)delegate
 {
@@ -153,10 +307,24 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
             .send_appendentries = send_appendentries ,
             .send_appendentries_response = send_appendentries_response ,
             .applylog = applylog ,
+            .send_installsnapshot = send_installsnapshot ,
+            .send_installsnapshot_response = send_installsnapshot_response ,
+            .snapshot_save = snapshot_save ,
+            .snapshot_load = snapshot_load ,
+            .capacity = capacity ,
+            .node_lagging = node_lagging ,
+            .send_appendentries_broadcast = send_appendentries_broadcast ,
+            .entry_done = entry_done ,
+            .send_proposal = send_proposal ,
+            // speculate only for delegates that can show and undo entries
+            .applylog_tentative = [delegate respondsToSelector:@selector(applyTentativeLog:tag:)] ? applylog_tentative : NULL ,
         };
         
         /* don't think we need the passed in udata to this function */
         raft_set_callbacks(raft_server, &funcs);
+        raft_set_snapshot_threshold(raft_server, RAFT_SNAPSHOT_THRESHOLD);
+        raft_set_uncommitted_limit(raft_server, RAFT_UNCOMMITTED_LIMIT);
+        raft_set_codecs(raft_server, RAFT_CODEC_ALL);
         
         
         self.discoveredPeripherals = [[NSMutableArray alloc] init];
@@ -164,8 +332,11 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
         self.PeripheralRaftIdxDict = [[NSMutableDictionary alloc]init];
         pConnectedPeripherals = self.connectedPeripherals;
         pPeripheralRaftIdxDict = self.PeripheralRaftIdxDict;
+        self.proposals = [[NSMutableDictionary alloc] init];
+        pProposals = self.proposals;
         
         self.freeIndices = [[NSMutableArray alloc]init];
+        self.pendingLearners = [[NSMutableArray alloc]init];
         
         // Start up the CBPeripheralManager
         self.peripheralManager = [[CBPeripheralManager alloc] initWithDelegate:self queue:nil];
@@ -185,23 +356,46 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
 }
 
 #pragma mark - Raft function
--(void)proposeLog:(unsigned char*)data length:(int)len
+-(BOOL)proposeLog:(unsigned char*)data length:(int)len
+{
+    return [self proposeLog:data length:len completion:nil];
+}
+
+-(BOOL)proposeLog:(unsigned char*)data length:(int)len completion:(void (^)(BOOL committed))completion
 {
     msg_entry_t msg;
+    // zero the unused bytes so consecutive entries compress well
+    memset(&msg, 0, sizeof(msg_entry_t));
     memcpy(msg.data, data, len);
         
     if (raft_is_leader(raft_server)) {
-        raft_recv_entry(raft_server, 0, &msg);
+        // the entry goes at the end of our log. Track it before proposing, as
+        // alone we apply it straight away
+        NSNumber *key = [NSNumber numberWithLongLong:raft_get_current_idx(raft_server)];
+        NSDate *now = [NSDate date];
+        self.proposals[key] = completion ? @[now, [completion copy]] : @[now];
+        if (raft_recv_entry(raft_server, 0, &msg, NULL) != 1) {
+            [self.proposals removeObjectForKey:key];
+            return NO;
+        }
+        return YES;
     }
     else {
-        NSData *data = [NSData dataWithBytes:&msg length:sizeof(msg_entry_t)];
-        [self.peripheralManager updateValue:data forCharacteristic:self.proposeCharacteristic onSubscribedCentrals:nil];
+        // rides to the leader with our next ack, or goes by itself through
+        // send_proposal if none goes out soon
+        return raft_forward_entry(raft_server, &msg) == 1;
     }
 }
 
 - (void) raft_call_periodic
 {
     raft_periodic(raft_server, RAFT_PERIODIC_SEC*1000);
+    
+    // devices that joined right after another one, once its change has committed
+    for (NSNumber *idx in [self.pendingLearners copy]) {
+        if (raft_set_learner(raft_server, [idx intValue]))
+            [self.pendingLearners removeObject:idx];
+    }
 }
 
 -(void) raft_call_become_candidate
@@ -209,6 +403,11 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
     raft_become_candidate(raft_server);
 }
 
+- (void)setEntryLayout:(const char *)layout
+{
+    raft_set_entry_layout(raft_server, layout);
+}
+
 - (void)raft_start:(int)startCandidate
 {
     if (self.raft_started)
@@ -240,7 +439,8 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
         idx = @([idx intValue] + 1);
     }
     
-    raft_set_configuration(raft_server, (int)numConnected + 1);
+    if (!raft_set_configuration(raft_server, (int)numConnected + 1))
+        NSLog(@"Raft was built for a fixed number of devices, not %d", (int)numConnected + 1);
     
     // MAKE SURE THIS WORKS
     if (startCandidate) {
@@ -287,11 +487,19 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
                                       permissions:CBAttributePermissionsReadable];
     pToCandidateCharacteristic = self.toCandidateCharacteristic;
     
+    self.toCentralSnapshotCharacteristic = [[CBMutableCharacteristic alloc]
+                                            initWithType:[CBUUID UUIDWithString:RAFT_TO_CENTRAL_SNAPSHOT_CHAR_UUID]
+                                            properties:CBCharacteristicPropertyNotify|CBCharacteristicPropertyRead
+                                            value:nil
+                                            permissions:CBAttributePermissionsReadable];
+    pToCentralSnapshotCharacteristic = self.toCentralSnapshotCharacteristic;
+    
     self.proposeCharacteristic = [[CBMutableCharacteristic alloc]
                                   initWithType:[CBUUID UUIDWithString:RAFT_PROPOSE_CHAR_UUID]
                                   properties:CBCharacteristicPropertyNotify|CBCharacteristicPropertyRead
                                   value:nil
                                   permissions:CBAttributePermissionsReadable];
+    pProposeCharacteristic = self.proposeCharacteristic;
     
     self.joinCharacteristic = [[CBMutableCharacteristic alloc]
                                initWithType:[CBUUID UUIDWithString:RAFT_JOIN_CHAR_UUID]
@@ -311,6 +519,12 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
                                         value:nil
                                         permissions:CBAttributePermissionsWriteable];
     
+    self.fromCentralSnapshotCharacteristic = [[CBMutableCharacteristic alloc]
+                                              initWithType:[CBUUID UUIDWithString:RAFT_FROM_CENTRAL_SNAPSHOT_CHAR_UUID]
+                                              properties:CBCharacteristicPropertyWriteWithoutResponse
+                                              value:nil
+                                              permissions:CBAttributePermissionsWriteable];
+    
     // Then the service
     CBMutableService *transferService = [[CBMutableService alloc] initWithType:[CBUUID UUIDWithString:RAFT_SERVICE_UUID]
                                                                        primary:YES];
@@ -318,7 +532,8 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
     // Add the characteristic to the service
     transferService.characteristics = @[self.toCentralCharacteristic, self.fromCentralCharacteristic,
                                         self.toCandidateCharacteristic, self.fromCandidateCharacteristic,
-                                        self.proposeCharacteristic, self.joinCharacteristic];
+                                        self.proposeCharacteristic, self.joinCharacteristic,
+                                        self.toCentralSnapshotCharacteristic, self.fromCentralSnapshotCharacteristic];
     
     // And add it to the peripheral manager
     [self.peripheralManager addService:transferService];
@@ -355,8 +570,9 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
                 }
             }
             msg_requestvote_t requestvote;
-            if (node != -1) {
-                [request_data getBytes:&requestvote length:sizeof(msg_requestvote_t)];
+            if (node != -1 &&
+                raft_decode_requestvote(raft_server, node, [request_data bytes],
+                                        (int)[request_data length], &requestvote)) {
                 raft_recv_requestvote(raft_server, node, &requestvote);
             }
         }
@@ -370,12 +586,29 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
                 }
             }
             msg_appendentries_t appendEntries;
-            if (node != -1) {
-                [request_data getBytes:&appendEntries length:sizeof(msg_appendentries_t)];
+            if (node != -1 &&
+                raft_decode_appendentries(raft_server, node, [request_data bytes],
+                                          (int)[request_data length], &appendEntries)) {
                 raft_recv_appendentries(raft_server, node, &appendEntries);
             }
             
         }
+        else if ([charac.UUID isEqual:[CBUUID UUIDWithString:RAFT_FROM_CENTRAL_SNAPSHOT_CHAR_UUID]])
+        {
+            int node = -1;
+            NSString *uuid = [[request.central identifier] UUIDString];
+            for (CBPeripheral *p in self.connectedPeripherals) {
+                if ([uuid isEqualToString:[[p identifier] UUIDString]]) {
+                    node = [self.PeripheralRaftIdxDict[p] intValue];
+                }
+            }
+            msg_installsnapshot_t installSnapshot;
+            if (node != -1 &&
+                raft_decode_installsnapshot(raft_server, node, [request_data bytes],
+                                            (int)[request_data length], &installSnapshot)) {
+                raft_recv_installsnapshot(raft_server, node, &installSnapshot);
+            }
+        }
     }
 }
 
@@ -478,6 +711,11 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
         [self.PeripheralRaftIdxDict setObject:[NSNumber numberWithInt:newIdx] forKey:peripheral];
         [self.PeripheralRaftIdxDict setObject:peripheral forKey:[NSNumber numberWithInt:newIdx]];
         
+        // the new device's log is empty, so don't let it hold up commits until it catches up
+        // only the leader's call counts; its appendentries carry the learner to the other devices
+        if (!raft_set_learner(raft_server, newIdx))
+            [self.pendingLearners addObject:[NSNumber numberWithInt:newIdx]];
+        
         [peripheral discoverServices:@[[CBUUID UUIDWithString:RAFT_SERVICE_UUID]]];
     }
     
@@ -520,7 +758,8 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
         [dict setObject:characteristic forKey:characteristic.UUID];
         if ([characteristic.UUID isEqual:[CBUUID UUIDWithString:RAFT_PROPOSE_CHAR_UUID]] ||
             [characteristic.UUID isEqual:[CBUUID UUIDWithString:RAFT_TO_CANDIDATE_CHAR_UUID]] ||
-            [characteristic.UUID isEqual:[CBUUID UUIDWithString:RAFT_TO_CENTRAL_CHAR_UUID]]) {
+            [characteristic.UUID isEqual:[CBUUID UUIDWithString:RAFT_TO_CENTRAL_CHAR_UUID]] ||
+            [characteristic.UUID isEqual:[CBUUID UUIDWithString:RAFT_TO_CENTRAL_SNAPSHOT_CHAR_UUID]]) {
             [peripheral setNotifyValue:YES forCharacteristic:characteristic];
         }
     }
@@ -537,7 +776,9 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
     
     if([characteristic.UUID isEqual: [CBUUID UUIDWithString: RAFT_TO_CANDIDATE_CHAR_UUID]]) {
         msg_requestvote_response_t voteResponse;
-        [characteristic.value getBytes:&voteResponse length:sizeof(msg_requestvote_response_t)];
+        if (!raft_decode_requestvote_response(raft_server, -1, [characteristic.value bytes],
+                                              (int)[characteristic.value length], &voteResponse))
+            return;
         NSString *receivedVoteeUUID = [[[NSUUID alloc] initWithUUIDBytes:(unsigned char *)voteResponse.uuid] UUIDString];
         if([receivedVoteeUUID isEqualToString:[[[UIDevice currentDevice] identifierForVendor] UUIDString]]) {
             int node = [self.PeripheralRaftIdxDict[peripheral] intValue];
@@ -551,11 +792,21 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
         if (!raft_is_leader(raft_server))
             return;
         msg_appendentries_response_t appendEntriesResponse;
-        [characteristic.value getBytes:&appendEntriesResponse length:sizeof(msg_appendentries_response_t)];
         int node = [self.PeripheralRaftIdxDict[peripheral] intValue];
-        raft_recv_appendentries_response(raft_server, node, &appendEntriesResponse);
+        if (raft_decode_appendentries_response(raft_server, node, [characteristic.value bytes],
+                                               (int)[characteristic.value length], &appendEntriesResponse))
+            raft_recv_appendentries_response(raft_server, node, &appendEntriesResponse);
         
     }
+    else if ([characteristic.UUID isEqual: [CBUUID UUIDWithString: RAFT_TO_CENTRAL_SNAPSHOT_CHAR_UUID]]) {
+        if (!raft_is_leader(raft_server))
+            return;
+        msg_installsnapshot_response_t installSnapshotResponse;
+        int node = [self.PeripheralRaftIdxDict[peripheral] intValue];
+        if (raft_decode_installsnapshot_response(raft_server, node, [characteristic.value bytes],
+                                                 (int)[characteristic.value length], &installSnapshotResponse))
+            raft_recv_installsnapshot_response(raft_server, node, &installSnapshotResponse);
+    }
     else if ([characteristic.UUID isEqual: [CBUUID UUIDWithString: RAFT_PROPOSE_CHAR_UUID]]) {
         if (!raft_is_leader(raft_server))
             return;
@@ -563,7 +814,10 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
         msg_entry_t msg;
         [characteristic.value getBytes:&msg length:sizeof(msg_entry_t)];
         int node = [self.PeripheralRaftIdxDict[peripheral] intValue];
-        raft_recv_entry(raft_server, node, &msg);
+        // there's no way to tell the proposer we're busy, so the entry is
+        // dropped just like a lost write
+        if (raft_recv_entry(raft_server, node, &msg, NULL) == RAFT_ERR_BUSY)
+            NSLog(@"Dropped proposal from %d, too many uncommitted entries", node);
     }
     else if ([characteristic.UUID isEqual: [CBUUID UUIDWithString: RAFT_JOIN_CHAR_UUID]]) {
         // leader found a new device... start scanning and advertising
@@ -584,6 +838,7 @@ int applylog(raft_server_t* raft, msg_entry_t entry)
         [self.PeripheralRaftIdxDict removeObjectForKey:peripheral];
         [self.PeripheralRaftIdxDict removeObjectForKey:[NSNumber numberWithInt:idx]];
         raft_clear_node(raft_server, idx);
+        [self.pendingLearners removeObject:[NSNumber numberWithInt:idx]];
         [self.freeIndices addObject:[NSNumber numberWithInt:idx]];
     }
     [self.connectedPeripherals removeObjectForKey:peripheral];
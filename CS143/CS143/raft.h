@@ -11,12 +11,17 @@
  * @version 0.1
  */
 
+/* Terms and log indices are 64 bits wide so that long running sessions
+ * can't wrap them. The wire encodings send them as varints */
+typedef long long raft_term_t;
+typedef long long raft_index_t;
+
 typedef struct {
     /* candidate's term */
-    uint16_t term;
+    raft_term_t term;
     
     /* idx of candidate's last log entry */
-    uint16_t last_log_idx;
+    raft_index_t last_log_idx;
     
     /* term of candidate's last log entry */
     // probably want this for complete correctness...
@@ -27,14 +32,32 @@ typedef struct {
 
 } msg_requestvote_t;
 
+/* Bytes of payload per entry. Every node must be built with the same
+ * size, e.g. -DRAFT_ENTRY_SIZE=64 */
+#ifndef RAFT_ENTRY_SIZE
+#define RAFT_ENTRY_SIZE 20
+#endif
+
 typedef struct {
     /* entry data */
-    unsigned char data[20];
+    unsigned char data[RAFT_ENTRY_SIZE];
 } msg_entry_t;
 
+typedef struct {
+    /* term the entry was appended in */
+    raft_term_t term;
+    
+    /* index the entry was appended at */
+    raft_index_t idx;
+    
+    /* number the entry was given when proposed to this server, if
+     * applylog_tentative was told of it; 0 otherwise */
+    int id;
+} msg_entry_response_t;
+
 typedef struct {
     /* currentTerm, for candidate to update itself */
-    int term;
+    raft_term_t term;
     
     /* true means candidate received vote */
     // not really used because we ignore further vote requests that term
@@ -44,23 +67,38 @@ typedef struct {
     char uuid[16];
 } msg_requestvote_response_t;
 
+/* Most nodes that can be learners at once. Each appendentries lists them */
+#define RAFT_LEARNERS_MAX 8
+
 /* TODO! this is way more than 20 bytes..., how much room do we have? */
 typedef struct {
-    int term;
+    raft_term_t term;
     int leader_id;
-    int prev_log_idx;
-    int prev_log_term;
+    raft_index_t prev_log_idx;
+    raft_term_t prev_log_term;
     
     // this will ALWAYS be 1 because we have small payloads with BLE
     int n_entries;
     msg_entry_t entry;
-    int entry_term;
-    int leader_commit;
+    raft_term_t entry_term;
+    raft_index_t leader_commit;
+    
+    /* the leader's clock, echoed in the response to measure RTT */
+    int timestamp;
+    
+    /* 1 if the leader wants our response at once rather than coalesced.
+     * See raft_set_ack_delay */
+    int ack_now;
+    
+    /* the nodes the leader holds as learners. Followers take these on, so
+     * that every node agrees on who votes */
+    int n_learners;
+    int learners[RAFT_LEARNERS_MAX];
 } msg_appendentries_t;
 
 typedef struct {
     /* currentTerm, for leader to update itself */
-    int term;
+    raft_term_t term;
     
     /* success true if follower contained entry matching
      * prevLogidx and prevLogTerm */
@@ -70,11 +108,97 @@ typedef struct {
     /* Having the following fields allows us to do less book keeping in
      * regards to full fledged RPC */
     /* This is the highest log IDX we've received and appended to our log */
-    int current_idx;
+    raft_index_t current_idx;
     /* The first idx that we received within the appendentries message */
-    int first_idx;
+    raft_index_t first_idx;
+    /* the sender's quorum RTT in milliseconds, or -1 if it doesn't know.
+     * Lets the leader hand over to a better placed node */
+    int quorum_rtt;
+    
+    /* timestamp of the appendentries we are responding to */
+    int timestamp;
+    
+    /* milliseconds we may hold an ack for; see raft_set_ack_delay */
+    int ack_delay;
+    
+    /* an entry proposed to us, riding to the leader with the ack. See
+     * raft_forward_entry */
+    int n_proposals;
+    msg_entry_t proposal;
 } msg_appendentries_response_t;
 
+/* Snapshots are streamed in chunks no bigger than this, so that each
+ * installsnapshot message fits within a single BLE write */
+#define RAFT_SNAPSHOT_CHUNK_SIZE 20
+
+typedef struct {
+    raft_term_t term;
+    int leader_id;
+    
+    /* the snapshot replaces all entries up through and including this idx */
+    raft_index_t last_idx;
+    
+    /* term of the entry at last_idx */
+    raft_term_t last_term;
+    
+    /* byte offset of this chunk within the snapshot */
+    int offset;
+    
+    /* number of bytes of data that are valid */
+    int len;
+    
+    /* 1 if this is the last chunk of the snapshot */
+    int done;
+    
+    unsigned char data[RAFT_SNAPSHOT_CHUNK_SIZE];
+} msg_installsnapshot_t;
+
+typedef struct {
+    /* currentTerm, for leader to update itself */
+    raft_term_t term;
+    
+    /* the last_idx of the snapshot that we are acknowledging */
+    raft_index_t last_idx;
+    
+    /* number of contiguous bytes of the snapshot we hold. The leader resumes
+     * streaming from here, so a dropped transfer doesn't start over */
+    int offset;
+    
+    /* 1 if the snapshot has been restored into the state machine */
+    int complete;
+} msg_installsnapshot_response_t;
+
+/* Codecs for the compact wire encoding of appendentries messages */
+enum {
+    RAFT_CODEC_NONE = 0,
+    /* per-field deltas against the previous entry; needs an entry layout */
+    RAFT_CODEC_DELTA = 1,
+    /* LZ77 using the previous entry as the dictionary */
+    RAFT_CODEC_LZ = 2,
+    RAFT_CODEC_ALL = RAFT_CODEC_DELTA | RAFT_CODEC_LZ
+};
+
+/* Timestamps wrap at this many milliseconds, which keeps them to two bytes
+ * on the wire while dwarfing any RTT worth measuring */
+#define RAFT_TIMESTAMP_MASK 0x1fff
+
+/* Large enough for any encoded message. An appendentries' other fields
+ * take at most 81 bytes, its learners 41, and a delta encoded entry up to
+ * twice its size */
+#define RAFT_WIRE_MAX (129 + 2 * RAFT_ENTRY_SIZE)
+
+/* raft_recv_entry turned the entry away because too many entries are
+ * waiting to be committed. The capacity callback says when to retry */
+#define RAFT_ERR_BUSY -1
+
+/* What became of an entry passed to raft_recv_entry, as reported through
+ * the entry_done callback. An entry is lost when a new leader overwrote
+ * it. Its fate is unknown when a snapshot replaced our log before the
+ * entry was applied */
+#define RAFT_ENTRY_COMMITTED 1
+#define RAFT_ENTRY_LOST 0
+#define RAFT_ENTRY_UNKNOWN -1
+
 typedef void* raft_server_t;
 typedef void* raft_node_t;
 
@@ -127,6 +251,156 @@ msg_appendentries_response_t* msg
 );
 
 
+/**
+ * @param raft The Raft server making this callback
+ * @param node The peer's ID that we are sending this message to
+ * @return 0 on error */
+typedef int (
+*func_send_installsnapshot_f
+)   (
+raft_server_t* raft,
+int node,
+msg_installsnapshot_t* msg
+);
+
+/**
+ * @param raft The Raft server making this callback
+ * @param node The peer's ID that we are sending this message to
+ * @return 0 on error */
+typedef int (
+*func_send_installsnapshot_response_f
+)   (
+raft_server_t* raft,
+int node,
+msg_installsnapshot_response_t* msg
+);
+
+/**
+ * Serialise the state machine, as of the last applied entry, into a buffer.
+ * The buffer must be allocated with malloc; the Raft server takes ownership
+ * @param raft The Raft server making this callback
+ * @param data Set to the serialised state
+ * @param len Set to the number of bytes within data
+ * @return 0 on error */
+typedef int (
+*func_snapshot_save_f
+)   (
+raft_server_t* raft,
+unsigned char** data,
+int* len
+);
+
+/**
+ * Replace the state machine with the state held within a snapshot
+ * @param raft The Raft server making this callback
+ * @param data The serialised state
+ * @param len Number of bytes within data
+ * @return 0 on error */
+typedef int (
+*func_snapshot_load_f
+)   (
+raft_server_t* raft,
+unsigned char* data,
+int len
+);
+
+/**
+ * There is room for entries again after raft_recv_entry returned
+ * RAFT_ERR_BUSY, either because entries committed or because we are no
+ * longer the leader
+ * @param raft The Raft server making this callback */
+typedef void (
+*func_capacity_f
+)   (
+raft_server_t* raft
+);
+
+/**
+ * A follower has stayed further behind than the lag threshold for an
+ * election timeout, or has since caught up again
+ * @param raft The Raft server making this callback
+ * @param node The follower's index
+ * @param lagging 1 if it is lagging; 0 if it has caught up */
+typedef void (
+*func_node_lagging_f
+)   (
+raft_server_t* raft,
+int node,
+int lagging
+);
+
+/**
+ * Send the same appendentries message to several peers at once, e.g. as a
+ * single notification to all subscribed centrals or a multicast datagram.
+ * The message encodes the same for every peer in the group, so it need
+ * only be encoded once, for nodes[0]. Optional; without it every peer is
+ * sent its own copy with send_appendentries
+ * @param raft The Raft server making this callback
+ * @param nodes The peers' IDs that we are sending this message to
+ * @param nnodes Number of peers, at least two
+ * @return 0 on error */
+typedef int (
+*func_send_appendentries_broadcast_f
+)   (
+raft_server_t* raft,
+const int* nodes,
+int nnodes,
+msg_appendentries_t* msg
+);
+
+/**
+ * An entry passed to raft_recv_entry has been applied, or never will be.
+ * Entries are reported in the order they were proposed, and each exactly
+ * once; those proposed while we are leader keep being tracked if we are
+ * deposed. Entries passed to applylog_tentative are reported here too,
+ * once their fate is known, whether or not we lead. Optional
+ * @param raft The Raft server making this callback
+ * @param r The term and index raft_recv_entry gave the entry. For a
+ * tentative entry the leader never sent back, both are -1
+ * @param result RAFT_ENTRY_COMMITTED, RAFT_ENTRY_LOST or RAFT_ENTRY_UNKNOWN */
+typedef void (
+*func_entry_done_f
+)   (
+raft_server_t* raft,
+msg_entry_response_t* r,
+int result
+);
+
+/**
+ * Send an entry proposed to us on to the leader on its own, because no
+ * appendentries response has gone out for it to ride on within the
+ * forward timeout. The leader hands it to raft_recv_entry. Optional;
+ * without it proposals wait for the next appendentries response
+ * @param raft The Raft server making this callback
+ * @param node The leader's ID
+ * @param entry The proposed entry
+ * @return 0 on error */
+typedef int (
+*func_send_proposal_f
+)   (
+raft_server_t* raft,
+int node,
+msg_entry_t* entry
+);
+
+/**
+ * Apply an entry proposed to this server before it has committed, so that
+ * the client sees it without waiting on the cluster. Keep it apart from the
+ * state applylog builds: if it commits it is passed to applylog as usual,
+ * and entry_done then reports it, by r->id, as RAFT_ENTRY_COMMITTED. Any
+ * other result means it must be rolled back.
+ * Setting this callback, along with entry_done, turns speculation on
+ * @param raft The Raft server making this callback
+ * @param r Identifies the entry. idx is -1 while it waits on the leader
+ * @param entry The proposed entry */
+typedef void (
+*func_applylog_tentative_f
+)   (
+raft_server_t* raft,
+msg_entry_response_t* r,
+msg_entry_t* entry
+);
+
 /**
  * Apply this log to the state machine
  * @param raft The Raft server making this callback
@@ -145,23 +419,181 @@ typedef struct {
     func_send_appendentries_f send_appendentries;
     func_send_appendentries_response_f send_appendentries_response;
     func_applylog_f applylog;
+    func_send_installsnapshot_f send_installsnapshot;
+    func_send_installsnapshot_response_f send_installsnapshot_response;
+    func_snapshot_save_f snapshot_save;
+    func_snapshot_load_f snapshot_load;
+    func_capacity_f capacity;
+    func_node_lagging_f node_lagging;
+    func_send_appendentries_broadcast_f send_appendentries_broadcast;
+    func_entry_done_f entry_done;
+    func_send_proposal_f send_proposal;
+    func_applylog_tentative_f applylog_tentative;
 } raft_cbs_t;
 
+#ifdef RAFT_STATIC_HOOKS
+/* Build with RAFT_STATIC_HOOKS defined to bind the transport and state
+ * machine when the program is linked, rather than through raft_cbs_t. The
+ * program defines these, and the server calls them directly, so with link
+ * time optimisation they may be inlined into it. The matching members of
+ * raft_cbs_t are ignored. Every server in the program shares them, and
+ * servers can't be traced */
+int raft_hook_send_requestvote(raft_server_t* raft, int node,
+                               msg_requestvote_t* msg);
+int raft_hook_send_requestvote_response(raft_server_t* raft, int node,
+                                        msg_requestvote_response_t* msg);
+int raft_hook_send_appendentries(raft_server_t* raft, int node,
+                                 msg_appendentries_t* msg);
+int raft_hook_send_appendentries_response(raft_server_t* raft, int node,
+                                          msg_appendentries_response_t* msg);
+int raft_hook_send_installsnapshot(raft_server_t* raft, int node,
+                                   msg_installsnapshot_t* msg);
+int raft_hook_send_installsnapshot_response(raft_server_t* raft, int node,
+                                            msg_installsnapshot_response_t* msg);
+int raft_hook_applylog(raft_server_t* raft, msg_entry_t entry);
+#endif
+
 typedef struct {
     /* entry's term */
-    unsigned int term;
+    raft_term_t term;
     /* the underlying entry */
     msg_entry_t entry;
     /* number of nodes that have this entry */
     unsigned int num_nodes;
 } raft_entry_t;
 
+/**
+ * Store an entry. Entries are appended in order, without gaps
+ * @param store The storage backend's state
+ * @param idx The entry's index; one past the last entry stored
+ * @param term The entry's term. Always at least 1
+ * @return 0 on error */
+typedef int (
+*func_log_append_f
+)   (
+void* store,
+raft_index_t idx,
+raft_term_t term,
+const msg_entry_t* entry
+);
+
+/**
+ * @param store The storage backend's state
+ * @param idx The entry's index
+ * @param term Filled in with the entry's term
+ * @return the stored payload, which must not move until the entry is
+ * truncated away; NULL if the entry isn't stored */
+typedef msg_entry_t* (
+*func_log_get_f
+)   (
+void* store,
+raft_index_t idx,
+raft_term_t* term
+);
+
+/**
+ * Discard entries. For truncate_suffix, idx and every entry after it; for
+ * truncate_prefix, every entry up to and including idx, which may be past
+ * the last entry stored
+ * @param store The storage backend's state
+ * @param idx The entry's index */
+typedef void (
+*func_log_truncate_f
+)   (
+void* store,
+raft_index_t idx
+);
+
+/**
+ * Make everything appended so far durable. Called before we acknowledge
+ * entries
+ * @param store The storage backend's state
+ * @return 0 on error */
+typedef int (
+*func_log_sync_f
+)   (
+void* store
+);
+
+/**
+ * @param store The storage backend's state
+ * @param first Filled in with the index of the first entry stored
+ * @return number of entries stored */
+typedef raft_index_t (
+*func_log_range_f
+)   (
+void* store,
+raft_index_t* first
+);
+
+/**
+ * Durably record our term and who we voted for in it. Called before we act
+ * on either, so we never vote twice in a term across a restart
+ * @param store The storage backend's state
+ * @param voted_for Node we voted for; -1 if we haven't voted
+ * @return 0 on error */
+typedef int (
+*func_log_save_state_f
+)   (
+void* store,
+raft_term_t term,
+int voted_for
+);
+
+/**
+ * Fill in what save_state last recorded. Leave them be if nothing was
+ * @param store The storage backend's state */
+typedef void (
+*func_log_load_state_f
+)   (
+void* store,
+raft_term_t* term,
+int* voted_for
+);
+
+/**
+ * Release the backend's state
+ * @param store The storage backend's state */
+typedef void (
+*func_log_free_f
+)   (
+void* store
+);
+
+/* Where the log's entries are kept. sync, save_state and load_state may
+ * be NULL */
+typedef struct {
+    func_log_append_f append;
+    func_log_get_f get;
+    func_log_truncate_f truncate_suffix;
+    func_log_truncate_f truncate_prefix;
+    func_log_sync_f sync;
+    func_log_range_f range;
+    func_log_save_state_f save_state;
+    func_log_load_state_f load_state;
+    func_log_free_f free;
+} raft_log_ops_t;
+
 /**
  * Initialise a new Raft server
  *
  * @return newly initialised Raft server */
 raft_server_t* raft_new(int nodeid);
 
+/**
+ * Initialise a new Raft server whose log is kept by a storage backend.
+ * Entries the backend already holds are taken as our log, and the term and
+ * vote it saved as ours, so a server restarts where it left off. Snapshots
+ * aren't stored, so a log that was compacted can't be restarted from; this
+ * fails, and the server must start over with an empty log and be sent a
+ * snapshot. raft_new uses an in-memory backend
+ * @param ops The backend's functions
+ * @param store The backend's state. The server frees it, unless this fails
+ * @return newly initialised Raft server; NULL on error, or if the backend's
+ *  log doesn't start at the first entry */
+raft_server_t* raft_new_with_log(int nodeid, const raft_log_ops_t* ops,
+                                 void* store);
+
 /**
  * De-Initialise Raft server
  * Free all memory */
@@ -171,14 +603,26 @@ void raft_free(raft_server_t* me_);
  * Set callbacks.
  * Callbacks need to be set by the user for CRaft to work.
  *
- * @param funcs Callbacks
- * @param udata The context that we include when making a callback */
+ * @param funcs Callbacks */
 void raft_set_callbacks(raft_server_t* me, raft_cbs_t* funcs);
 
 /**
- * Set configuration
- * @param nodes Array of nodes. End of array is marked by NULL entry */
-void raft_set_configuration(raft_server_t* me_, int num_nodes);
+ * Set the context that callbacks can retrieve with raft_get_udata
+ * @param udata The context */
+void raft_set_udata(raft_server_t* me_, void* udata);
+
+/**
+ * @return the context set by raft_set_udata */
+void* raft_get_udata(raft_server_t* me_);
+
+/**
+ * Set configuration. Call once; nodes are then made learners with
+ * raft_set_learner, or their slots reused after raft_clear_node
+ * @param num_nodes Number of nodes in the cluster, including us
+ * @return 1 on success; 0 if we are configured already, if we ran out of
+ * memory, or if we were built with RAFT_NUM_NODES set to a different
+ * number */
+int raft_set_configuration(raft_server_t* me_, int num_nodes);
 
 /**
  * Set election timeout
@@ -213,6 +657,24 @@ int raft_recv_appendentries(raft_server_t* me, int node,
  * @return 0 on error */
 int raft_recv_appendentries_response(raft_server_t* me_,
                                      int node, msg_appendentries_response_t* r);
+/**
+ * Receive a chunk of a snapshot from the leader.
+ * Once the last chunk arrives the snapshot is restored into the state machine
+ * and replaces our log up through the snapshot's last_idx
+ * @param node Index of the node who sent us this message
+ * @param is The installsnapshot message
+ * @return 0 on error */
+int raft_recv_installsnapshot(raft_server_t* me_, int node,
+                              msg_installsnapshot_t* is);
+
+/**
+ * Receive a response from an installsnapshot message we sent
+ * @param node Index of the node who sent us this message
+ * @param r The installsnapshot response message
+ * @return 0 on error */
+int raft_recv_installsnapshot_response(raft_server_t* me_, int node,
+                                       msg_installsnapshot_response_t* r);
+
 /**
  * Receive a requestvote message
  * @param node Index of the node who sent us this message
@@ -234,8 +696,222 @@ int raft_recv_requestvote_response(raft_server_t* me, int node,
  * Append the entry to the log
  * Send appendentries to followers
  * @param node Index of the node who sent us this message
- * @param e The entry message */
-int raft_recv_entry(raft_server_t* me, int node, msg_entry_t* e);
+ * @param e The entry message
+ * @param r Set to the term and index the entry was appended at, which the
+ * entry_done callback reports it by. May be NULL
+ * @return 1 on success; RAFT_ERR_BUSY if the uncommitted limit has been
+ * reached; 0 on error */
+int raft_recv_entry(raft_server_t* me, int node, msg_entry_t* e,
+                    msg_entry_response_t* r);
+
+/**
+ * Receive an entry from a client while we may not be the leader. A
+ * follower holds on to it and sends it to the leader with its next
+ * appendentries response, saving a message. If no response goes out
+ * within the forward timeout, or the leader has already been quiet for
+ * that long, it is sent on its own with send_proposal.
+ * The leader passes it to raft_recv_entry, as it does entries it is
+ * given as leader. Like any message, the entry is lost if the message
+ * carrying it is. When speculating, the entry is applied tentatively
+ * here and now, and we watch for the leader sending it back
+ * @param e The entry message
+ * @return 1 on success; RAFT_ERR_BUSY if too many entries are waiting to
+ * be sent, or as raft_recv_entry; 0 on error */
+int raft_forward_entry(raft_server_t* me, msg_entry_t* e);
+
+/**
+ * Set how long an entry passed to raft_forward_entry may wait for an
+ * appendentries response to ride on
+ * @param msec Timeout in milliseconds */
+void raft_set_forward_timeout(raft_server_t* me_, int msec);
+
+/**
+ * Coalesce acks while following. Successful responses are held back and
+ * merged into one cumulative response, which goes out once the oldest has
+ * waited msec or nacks have been merged. The leader asks for an ack at once
+ * when it would complete the quorum it is waiting on to commit; rejections
+ * and responses carrying a proposal aren't held either, but commits may
+ * otherwise wait up to msec longer. Our responses tell the leader the
+ * delay, so that it doesn't resend entries whose acks we may be holding.
+ * Keep msec well below the leader's request timeout; held acks also add to
+ * the RTT it measures
+ * @param msec Longest an ack is held; 0 sends every response at once
+ * @param nacks Most acks merged into one response; 0 for no limit */
+void raft_set_ack_delay(raft_server_t* me_, int msec, int nacks);
+
+/**
+ * Limit how many entries may be appended but not yet committed. Entries
+ * beyond this are turned away with RAFT_ERR_BUSY rather than queued, so a
+ * slow quorum can't grow the log and commit latency without bound
+ * @param nentries Most uncommitted entries; 0 for no limit */
+void raft_set_uncommitted_limit(raft_server_t* me_, int nentries);
+
+/**
+ * Report followers that stay more than this many entries behind through
+ * the node_lagging callback
+ * @param nentries How far behind; 0 never reports */
+void raft_set_lag_threshold(raft_server_t* me_, int nentries);
+
+/**
+ * Snapshot the state machine as of the last applied entry, and compact the
+ * log up to that entry
+ * @return 0 on error */
+int raft_snapshot(raft_server_t* me_);
+
+/**
+ * Set the number of applied entries that may accumulate in the log before
+ * raft_periodic takes a snapshot automatically
+ * @param nentries Threshold in entries; 0 disables automatic snapshots */
+void raft_set_snapshot_threshold(raft_server_t* me_, int nentries);
+
+/**
+ * @return idx of the last entry included in our snapshot; -1 if none */
+raft_index_t raft_get_snapshot_last_idx(raft_server_t* me_);
+
+/**
+ * Make the node a learner. Learners are replicated to but don't vote and
+ * don't count towards commit. A learner is promoted to a voting member once
+ * its log is within the learner threshold of ours.
+ * Call this on the leader; the other nodes take on its learners from its
+ * appendentries. One change at a time: the node is left voting while an
+ * entry appended since the last promotion or demotion hasn't committed, or
+ * if RAFT_LEARNERS_MAX nodes are learners already. Likewise a learner is
+ * only promoted once the last change has committed. A node told it is a
+ * learner doesn't stand for election
+ * @param node The node's index
+ * @return 1 if the node is a learner; 0 if it is left voting, so call again
+ * later */
+int raft_set_learner(raft_server_t* me_, int node);
+
+/**
+ * Set how close a learner's log must be to ours before it is promoted
+ * @param nentries Number of entries the learner may still be missing */
+void raft_set_learner_threshold(raft_server_t* me_, int nentries);
+
+/**
+ * Configure catch-up mode. Followers further behind than the threshold are
+ * streamed contiguous entries without waiting for each ack, at no more than
+ * the given rate so that heartbeats and replication to other peers go on
+ * @param nentries How far behind a follower must be to be streamed to
+ * @param msgs_per_sec Catch-up messages we may send per second */
+void raft_set_catchup(raft_server_t* me_, int nentries, int msgs_per_sec);
+
+/**
+ * Enable codecs for the compact wire encoding. A codec is only used with a
+ * peer once that peer has advertised it in an appendentries response
+ * @param codecs Mask of RAFT_CODEC_* values; 0 sends entries verbatim */
+void raft_set_codecs(raft_server_t* me_, int codecs);
+
+/**
+ * Describe the fixed layout of entry payloads for RAFT_CODEC_DELTA.
+ * One character per field: 'b' int8, 'h' int16, 'i' int32, 'q' int64,
+ * 'f' float, 'd' double. Bytes past the last field are LZ encoded.
+ * All nodes must be configured with the same layout
+ * @return 0 if the layout is invalid or too large for an entry */
+int raft_set_entry_layout(raft_server_t* me_, const char* layout);
+
+/**
+ * Compact the log by key rather than through snapshot_save/snapshot_load,
+ * for state machines where an entry only matters until a later entry
+ * updates the same thing. Entries carry their key in a fixed range of
+ * bytes; a key of all zero bytes is no key, and such entries are never
+ * dropped. Snapshots then hold the applied entries that no later entry
+ * with the same key supersedes, and followers that fall behind the
+ * snapshot have these applied in order. All nodes must be configured with
+ * the same key
+ * @param offset Offset of the key within the entry's data
+ * @param len Length of the key in bytes; 0 turns key compaction off
+ * @return 0 if the key doesn't fit within an entry */
+int raft_set_compaction_key(raft_server_t* me_, int offset, int len);
+
+/**
+ * Encode an appendentries message for the wire
+ * @param node The peer's ID that we are sending this message to
+ * @param buf Buffer of at least RAFT_WIRE_MAX bytes
+ * @return number of bytes written; 0 on error */
+int raft_encode_appendentries(raft_server_t* me_, int node,
+                              msg_appendentries_t* ae,
+                              unsigned char* buf, int size);
+
+/**
+ * Decode an appendentries message received from the wire
+ * @param node Index of the node who sent us this message
+ * @return 0 on error */
+int raft_decode_appendentries(raft_server_t* me_, int node,
+                              const unsigned char* buf, int len,
+                              msg_appendentries_t* ae);
+
+/**
+ * Encode an appendentries response for the wire
+ * @param node The peer's ID that we are sending this message to
+ * @return number of bytes written; 0 on error */
+int raft_encode_appendentries_response(raft_server_t* me_, int node,
+                                       msg_appendentries_response_t* r,
+                                       unsigned char* buf, int size);
+
+/**
+ * Decode an appendentries response received from the wire
+ * @param node Index of the node who sent us this message
+ * @return 0 on error */
+int raft_decode_appendentries_response(raft_server_t* me_, int node,
+                                       const unsigned char* buf, int len,
+                                       msg_appendentries_response_t* r);
+
+/**
+ * Encode a requestvote message for the wire. With small terms and indices
+ * this fits the 20 bytes the fixed size message used to take
+ * @return number of bytes written; 0 on error */
+int raft_encode_requestvote(raft_server_t* me_, int node,
+                            msg_requestvote_t* rv,
+                            unsigned char* buf, int size);
+
+/**
+ * @return 0 on error */
+int raft_decode_requestvote(raft_server_t* me_, int node,
+                            const unsigned char* buf, int len,
+                            msg_requestvote_t* rv);
+
+/**
+ * @return number of bytes written; 0 on error */
+int raft_encode_requestvote_response(raft_server_t* me_, int node,
+                                     msg_requestvote_response_t* r,
+                                     unsigned char* buf, int size);
+
+/**
+ * @return 0 on error */
+int raft_decode_requestvote_response(raft_server_t* me_, int node,
+                                     const unsigned char* buf, int len,
+                                     msg_requestvote_response_t* r);
+
+/**
+ * Encode an installsnapshot message. Only the valid bytes of the chunk
+ * are sent
+ * @return number of bytes written; 0 on error */
+int raft_encode_installsnapshot(raft_server_t* me_, int node,
+                                msg_installsnapshot_t* is,
+                                unsigned char* buf, int size);
+
+/**
+ * @return 0 on error */
+int raft_decode_installsnapshot(raft_server_t* me_, int node,
+                                const unsigned char* buf, int len,
+                                msg_installsnapshot_t* is);
+
+/**
+ * @return number of bytes written; 0 on error */
+int raft_encode_installsnapshot_response(raft_server_t* me_, int node,
+                                         msg_installsnapshot_response_t* r,
+                                         unsigned char* buf, int size);
+
+/**
+ * @return 0 on error */
+int raft_decode_installsnapshot_response(raft_server_t* me_, int node,
+                                         const unsigned char* buf, int len,
+                                         msg_installsnapshot_response_t* r);
+
+/**
+ * @return number of voting nodes, including ourselves */
+int raft_get_num_voting_nodes(raft_server_t* me_);
 
 /**
  * @return the server's node ID */
@@ -255,11 +931,11 @@ int raft_get_log_count(raft_server_t* me);
 
 /**
  * @return current term */
-int raft_get_current_term(raft_server_t* me);
+raft_term_t raft_get_current_term(raft_server_t* me);
 
 /**
  * @return current log index */
-int raft_get_current_idx(raft_server_t* me);
+raft_index_t raft_get_current_idx(raft_server_t* me);
 
 /**
  * @return 1 if follower; 0 otherwise */
@@ -283,7 +959,7 @@ int raft_get_request_timeout(raft_server_t* me_);
 
 /**
  * @return index of last applied entry */
-int raft_get_last_applied_idx(raft_server_t* me);
+raft_index_t raft_get_last_applied_idx(raft_server_t* me);
 
 /**
  * @return 1 if node is leader; 0 otherwise */
@@ -291,12 +967,55 @@ int raft_node_is_leader(raft_node_t* node);
 
 /**
  * @return the node's next index */
-int raft_node_get_next_idx(raft_node_t* node);
+raft_index_t raft_node_get_next_idx(raft_node_t* node);
+
+/**
+ * @return 1 if node votes and counts towards commit; 0 if it is a learner */
+int raft_node_is_voting(raft_node_t* node);
+
+/**
+ * @return smoothed round trip time to the node in milliseconds; -1 if we
+ * haven't measured it */
+int raft_node_get_rtt(raft_node_t* node);
+
+/**
+ * @return smoothed fraction of requests to the node that went unanswered,
+ * in thousandths */
+int raft_node_get_loss(raft_node_t* node);
+
+/**
+ * @return entries per second the node has been acknowledging, smoothed */
+int raft_node_get_ack_rate(raft_node_t* node);
+
+/**
+ * Report a round trip to the node that the transport measured itself.
+ * We only time our own requests, and followers send none, so without this
+ * a follower knows nothing of its links until it leads
+ * @param node The node's index
+ * @param msec The round trip time; -1 if the request was lost */
+void raft_add_rtt_sample(raft_server_t* me_, int node, int msec);
+
+/**
+ * Commit latency is set by how long the slowest member of the fastest
+ * quorum takes to answer. Elections favour nodes for whom this is low
+ * @return that time in milliseconds, allowing for loss; -1 if we haven't
+ * measured enough of our peers */
+int raft_get_quorum_rtt(raft_server_t* me_);
+
+/**
+ * @param idx The entry's index
+ * @param ety Filled in with the entry
+ * @return 0 if we don't hold the entry */
+int raft_get_entry_from_idx(raft_server_t* me_, raft_index_t idx,
+                            raft_entry_t* ety);
 
 /**
+ * The pointer stays valid until the entry is compacted into a snapshot or
+ * deleted for conflicting with the leader's log, so it may be handed to
+ * consumers that outlive the call
  * @param idx The entry's index
- * @return entry from index */
-raft_entry_t* raft_get_entry_from_idx(raft_server_t* me_, int idx);
+ * @return payload of the entry; NULL if we don't hold it */
+msg_entry_t* raft_get_entry_data_from_idx(raft_server_t* me_, raft_index_t idx);
 
 /**
  * @param node The node's index
@@ -0,0 +1,553 @@
+#ifndef RAFT_HPP_
+#define RAFT_HPP_
+
+/**
+ * Copyright (c) 2013, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Header-only C++20 layer over the C Raft server
+ *
+ * raft::Server owns a raft_server_t and frees it along with everything it
+ * allocated. Its transport and state machine are whatever types model the
+ * raft::Transport and raft::StateMachine concepts. The server is a
+ * template over them, so each callback lands in a trampoline made for that
+ * type, which calls the member directly and can inline it; no event
+ * allocates. Built with RAFT_STATIC_HOOKS, the C server calls those
+ * trampolines directly too, rather than through its callback table; see
+ * RAFT_HOOKS. Proposals are awaitable from any coroutine type:
+ *
+ *     raft::Result r = co_await server.propose(entry);
+ *     if (raft::Outcome::committed == r.outcome)
+ *         ...
+ *
+ * The coroutine resumes once the entry has committed or is known to be
+ * lost. Coroutines are resumed after the server has finished handling the
+ * input that decided their entries, never from within it, so they may call
+ * back into the server. Anything not wrapped here is reached through c().
+ */
+
+extern "C" {
+#include "raft.h"
+}
+
+#include <algorithm>
+#include <cassert>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <utility>
+
+namespace raft {
+
+using Term = raft_term_t;
+using Index = raft_index_t;
+
+/**
+ * An entry's payload. Entries are a fixed size, so this is a plain value */
+class Entry
+{
+public:
+    static constexpr std::size_t size = sizeof(msg_entry_t::data);
+
+    Entry() noexcept : e_{} {}
+
+    explicit Entry(const msg_entry_t& e) noexcept : e_(e) {}
+
+    /**
+     * @param bytes At most 'size' bytes; the rest of the entry is zeroed */
+    explicit Entry(std::span<const std::byte> bytes) noexcept : e_{}
+    {
+        assert(bytes.size() <= size);
+        std::memcpy(e_.data, bytes.data(), std::min(bytes.size(), size));
+    }
+
+    std::span<std::byte, size> bytes() noexcept
+    {
+        return std::as_writable_bytes(std::span(e_.data));
+    }
+
+    std::span<const std::byte, size> bytes() const noexcept
+    {
+        return std::as_bytes(std::span(e_.data));
+    }
+
+    msg_entry_t* c() noexcept { return &e_; }
+    const msg_entry_t* c() const noexcept { return &e_; }
+
+private:
+    msg_entry_t e_;
+};
+
+/**
+ * Bytes allocated with malloc, so that the server can take them over, as
+ * it does a snapshot. Move-only; freed unless released */
+class Buffer
+{
+public:
+    Buffer() noexcept = default;
+
+    explicit Buffer(std::size_t len) :
+        data_(static_cast<unsigned char*>(std::malloc(len ? len : 1))),
+        len_(len)
+    {
+        if (!data_)
+            throw std::bad_alloc();
+    }
+
+    Buffer(Buffer&& o) noexcept :
+        data_(std::exchange(o.data_, nullptr)), len_(std::exchange(o.len_, 0))
+    {
+    }
+
+    Buffer& operator=(Buffer&& o) noexcept
+    {
+        if (this != &o)
+        {
+            std::free(data_);
+            data_ = std::exchange(o.data_, nullptr);
+            len_ = std::exchange(o.len_, 0);
+        }
+        return *this;
+    }
+
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+
+    ~Buffer() { std::free(data_); }
+
+    std::span<std::byte> bytes() noexcept
+    {
+        return std::as_writable_bytes(std::span(data_, len_));
+    }
+
+    std::size_t size() const noexcept { return len_; }
+
+    /**
+     * Give up the bytes, which the caller must now free */
+    unsigned char* release() noexcept
+    {
+        len_ = 0;
+        return std::exchange(data_, nullptr);
+    }
+
+private:
+    unsigned char* data_ = nullptr;
+    std::size_t len_ = 0;
+};
+
+/**
+ * What became of a proposal. The first three are as RAFT_ENTRY_* */
+enum class Outcome {
+    committed = RAFT_ENTRY_COMMITTED,
+    lost = RAFT_ENTRY_LOST,
+    unknown = RAFT_ENTRY_UNKNOWN,
+    /* turned away by admission control; see the capacity callback */
+    busy = 2,
+    /* only the leader takes proposals */
+    not_leader = 3,
+    error = 4
+};
+
+struct Result {
+    Outcome outcome;
+    /* where the entry was appended, if it was */
+    Term term;
+    Index idx;
+};
+
+/**
+ * Sends messages to peers. Each send returns false on error */
+template <class T>
+concept Transport = requires(T& t, int node,
+                             const msg_requestvote_t& rv,
+                             const msg_requestvote_response_t& rvr,
+                             const msg_appendentries_t& ae,
+                             const msg_appendentries_response_t& aer,
+                             const msg_installsnapshot_t& is,
+                             const msg_installsnapshot_response_t& isr) {
+    { t.send(node, rv) } -> std::convertible_to<bool>;
+    { t.send(node, rvr) } -> std::convertible_to<bool>;
+    { t.send(node, ae) } -> std::convertible_to<bool>;
+    { t.send(node, aer) } -> std::convertible_to<bool>;
+    { t.send(node, is) } -> std::convertible_to<bool>;
+    { t.send(node, isr) } -> std::convertible_to<bool>;
+};
+
+/**
+ * Applies committed entries. apply returns false on error */
+template <class T>
+concept StateMachine = requires(T& m, const Entry& e) {
+    { m.apply(e) } -> std::convertible_to<bool>;
+};
+
+/**
+ * A state machine that can be snapshotted, as snapshot_save and
+ * snapshot_load describe. The server only takes snapshots of these */
+template <class T>
+concept Snapshottable = StateMachine<T> &&
+    requires(T& m, std::span<const std::byte> bytes) {
+    { m.save() } -> std::same_as<Buffer>;
+    { m.load(bytes) } -> std::convertible_to<bool>;
+};
+
+template <Transport T, StateMachine M>
+class Server
+{
+public:
+    class Proposal;
+
+    /**
+     * @param nodeid Our ID among the nodes
+     * @param num_nodes Number of nodes in the cluster, including us */
+    Server(int nodeid, int num_nodes, T& transport, M& machine) :
+        raft_(static_cast<raft_server_t*>(raft_new(nodeid))),
+        transport_(transport), machine_(machine)
+    {
+        raft_cbs_t cbs = {};
+
+        if (!raft_)
+            throw std::bad_alloc();
+
+#ifndef RAFT_STATIC_HOOKS
+        cbs.send_requestvote = &Hooks::send;
+        cbs.send_requestvote_response = &Hooks::send;
+        cbs.send_appendentries = &Hooks::send;
+        cbs.send_appendentries_response = &Hooks::send;
+        cbs.send_installsnapshot = &Hooks::send;
+        cbs.send_installsnapshot_response = &Hooks::send;
+        cbs.applylog = &Hooks::apply;
+#endif
+        cbs.entry_done =
+            [](raft_server_t* r, msg_entry_response_t* res, int result) {
+                self_(r).finish_(*res, static_cast<Outcome>(result));
+            };
+        if constexpr (Snapshottable<M>)
+        {
+            cbs.snapshot_save = [](raft_server_t* r, unsigned char** data,
+                                   int* len) {
+                Buffer b = self_(r).machine_.save();
+                *len = static_cast<int>(b.size());
+                *data = b.release();
+                return *data ? 1 : 0;
+            };
+            cbs.snapshot_load = [](raft_server_t* r, unsigned char* data,
+                                   int len) {
+                return self_(r).machine_.load(std::as_bytes(
+                    std::span(data, static_cast<std::size_t>(len)))) ? 1 : 0;
+            };
+        }
+
+        raft_set_callbacks(c(), &cbs);
+        raft_set_udata(c(), this);
+        if (!raft_set_configuration(c(), num_nodes))
+            throw std::invalid_argument("built for another number of nodes");
+    }
+
+    /* the C server points back at us */
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    /**
+     * Coroutines still waiting on proposals are never resumed */
+    ~Server()
+    {
+        for (Proposal* p = pending_; p; p = p->next_)
+            p->server_ = nullptr;
+        for (Proposal* p = ready_; p; p = p->next_)
+            p->server_ = nullptr;
+    }
+
+    /**
+     * Propose an entry when awaited. The awaiting coroutine resumes with
+     * the entry's Result once it commits or is lost, or at once if we
+     * can't take it
+     * @return an awaitable yielding a Result */
+    Proposal propose(const Entry& e) noexcept { return Proposal(*this, e); }
+
+    /**
+     * @param bytes At most Entry::size bytes */
+    Proposal propose(std::span<const std::byte> bytes) noexcept
+    {
+        return Proposal(*this, Entry(bytes));
+    }
+
+    int periodic(int msec) { return input_(raft_periodic(c(), msec)); }
+
+    int recv(int node, msg_requestvote_t m)
+    {
+        return input_(raft_recv_requestvote(c(), node, &m));
+    }
+
+    int recv(int node, msg_requestvote_response_t m)
+    {
+        return input_(raft_recv_requestvote_response(c(), node, &m));
+    }
+
+    int recv(int node, msg_appendentries_t m)
+    {
+        return input_(raft_recv_appendentries(c(), node, &m));
+    }
+
+    int recv(int node, msg_appendentries_response_t m)
+    {
+        return input_(raft_recv_appendentries_response(c(), node, &m));
+    }
+
+    int recv(int node, msg_installsnapshot_t m)
+    {
+        return input_(raft_recv_installsnapshot(c(), node, &m));
+    }
+
+    int recv(int node, msg_installsnapshot_response_t m)
+    {
+        return input_(raft_recv_installsnapshot_response(c(), node, &m));
+    }
+
+    void become_candidate()
+    {
+        raft_become_candidate(c());
+        input_(1);
+    }
+
+    bool is_leader() const noexcept { return raft_is_leader(c()); }
+    int nodeid() const noexcept { return raft_get_nodeid(c()); }
+    Term current_term() const noexcept { return raft_get_current_term(c()); }
+    Index current_idx() const noexcept { return raft_get_current_idx(c()); }
+    Index last_applied_idx() const noexcept
+    {
+        return raft_get_last_applied_idx(c());
+    }
+
+    /**
+     * @return the C server, for what isn't wrapped here. Its callbacks and
+     * udata belong to us */
+    raft_server_t* c() const noexcept { return raft_.get(); }
+
+    /**
+     * The transport's and state machine's callbacks, which call their
+     * members directly */
+    struct Hooks
+    {
+        template <class Msg>
+        static int send(raft_server_t* r, int node, Msg* m)
+        {
+            return self_(r).transport_.send(node, *m) ? 1 : 0;
+        }
+
+        static int apply(raft_server_t* r, msg_entry_t e)
+        {
+            return self_(r).machine_.apply(Entry(e)) ? 1 : 0;
+        }
+    };
+
+    class Proposal
+    {
+    public:
+        Proposal(const Proposal&) = delete;
+        Proposal& operator=(const Proposal&) = delete;
+
+        ~Proposal()
+        {
+            if (server_ && linked_)
+                server_->unlink_(this);
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        /**
+         * @return false to carry on at once, having not been queued */
+        bool await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            raft_server_t* raft = server_->c();
+            msg_entry_response_t r;
+            int e;
+
+            if (!raft_is_leader(raft))
+            {
+                result_.outcome = Outcome::not_leader;
+                return false;
+            }
+
+            /* entry_done may report the entry before raft_recv_entry
+             * returns, so be ready for it by where it will be appended */
+            handle_ = h;
+            result_.term = raft_get_current_term(raft);
+            result_.idx = raft_get_current_idx(raft);
+            server_->link_(this);
+
+            e = raft_recv_entry(raft, raft_get_nodeid(raft), entry_.c(), &r);
+            if (1 != e)
+            {
+                server_->unlink_(this);
+                result_.outcome = RAFT_ERR_BUSY == e ? Outcome::busy
+                                                     : Outcome::error;
+                return false;
+            }
+            if (done_)
+            {
+                server_->unlink_(this);
+                return false;
+            }
+            return true;
+        }
+
+        Result await_resume() const noexcept { return result_; }
+
+    private:
+        friend class Server;
+
+        Proposal(Server& server, const Entry& e) noexcept :
+            server_(&server), entry_(e)
+        {
+        }
+
+        Server* server_;
+        Entry entry_;
+        Result result_ = { Outcome::error, -1, -1 };
+        std::coroutine_handle<> handle_;
+        bool linked_ = false;
+        bool done_ = false;
+
+        /* in the server's pending list, oldest first, then its ready list */
+        Proposal* prev_ = nullptr;
+        Proposal* next_ = nullptr;
+    };
+
+private:
+    struct Free {
+        void operator()(raft_server_t* r) const noexcept { raft_free(r); }
+    };
+
+    static Server& self_(raft_server_t* r) noexcept
+    {
+        return *static_cast<Server*>(raft_get_udata(r));
+    }
+
+    void link_(Proposal* p) noexcept
+    {
+        p->prev_ = pending_tail_;
+        p->next_ = nullptr;
+        if (pending_tail_)
+            pending_tail_->next_ = p;
+        else
+            pending_ = p;
+        pending_tail_ = p;
+        p->linked_ = true;
+    }
+
+    /**
+     * Take a proposal off whichever list holds it */
+    void unlink_(Proposal* p) noexcept
+    {
+        if (p->done_)
+        {
+            Proposal** pp = &ready_;
+            while (*pp != p)
+                pp = &(*pp)->next_;
+            *pp = p->next_;
+        }
+        else
+        {
+            if (p->prev_)
+                p->prev_->next_ = p->next_;
+            else
+                pending_ = p->next_;
+            if (p->next_)
+                p->next_->prev_ = p->prev_;
+            else
+                pending_tail_ = p->prev_;
+        }
+        p->linked_ = false;
+    }
+
+    /**
+     * Entries are reported in the order they were proposed, except that
+     * those a new leader overwrote go newest first. Either way the
+     * proposal is usually at one end of the list */
+    void finish_(const msg_entry_response_t& r, Outcome outcome) noexcept
+    {
+        Proposal* p = pending_;
+
+        if (pending_tail_ && pending_tail_->result_.idx == r.idx)
+            p = pending_tail_;
+        while (p && !(p->result_.idx == r.idx && p->result_.term == r.term))
+            p = p->next_;
+
+        /* not one of ours; it was proposed through the C API, or by a
+         * follower */
+        if (!p)
+            return;
+
+        unlink_(p);
+        p->result_.outcome = outcome;
+        p->done_ = true;
+        p->next_ = ready_;
+        ready_ = p;
+        p->linked_ = true;
+    }
+
+    /**
+     * Resume the coroutines whose entries the last input decided */
+    int input_(int res)
+    {
+        while (ready_)
+        {
+            Proposal* p = ready_;
+            ready_ = p->next_;
+            p->linked_ = false;
+            p->handle_.resume();
+        }
+        return res;
+    }
+
+    std::unique_ptr<raft_server_t, Free> raft_;
+    T& transport_;
+    M& machine_;
+
+    Proposal* pending_ = nullptr;
+    Proposal* pending_tail_ = nullptr;
+    Proposal* ready_ = nullptr;
+};
+
+} /* namespace raft */
+
+#ifdef RAFT_STATIC_HOOKS
+/**
+ * Define the C server's hooks as the callbacks of a Server type. Use it
+ * once in the program, at namespace scope; every server in the program
+ * must be of that type:
+ *
+ *     RAFT_HOOKS(raft::Server<Udp, Kv>)
+ */
+#define RAFT_HOOKS(...) \
+    extern "C" int raft_hook_send_requestvote(raft_server_t* r, int node, \
+        msg_requestvote_t* m) \
+    { return __VA_ARGS__::Hooks::send(r, node, m); } \
+    extern "C" int raft_hook_send_requestvote_response(raft_server_t* r, \
+        int node, msg_requestvote_response_t* m) \
+    { return __VA_ARGS__::Hooks::send(r, node, m); } \
+    extern "C" int raft_hook_send_appendentries(raft_server_t* r, int node, \
+        msg_appendentries_t* m) \
+    { return __VA_ARGS__::Hooks::send(r, node, m); } \
+    extern "C" int raft_hook_send_appendentries_response(raft_server_t* r, \
+        int node, msg_appendentries_response_t* m) \
+    { return __VA_ARGS__::Hooks::send(r, node, m); } \
+    extern "C" int raft_hook_send_installsnapshot(raft_server_t* r, int node, \
+        msg_installsnapshot_t* m) \
+    { return __VA_ARGS__::Hooks::send(r, node, m); } \
+    extern "C" int raft_hook_send_installsnapshot_response(raft_server_t* r, \
+        int node, msg_installsnapshot_response_t* m) \
+    { return __VA_ARGS__::Hooks::send(r, node, m); } \
+    extern "C" int raft_hook_applylog(raft_server_t* r, msg_entry_t e) \
+    { return __VA_ARGS__::Hooks::apply(r, e); }
+#endif
+
+#endif /* RAFT_HPP_ */
@@ -0,0 +1,739 @@
+/**
+ * Copyright (c) 2013, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Compact wire encoding of Raft messages
+ * @version 0.1
+ *
+ * Terms, indices and other header fields are sent as zigzag varints, so
+ * their 64 bit width costs nothing until values grow. The entry itself is encoded
+ * against the entry at prev_log_idx, which the follower must already hold
+ * for it to accept the message; by the Log Matching property both copies
+ * are identical, so the follower can decode against its own log.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include "raft.h"
+#include "raft_log.h"
+#include "raft_private.h"
+
+/* first byte of an encoded appendentries */
+#define CODEC_MASK          0x0f
+#define CODEC_HAS_REF       0x10
+#define CODEC_HAS_LEARNERS  0x20
+#define CODEC_ACK_NOW       0x40
+
+/* first byte of an encoded appendentries response */
+#define CODEC_MISSING_REF   0x80
+#define CODEC_HAS_PROPOSAL  0x40
+#define CODEC_ACK_DELAY     0x20
+
+/* LZ tokens: a literal run, or a match against earlier bytes */
+#define LZ_MATCH            0x80
+#define LZ_MIN_MATCH        3
+
+static int __put_varint(unsigned char* buf, int size, int* pos, uint64_t v)
+{
+    do
+    {
+        if (size <= *pos)
+            return 0;
+        buf[(*pos)++] = (v & 0x7f) | (0x7f < v ? 0x80 : 0);
+        v >>= 7;
+    }
+    while (v);
+    return 1;
+}
+
+static int __get_varint(const unsigned char* buf, int len, int* pos, uint64_t* v)
+{
+    int shift;
+
+    for (*v = 0, shift = 0; shift < 64; shift += 7)
+    {
+        if (len <= *pos)
+            return 0;
+        *v |= (uint64_t)(buf[*pos] & 0x7f) << shift;
+        if (!(buf[(*pos)++] & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+static int __put_int(unsigned char* buf, int size, int* pos, int64_t v)
+{
+    return __put_varint(buf, size, pos, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static int __get_int(const unsigned char* buf, int len, int* pos, int64_t* v)
+{
+    uint64_t u;
+
+    if (!__get_varint(buf, len, pos, &u))
+        return 0;
+    *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+    return 1;
+}
+
+static int __field_width(char type)
+{
+    switch (type)
+    {
+        case 'b': return 1;
+        case 'h': return 2;
+        case 'i': case 'f': return 4;
+        case 'q': case 'd': return 8;
+        default: return 0;
+    }
+}
+
+/* read a field as a sign extended integer, or as raw bits for floats */
+static uint64_t __field_read(char type, const unsigned char* p)
+{
+    int8_t b; int16_t h; int32_t i; int64_t q; uint32_t f; uint64_t d;
+
+    switch (type)
+    {
+        case 'b': memcpy(&b, p, 1); return (uint64_t)(int64_t)b;
+        case 'h': memcpy(&h, p, 2); return (uint64_t)(int64_t)h;
+        case 'i': memcpy(&i, p, 4); return (uint64_t)(int64_t)i;
+        case 'q': memcpy(&q, p, 8); return (uint64_t)q;
+        case 'f': memcpy(&f, p, 4); return f;
+        default: memcpy(&d, p, 8); return d;
+    }
+}
+
+static void __field_write(char type, unsigned char* p, uint64_t v)
+{
+    int8_t b = v; int16_t h = v; int32_t i = v; uint32_t f = v;
+
+    switch (type)
+    {
+        case 'b': memcpy(p, &b, 1); break;
+        case 'h': memcpy(p, &h, 2); break;
+        case 'i': memcpy(p, &i, 4); break;
+        case 'f': memcpy(p, &f, 4); break;
+        default: memcpy(p, &v, 8); break;
+    }
+}
+
+/**
+ * Float fields are XORed with the reference. Coordinates and the like tend
+ * to differ in a few high mantissa bits with zeros below, so strip whole
+ * trailing zero bytes. Their count goes in the low 3 bits of the first byte,
+ * alongside the low 5 bits of what remains */
+static int __put_xor(unsigned char* buf, int size, int* pos, uint64_t x)
+{
+    int tz = 0;
+
+    while (x && !(x & 0xff))
+    {
+        x >>= 8;
+        tz++;
+    }
+    if (size <= *pos)
+        return 0;
+    buf[(*pos)++] = tz | (x & 0x1f) << 3;
+    return __put_varint(buf, size, pos, x >> 5);
+}
+
+static int __get_xor(const unsigned char* buf, int len, int* pos, uint64_t* x)
+{
+    int c;
+
+    if (len <= *pos)
+        return 0;
+    c = buf[(*pos)++];
+    if (!__get_varint(buf, len, pos, x))
+        return 0;
+    *x = (*x << 5 | c >> 3) << (8 * (c & 7));
+    return 1;
+}
+
+/**
+ * LZ77 over a window made of the reference bytes followed by the data, so
+ * repeats of the reference cost a couple of bytes */
+static int __lz_encode(const unsigned char* ref, const unsigned char* data,
+                       int n, unsigned char* buf, int size, int* pos)
+{
+    unsigned char win[2 * sizeof(msg_entry_t)];
+    int m = ref ? n : 0;
+    int i, lit = -1;
+
+    assert(n <= (int)sizeof(msg_entry_t));
+    if (ref)
+        memcpy(win, ref, n);
+    memcpy(win + m, data, n);
+
+    for (i = m; i < m + n; )
+    {
+        int j, best_len = 0, best_off = 0;
+
+        /* offsets take a byte */
+        for (j = 0xff < i ? i - 0xff : 0; j < i; j++)
+        {
+            int k = 0;
+            while (i + k < m + n && k < 0x7f + LZ_MIN_MATCH && win[j + k] == win[i + k])
+                k++;
+            if (best_len < k)
+            {
+                best_len = k;
+                best_off = i - j;
+            }
+        }
+
+        if (LZ_MIN_MATCH <= best_len)
+        {
+            if (*pos + 2 > size)
+                return 0;
+            buf[(*pos)++] = LZ_MATCH | (best_len - LZ_MIN_MATCH);
+            buf[(*pos)++] = best_off;
+            i += best_len;
+            lit = -1;
+        }
+        else
+        {
+            /* extend the current literal run */
+            if (lit == -1 || buf[lit] == 0x7f)
+            {
+                if (size <= *pos)
+                    return 0;
+                lit = (*pos)++;
+                buf[lit] = 0xff;
+            }
+            if (size <= *pos)
+                return 0;
+            buf[lit] = (unsigned char)(buf[lit] + 1);
+            buf[(*pos)++] = win[i++];
+        }
+    }
+    return 1;
+}
+
+static int __lz_decode(const unsigned char* ref, unsigned char* data, int n,
+                       const unsigned char* buf, int len, int* pos)
+{
+    unsigned char win[2 * sizeof(msg_entry_t)];
+    int m = ref ? n : 0;
+    int i = m;
+
+    if (ref)
+        memcpy(win, ref, n);
+
+    while (i < m + n)
+    {
+        int c, k;
+
+        if (len <= *pos)
+            return 0;
+        c = buf[(*pos)++];
+
+        if (c & LZ_MATCH)
+        {
+            int run = (c & 0x7f) + LZ_MIN_MATCH, off;
+            if (len <= *pos)
+                return 0;
+            off = buf[(*pos)++];
+            if (off == 0 || i < off || m + n < i + run)
+                return 0;
+            for (k = 0; k < run; k++, i++)
+                win[i] = win[i - off];
+        }
+        else
+        {
+            int run = c + 1;
+            if (m + n < i + run || len < *pos + run)
+                return 0;
+            memcpy(win + i, buf + *pos, run);
+            *pos += run;
+            i += run;
+        }
+    }
+
+    memcpy(data, win + m, n);
+    return 1;
+}
+
+/**
+ * Per-field delta against the reference: zigzag deltas for integers, XOR
+ * for floats. Bytes past the described fields are LZ encoded */
+static int __delta_encode(const char* layout, const unsigned char* ref,
+                          const unsigned char* data, unsigned char* buf,
+                          int size, int* pos)
+{
+    static const unsigned char zero[sizeof(msg_entry_t)];
+    int off = 0;
+
+    if (!ref)
+        ref = zero;
+
+    for (; *layout; layout++)
+    {
+        char type = *layout;
+        uint64_t cur = __field_read(type, data + off);
+        uint64_t prev = __field_read(type, ref + off);
+
+        if (type == 'f' || type == 'd')
+        {
+            if (!__put_xor(buf, size, pos, cur ^ prev))
+                return 0;
+        }
+        else if (!__put_int(buf, size, pos, (int64_t)(cur - prev)))
+            return 0;
+        off += __field_width(type);
+    }
+
+    return __lz_encode(ref + off, data + off, sizeof(msg_entry_t) - off,
+                       buf, size, pos);
+}
+
+static int __delta_decode(const char* layout, const unsigned char* ref,
+                          unsigned char* data, const unsigned char* buf,
+                          int len, int* pos)
+{
+    static const unsigned char zero[sizeof(msg_entry_t)];
+    int off = 0;
+
+    if (!ref)
+        ref = zero;
+
+    for (; *layout; layout++)
+    {
+        char type = *layout;
+        uint64_t prev = __field_read(type, ref + off);
+        uint64_t v;
+
+        if (type == 'f' || type == 'd')
+        {
+            if (!__get_xor(buf, len, pos, &v))
+                return 0;
+            v ^= prev;
+        }
+        else
+        {
+            int64_t delta;
+            if (!__get_int(buf, len, pos, &delta))
+                return 0;
+            v = prev + (uint64_t)delta;
+        }
+        __field_write(type, data + off, v);
+        off += __field_width(type);
+    }
+
+    return __lz_decode(ref + off, data + off, sizeof(msg_entry_t) - off,
+                       buf, len, pos);
+}
+
+void raft_set_codecs(raft_server_t* me_, int codecs)
+{
+    raft_server_private_t* me = (void*)me_;
+    me->codecs = codecs & RAFT_CODEC_ALL;
+}
+
+int raft_set_entry_layout(raft_server_t* me_, const char* layout)
+{
+    raft_server_private_t* me = (void*)me_;
+    int i, width;
+
+    for (i = 0, width = 0; layout[i]; i++)
+    {
+        if (0 == __field_width(layout[i]))
+            return 0;
+        width += __field_width(layout[i]);
+    }
+    if ((int)sizeof(msg_entry_t) < width)
+        return 0;
+
+    memcpy(me->entry_layout, layout, i + 1);
+    return 1;
+}
+
+int raft_encode_appendentries(raft_server_t* me_, int node,
+                              msg_appendentries_t* ae,
+                              unsigned char* buf, int size)
+{
+    raft_server_private_t* me = (void*)me_;
+    raft_node_t* p = raft_get_node(me_, node);
+    msg_entry_t* ref = NULL;
+    int codecs, codec, pos = 1;
+
+    if (size < 1 || !p)
+        return 0;
+
+    /* only use what both of us have enabled */
+    codecs = me->codecs & raft_node_get_codecs(p);
+    if ((codecs & RAFT_CODEC_DELTA) && me->entry_layout[0])
+        codec = RAFT_CODEC_DELTA;
+    else if (codecs & RAFT_CODEC_LZ)
+        codec = RAFT_CODEC_LZ;
+    else
+        codec = RAFT_CODEC_NONE;
+
+    /* the node told us it doesn't hold this entry */
+    if (raft_node_get_codec_noref_idx(p) < ae->prev_log_idx)
+        ref = log_get_entry(me->log, ae->prev_log_idx);
+
+    buf[0] = codec | (ref ? CODEC_HAS_REF : 0) |
+             (ae->n_learners ? CODEC_HAS_LEARNERS : 0) |
+             (ae->ack_now ? CODEC_ACK_NOW : 0);
+
+    if (!__put_int(buf, size, &pos, ae->term) ||
+        !__put_int(buf, size, &pos, ae->leader_id) ||
+        !__put_int(buf, size, &pos, ae->prev_log_idx) ||
+        !__put_int(buf, size, &pos, ae->prev_log_term) ||
+        !__put_int(buf, size, &pos, ae->n_entries) ||
+        !__put_int(buf, size, &pos, ae->leader_commit) ||
+        !__put_int(buf, size, &pos, ae->timestamp))
+        return 0;
+
+    /* the learners are usually none, which costs nothing */
+    if (ae->n_learners)
+    {
+        int i;
+
+        if (!__put_int(buf, size, &pos, ae->n_learners))
+            return 0;
+        for (i = 0; i < ae->n_learners; i++)
+            if (!__put_int(buf, size, &pos, ae->learners[i]))
+                return 0;
+    }
+
+    if (0 == ae->n_entries)
+        return pos;
+
+    if (!__put_int(buf, size, &pos, ae->entry_term))
+        return 0;
+
+    switch (codec)
+    {
+        case RAFT_CODEC_DELTA:
+            if (!__delta_encode(me->entry_layout, ref ? ref->data : NULL,
+                                ae->entry.data, buf, size, &pos))
+                return 0;
+            break;
+        case RAFT_CODEC_LZ:
+            if (!__lz_encode(ref ? ref->data : NULL, ae->entry.data,
+                             sizeof(msg_entry_t), buf, size, &pos))
+                return 0;
+            break;
+        default:
+            if (size < pos + (int)sizeof(msg_entry_t))
+                return 0;
+            memcpy(buf + pos, ae->entry.data, sizeof(msg_entry_t));
+            pos += sizeof(msg_entry_t);
+            break;
+    }
+
+    return pos;
+}
+
+int raft_decode_appendentries(raft_server_t* me_, int node,
+                              const unsigned char* buf, int len,
+                              msg_appendentries_t* ae)
+{
+    raft_server_private_t* me = (void*)me_;
+    msg_entry_t* ref = NULL;
+    int64_t v[8];
+    int i, codec, pos = 1;
+
+    if (len < 1)
+        return 0;
+    codec = buf[0] & CODEC_MASK;
+
+    for (i = 0; i < 7; i++)
+        if (!__get_int(buf, len, &pos, &v[i]))
+            return 0;
+
+    memset(ae, 0, sizeof(msg_appendentries_t));
+    ae->term = v[0];
+    ae->leader_id = v[1];
+    ae->prev_log_idx = v[2];
+    ae->prev_log_term = v[3];
+    ae->n_entries = v[4];
+    ae->leader_commit = v[5];
+    ae->timestamp = v[6];
+    ae->ack_now = !!(buf[0] & CODEC_ACK_NOW);
+
+    if (buf[0] & CODEC_HAS_LEARNERS)
+    {
+        if (!__get_int(buf, len, &pos, &v[7]) ||
+            v[7] < 0 || RAFT_LEARNERS_MAX < v[7])
+            return 0;
+        ae->n_learners = v[7];
+        for (i = 0; i < ae->n_learners; i++)
+        {
+            if (!__get_int(buf, len, &pos, &v[7]))
+                return 0;
+            ae->learners[i] = v[7];
+        }
+    }
+
+    if (0 == ae->n_entries)
+        return 1;
+
+    if (!__get_int(buf, len, &pos, &v[7]))
+        return 0;
+    ae->entry_term = v[7];
+
+    if (buf[0] & CODEC_HAS_REF)
+    {
+        /* we can't rebuild the entry without the one before it. Deliver
+         * what we have as a heartbeat; our response asks the leader to
+         * resend without the reference */
+        if (!(ref = log_get_entry(me->log, ae->prev_log_idx)))
+        {
+            me->codec_missing_ref = 1;
+            ae->n_entries = 0;
+            return 1;
+        }
+    }
+
+    switch (codec)
+    {
+        case RAFT_CODEC_DELTA:
+            return __delta_decode(me->entry_layout, ref ? ref->data : NULL,
+                                  ae->entry.data, buf, len, &pos);
+        case RAFT_CODEC_LZ:
+            return __lz_decode(ref ? ref->data : NULL, ae->entry.data,
+                               sizeof(msg_entry_t), buf, len, &pos);
+        case RAFT_CODEC_NONE:
+            if (len < pos + (int)sizeof(msg_entry_t))
+                return 0;
+            memcpy(ae->entry.data, buf + pos, sizeof(msg_entry_t));
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int raft_encode_appendentries_response(raft_server_t* me_, int node,
+                                       msg_appendentries_response_t* r,
+                                       unsigned char* buf, int size)
+{
+    raft_server_private_t* me = (void*)me_;
+    int pos = 1;
+
+    if (size < 1)
+        return 0;
+
+    /* advertise what we can decode */
+    buf[0] = me->codecs | (me->codec_missing_ref ? CODEC_MISSING_REF : 0) |
+             (r->n_proposals ? CODEC_HAS_PROPOSAL : 0) |
+             (r->ack_delay ? CODEC_ACK_DELAY : 0);
+    me->codec_missing_ref = 0;
+
+    if (!__put_int(buf, size, &pos, r->term) ||
+        !__put_int(buf, size, &pos, r->success) ||
+        !__put_int(buf, size, &pos, r->current_idx) ||
+        !__put_int(buf, size, &pos, r->first_idx) ||
+        !__put_int(buf, size, &pos, r->quorum_rtt) ||
+        !__put_int(buf, size, &pos, r->timestamp))
+        return 0;
+    if (r->ack_delay && !__put_int(buf, size, &pos, r->ack_delay))
+        return 0;
+
+    /* the proposal goes verbatim; we don't know what the leader decodes */
+    if (r->n_proposals)
+    {
+        if (size < pos + (int)sizeof(msg_entry_t))
+            return 0;
+        memcpy(buf + pos, r->proposal.data, sizeof(msg_entry_t));
+        pos += sizeof(msg_entry_t);
+    }
+    return pos;
+}
+
+int raft_decode_appendentries_response(raft_server_t* me_, int node,
+                                       const unsigned char* buf, int len,
+                                       msg_appendentries_response_t* r)
+{
+    raft_node_t* p = raft_get_node(me_, node);
+    int64_t v[7];
+    int i, pos = 1;
+
+    if (len < 1 || !p)
+        return 0;
+
+    for (i = 0; i < 6; i++)
+        if (!__get_int(buf, len, &pos, &v[i]))
+            return 0;
+    v[6] = 0;
+    if ((buf[0] & CODEC_ACK_DELAY) && !__get_int(buf, len, &pos, &v[6]))
+        return 0;
+
+    r->term = v[0];
+    r->success = v[1];
+    r->current_idx = v[2];
+    r->first_idx = v[3];
+    r->quorum_rtt = v[4];
+    r->timestamp = v[5];
+    r->ack_delay = v[6];
+
+    r->n_proposals = 0;
+    if (buf[0] & CODEC_HAS_PROPOSAL)
+    {
+        if (len < pos + (int)sizeof(msg_entry_t))
+            return 0;
+        memcpy(r->proposal.data, buf + pos, sizeof(msg_entry_t));
+        r->n_proposals = 1;
+    }
+
+    raft_node_set_codecs(p, buf[0] & RAFT_CODEC_ALL);
+
+    /* entries up to where the node's log ends can't be encoded against */
+    if (buf[0] & CODEC_MISSING_REF)
+        raft_node_set_codec_noref_idx(p, r->current_idx);
+    return 1;
+}
+
+int raft_encode_requestvote(raft_server_t* me_, int node,
+                            msg_requestvote_t* rv,
+                            unsigned char* buf, int size)
+{
+    int pos = 0;
+
+    if (!__put_int(buf, size, &pos, rv->term) ||
+        !__put_int(buf, size, &pos, rv->last_log_idx) ||
+        size < pos + (int)sizeof(rv->uuid))
+        return 0;
+    memcpy(buf + pos, rv->uuid, sizeof(rv->uuid));
+    return pos + sizeof(rv->uuid);
+}
+
+int raft_decode_requestvote(raft_server_t* me_, int node,
+                            const unsigned char* buf, int len,
+                            msg_requestvote_t* rv)
+{
+    int64_t term, idx;
+    int pos = 0;
+
+    if (!__get_int(buf, len, &pos, &term) ||
+        !__get_int(buf, len, &pos, &idx) ||
+        len < pos + (int)sizeof(rv->uuid))
+        return 0;
+    rv->term = term;
+    rv->last_log_idx = idx;
+    memcpy(rv->uuid, buf + pos, sizeof(rv->uuid));
+    return 1;
+}
+
+int raft_encode_requestvote_response(raft_server_t* me_, int node,
+                                     msg_requestvote_response_t* r,
+                                     unsigned char* buf, int size)
+{
+    int pos = 0;
+
+    if (!__put_int(buf, size, &pos, r->term) ||
+        !__put_int(buf, size, &pos, r->vote_granted) ||
+        size < pos + (int)sizeof(r->uuid))
+        return 0;
+    memcpy(buf + pos, r->uuid, sizeof(r->uuid));
+    return pos + sizeof(r->uuid);
+}
+
+int raft_decode_requestvote_response(raft_server_t* me_, int node,
+                                     const unsigned char* buf, int len,
+                                     msg_requestvote_response_t* r)
+{
+    int64_t term, granted;
+    int pos = 0;
+
+    if (!__get_int(buf, len, &pos, &term) ||
+        !__get_int(buf, len, &pos, &granted) ||
+        len < pos + (int)sizeof(r->uuid))
+        return 0;
+    r->term = term;
+    r->vote_granted = granted;
+    memcpy(r->uuid, buf + pos, sizeof(r->uuid));
+    return 1;
+}
+
+int raft_encode_installsnapshot(raft_server_t* me_, int node,
+                                msg_installsnapshot_t* is,
+                                unsigned char* buf, int size)
+{
+    int pos = 0;
+
+    if (is->len < 0 || RAFT_SNAPSHOT_CHUNK_SIZE < is->len)
+        return 0;
+
+    if (!__put_int(buf, size, &pos, is->term) ||
+        !__put_int(buf, size, &pos, is->leader_id) ||
+        !__put_int(buf, size, &pos, is->last_idx) ||
+        !__put_int(buf, size, &pos, is->last_term) ||
+        !__put_int(buf, size, &pos, is->offset) ||
+        !__put_int(buf, size, &pos, is->len) ||
+        !__put_int(buf, size, &pos, is->done) ||
+        size < pos + is->len)
+        return 0;
+
+    /* only the valid part of the chunk */
+    memcpy(buf + pos, is->data, is->len);
+    return pos + is->len;
+}
+
+int raft_decode_installsnapshot(raft_server_t* me_, int node,
+                                const unsigned char* buf, int len,
+                                msg_installsnapshot_t* is)
+{
+    int64_t v[7];
+    int i, pos = 0;
+
+    for (i = 0; i < 7; i++)
+        if (!__get_int(buf, len, &pos, &v[i]))
+            return 0;
+
+    memset(is, 0, sizeof(msg_installsnapshot_t));
+    is->term = v[0];
+    is->leader_id = v[1];
+    is->last_idx = v[2];
+    is->last_term = v[3];
+    is->offset = v[4];
+    is->len = v[5];
+    is->done = v[6];
+
+    if (is->len < 0 || RAFT_SNAPSHOT_CHUNK_SIZE < is->len ||
+        len < pos + is->len)
+        return 0;
+    memcpy(is->data, buf + pos, is->len);
+    return 1;
+}
+
+int raft_encode_installsnapshot_response(raft_server_t* me_, int node,
+                                         msg_installsnapshot_response_t* r,
+                                         unsigned char* buf, int size)
+{
+    int pos = 0;
+
+    if (!__put_int(buf, size, &pos, r->term) ||
+        !__put_int(buf, size, &pos, r->last_idx) ||
+        !__put_int(buf, size, &pos, r->offset) ||
+        !__put_int(buf, size, &pos, r->complete))
+        return 0;
+    return pos;
+}
+
+int raft_decode_installsnapshot_response(raft_server_t* me_, int node,
+                                         const unsigned char* buf, int len,
+                                         msg_installsnapshot_response_t* r)
+{
+    int64_t v[4];
+    int i, pos = 0;
+
+    for (i = 0; i < 4; i++)
+        if (!__get_int(buf, len, &pos, &v[i]))
+            return 0;
+
+    r->term = v[0];
+    r->last_idx = v[1];
+    r->offset = v[2];
+    r->complete = v[3];
+    return 1;
+}
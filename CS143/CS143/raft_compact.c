@@ -0,0 +1,185 @@
+/**
+ * Copyright (c) 2013, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Key-based compaction of applied entries
+ * @version 0.1
+ *
+ * Entries may carry a compaction key: a fixed range of bytes within the
+ * entry. Once an entry is applied, it is only needed for as long as no
+ * later entry with the same key has been applied. Rather than a state
+ * machine image, the snapshot then holds the entries that are still needed,
+ * each after its index, oldest first. A follower that is sent the snapshot
+ * applies the entries it doesn't hold yet, so catching up costs one entry
+ * per live key rather than one per update.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include "raft.h"
+#include "raft_log.h"
+#include "raft_private.h"
+
+/* a record is the entry's index, little endian, followed by the entry */
+#define RECORD_IDX_SIZE 8
+#define RECORD_SIZE (RECORD_IDX_SIZE + (int)sizeof(msg_entry_t))
+
+static void __put_idx(unsigned char* p, raft_index_t idx)
+{
+    uint64_t v = (uint64_t)idx;
+    int i;
+
+    for (i = 0; i < RECORD_IDX_SIZE; i++, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static raft_index_t __get_idx(const unsigned char* p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = RECORD_IDX_SIZE - 1; 0 <= i; i--)
+        v = (v << 8) | p[i];
+    return (raft_index_t)v;
+}
+
+/**
+ * @return 1 if the entry carries a key; one of all zero bytes is no key */
+static int __has_key(raft_server_private_t* me, const unsigned char* e)
+{
+    int i;
+
+    for (i = 0; i < me->compaction_key_len; i++)
+        if (e[me->compaction_key_offset + i])
+            return 1;
+    return 0;
+}
+
+static uint32_t __hash_key(raft_server_private_t* me, const unsigned char* e)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < me->compaction_key_len; i++)
+    {
+        h ^= e[me->compaction_key_offset + i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int raft_set_compaction_key(raft_server_t* me_, int offset, int len)
+{
+    raft_server_private_t* me = (void*)me_;
+
+    if (offset < 0 || len < 0 || (int)sizeof(msg_entry_t) < offset + len)
+        return 0;
+
+    me->compaction_key_offset = offset;
+    me->compaction_key_len = len;
+    return 1;
+}
+
+int raft_compact_save(raft_server_t* me_, unsigned char** data, int* len)
+{
+    raft_server_private_t* me = (void*)me_;
+    unsigned char* buf;
+    int* table;
+    int nold, n, i, j, mask;
+    raft_index_t idx;
+
+    /* the entries our last snapshot kept, then those applied since */
+    nold = me->snapshot_len / RECORD_SIZE;
+    n = nold + (int)(me->last_applied_idx - me->snapshot_last_idx);
+    if (!(buf = malloc((size_t)n * RECORD_SIZE)))
+        return 0;
+    if (0 < nold)
+        memcpy(buf, me->snapshot, (size_t)nold * RECORD_SIZE);
+    for (i = nold, idx = me->snapshot_last_idx + 1;
+         idx <= me->last_applied_idx; i++, idx++)
+    {
+        msg_entry_t* e = log_get_entry(me->log, idx);
+        if (!e)
+        {
+            free(buf);
+            return 0;
+        }
+        __put_idx(buf + i * RECORD_SIZE, idx);
+        memcpy(buf + i * RECORD_SIZE + RECORD_IDX_SIZE, e,
+               sizeof(msg_entry_t));
+    }
+
+    /* open addressing set of the keys seen so far, holding the record
+     * number plus one. Newest first, so the first entry seen for a key is the
+     * one that stays */
+    for (mask = 1; mask < n * 2; mask <<= 1)
+        ;
+    if (!(table = calloc(mask, sizeof(int))))
+    {
+        free(buf);
+        return 0;
+    }
+    mask--;
+
+    for (i = n - 1, j = n; 0 <= i; i--)
+    {
+        unsigned char* e = buf + i * RECORD_SIZE + RECORD_IDX_SIZE;
+        uint32_t h;
+
+        if (__has_key(me, e))
+        {
+            for (h = __hash_key(me, e) & mask; table[h]; h = (h + 1) & mask)
+            {
+                unsigned char* other = buf + (table[h] - 1) * RECORD_SIZE +
+                    RECORD_IDX_SIZE;
+                if (0 == memcmp(e + me->compaction_key_offset,
+                                other + me->compaction_key_offset,
+                                me->compaction_key_len))
+                    break;
+            }
+
+            /* superseded */
+            if (table[h])
+                continue;
+            table[h] = j;
+        }
+
+        /* pack kept records at the end, so they stay in order */
+        if (--j != i)
+            memmove(buf + j * RECORD_SIZE, buf + i * RECORD_SIZE, RECORD_SIZE);
+    }
+    free(table);
+
+    memmove(buf, buf + j * RECORD_SIZE, (size_t)(n - j) * RECORD_SIZE);
+    *data = buf;
+    *len = (n - j) * RECORD_SIZE;
+    return 1;
+}
+
+int raft_compact_load(raft_server_t* me_, const unsigned char* data, int len,
+                      raft_index_t idx)
+{
+    raft_server_private_t* me = (void*)me_;
+    int i;
+
+    if (len % RECORD_SIZE)
+        return 0;
+
+    for (i = 0; i < len; i += RECORD_SIZE)
+    {
+        msg_entry_t e;
+
+        if (__get_idx(data + i) <= idx)
+            continue;
+        memcpy(&e, data + i + RECORD_IDX_SIZE, sizeof(e));
+        if (HAS_HOOK(me, applylog) && 0 == HOOK(me, applylog)(me_, e))
+            return 0;
+    }
+    return 1;
+}
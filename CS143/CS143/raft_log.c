@@ -1,4 +1,3 @@
-
 /**
  * Copyright (c) 2013, Willem-Hendrik Thiart
  * Use of this source code is governed by a BSD-style license that can be
@@ -20,38 +19,189 @@
 
 #define INITIAL_CAPACITY 10
 
+/* a run of consecutive entries that share a term */
+typedef struct
+{
+    raft_term_t term;
+    raft_index_t first_idx;
+} run_t;
+
+/* The entries themselves are kept by a storage backend. We keep what
+ * consensus needs to look up quickly: where each term starts, and how many
+ * nodes hold each entry */
 typedef struct
 {
-    /* size of array */
-    int size;
+    raft_log_ops_t ops;
+    void* store;
     
-    /* the amount of elements in the array */
+    /* the amount of elements in the log */
     int count;
     
-    raft_entry_t* entries;
+    /* idx of the first entry we hold. Entries before this have been
+     * compacted into a snapshot */
+    raft_index_t base;
+    
+    /* nodes holding each entry. A ring; the first entry's count is at
+     * slot 'head' */
+    unsigned int* num_nodes;
+    int num_nodes_size;
+    int head;
+    
+    /* where each term starts, oldest first. Terms only grow along the log,
+     * so this is sorted by both fields */
+    run_t* runs;
+    int nruns;
+    int runs_size;
 } log_private_t;
 
-static void __ensurecapacity(log_private_t * me)
+static void* __grow(void* array, int count, int size, int elem_size)
 {
-    if (me->count < me->size)
-        return;
+    void *temp = calloc(size, elem_size);
+    if (!temp)
+        return NULL;
+    memcpy(temp, array, elem_size * count);
+    free(array);
+    return temp;
+}
+
+static unsigned int* __num_nodes(log_private_t* me, raft_index_t idx)
+{
+    if (idx < me->base || me->base + me->count <= idx)
+        return NULL;
+    return &me->num_nodes[(me->head + (int)(idx - me->base)) % me->num_nodes_size];
+}
+
+/**
+ * @return index into runs of the run holding idx */
+static int __find_run(log_private_t* me, raft_index_t idx)
+{
+    int lo = 0, hi = me->nruns - 1;
     
-    raft_entry_t *temp = calloc(1,sizeof(raft_entry_t) * me->size * 2);
-    memcpy(temp, me->entries, sizeof(raft_entry_t)*me->count);
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (me->runs[mid].first_idx <= idx)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/**
+ * Index an entry we've just stored */
+static int __add(log_private_t* me, raft_term_t term)
+{
+    if (me->count == me->num_nodes_size)
+    {
+        /* unroll the ring as we grow it */
+        unsigned int* temp = calloc(me->num_nodes_size * 2, sizeof(unsigned int));
+        if (!temp)
+            return 0;
+        memcpy(temp, &me->num_nodes[me->head],
+               sizeof(unsigned int) * (me->num_nodes_size - me->head));
+        memcpy(&temp[me->num_nodes_size - me->head], me->num_nodes,
+               sizeof(unsigned int) * me->head);
+        free(me->num_nodes);
+        me->num_nodes = temp;
+        me->num_nodes_size *= 2;
+        me->head = 0;
+    }
+    
+    if (0 == me->nruns || me->runs[me->nruns - 1].term != term)
+    {
+        if (me->nruns == me->runs_size)
+        {
+            run_t* temp = __grow(me->runs, me->nruns, me->runs_size * 2, sizeof(run_t));
+            if (!temp)
+                return 0;
+            me->runs = temp;
+            me->runs_size *= 2;
+        }
+        me->runs[me->nruns].term = term;
+        me->runs[me->nruns].first_idx = me->base + me->count;
+        me->nruns++;
+    }
     
-    me->size *= 2;
-    free(me->entries);
-    me->entries = temp;
+    me->count++;
+    *__num_nodes(me, me->base + me->count - 1) = 0;
+    return 1;
+}
+
+/**
+ * Index the entries the store held when we started. Terms never go down
+ * along the log, so each run's end is found by binary search; we needn't
+ * read every entry */
+static int __load(log_private_t* me)
+{
+    raft_index_t n, idx, end;
+    
+    n = me->ops.range(me->store, &me->base);
+    if (n <= 0)
+        return 1;
+    
+    me->num_nodes_size = (int)n;
+    free(me->num_nodes);
+    if (!(me->num_nodes = calloc(me->num_nodes_size, sizeof(unsigned int))))
+        return 0;
+    
+    end = me->base + n;
+    for (idx = me->base; idx < end; )
+    {
+        raft_term_t term, t;
+        raft_index_t lo = idx, hi = end - 1;
+    
+        if (!me->ops.get(me->store, idx, &term))
+            return 0;
+    
+        /* last entry of this term */
+        while (lo < hi)
+        {
+            raft_index_t mid = lo + (hi - lo + 1) / 2;
+            if (!me->ops.get(me->store, mid, &t))
+                return 0;
+            if (t == term)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+    
+        if (me->nruns == me->runs_size)
+        {
+            run_t* temp = __grow(me->runs, me->nruns, me->runs_size * 2, sizeof(run_t));
+            if (!temp)
+                return 0;
+            me->runs = temp;
+            me->runs_size *= 2;
+        }
+        me->runs[me->nruns].term = term;
+        me->runs[me->nruns].first_idx = idx;
+        me->nruns++;
+        idx = lo + 1;
+    }
+    me->count = (int)n;
+    return 1;
 }
 
-log_t* log_new()
+log_t* log_new(const raft_log_ops_t* ops, void* store)
 {
     log_private_t* me;
     
-    me = calloc(1,sizeof(log_private_t));
-    me->size = INITIAL_CAPACITY;
-    me->count = 0;
-    me->entries = calloc(1,sizeof(raft_entry_t) * me->size);
+    if (!(me = calloc(1,sizeof(log_private_t))))
+        return NULL;
+    me->ops = *ops;
+    me->store = store;
+    me->num_nodes_size = INITIAL_CAPACITY;
+    me->num_nodes = calloc(me->num_nodes_size, sizeof(unsigned int));
+    me->runs_size = INITIAL_CAPACITY;
+    me->runs = calloc(me->runs_size, sizeof(run_t));
+    if (!me->num_nodes || !me->runs || !__load(me))
+    {
+        free(me->num_nodes);
+        free(me->runs);
+        free(me);
+        return NULL;
+    }
     return (void*)me;
 }
 
@@ -59,23 +209,72 @@ int log_append_entry(log_t* me_, raft_entry_t* c)
 {
     log_private_t* me = (void*)me_;
     
-    __ensurecapacity(me);
-    
-    memcpy(&me->entries[me->count],c,sizeof(raft_entry_t));
-    me->entries[me->count].num_nodes = 0;
-    me->count++;
+    if (0 == me->ops.append(me->store, me->base + me->count, c->term, &c->entry))
+        return 0;
+    if (0 == __add(me, c->term))
+    {
+        me->ops.truncate_suffix(me->store, me->base + me->count);
+        return 0;
+    }
     return 1;
 }
 
-raft_entry_t* log_get_from_idx(log_t* me_, int idx)
+int log_sync(log_t* me_)
 {
     log_private_t* me = (void*)me_;
+    return me->ops.sync ? me->ops.sync(me->store) : 1;
+}
+
+int log_save_state(log_t* me_, raft_term_t term, int voted_for)
+{
+    log_private_t* me = (void*)me_;
+    return me->ops.save_state ? me->ops.save_state(me->store, term, voted_for) : 1;
+}
+
+void log_load_state(log_t* me_, raft_term_t* term, int* voted_for)
+{
+    log_private_t* me = (void*)me_;
+    if (me->ops.load_state)
+        me->ops.load_state(me->store, term, voted_for);
+}
+
+raft_term_t log_get_term(log_t* me_, raft_index_t idx)
+{
+    log_private_t* me = (void*)me_;
+    
+    if (idx < me->base || me->base + me->count <= idx)
+        return -1;
+    
+    /* usually asked about the latest term */
+    if (me->runs[me->nruns - 1].first_idx <= idx)
+        return me->runs[me->nruns - 1].term;
+    return me->runs[__find_run(me, idx)].term;
+}
+
+msg_entry_t* log_get_entry(log_t* me_, raft_index_t idx)
+{
+    log_private_t* me = (void*)me_;
+    raft_term_t term;
     
-    if (me->count <= idx) {
+    if (idx < me->base || me->base + me->count <= idx)
         return NULL;
-    }
+    return me->ops.get(me->store, idx, &term);
+}
+
+unsigned int log_get_num_nodes(log_t* me_, raft_index_t idx)
+{
+    unsigned int* n = __num_nodes((void*)me_, idx);
+    return n ? *n : 0;
+}
+
+raft_index_t log_get_first_idx_of_run(log_t* me_, raft_index_t idx)
+{
+    log_private_t* me = (void*)me_;
+    
+    if (idx < me->base || me->base + me->count <= idx)
+        return -1;
     
-    return &me->entries[idx];
+    return me->runs[__find_run(me, idx)].first_idx;
 }
 
 int log_count(log_t* me_)
@@ -84,43 +283,104 @@ int log_count(log_t* me_)
     return me->count;
 }
 
-void log_delete(log_t* me_, int idx)
+void log_delete(log_t* me_, raft_index_t idx)
 {
     log_private_t* me = (void*)me_;
-    me->count = idx;
+    
+    if (idx < me->base)
+        idx = me->base;
+    if (me->base + me->count <= idx)
+        return;
+    me->ops.truncate_suffix(me->store, idx);
+    me->count = (int)(idx - me->base);
+    
+    while (0 < me->nruns && idx <= me->runs[me->nruns - 1].first_idx)
+        me->nruns--;
 }
 
-raft_entry_t *log_peektail(log_t * me_)
+void log_compact(log_t* me_, raft_index_t idx)
 {
     log_private_t* me = (void*)me_;
+    int n, r;
+    
+    if (idx < me->base)
+        return;
+    if (me->base + me->count <= idx)
+        n = me->count;
+    else
+        n = (int)(idx - me->base + 1);
+    
+    me->ops.truncate_prefix(me->store, me->base + n - 1);
+    me->count -= n;
+    me->base += n;
+    me->head = (me->head + n) % me->num_nodes_size;
     
     if (0 == me->count)
-        return NULL;
+    {
+        me->nruns = 0;
+        return;
+    }
     
-    return &me->entries[me->count - 1];
+    /* the run holding the new base now starts there */
+    r = __find_run(me, me->base);
+    memmove(me->runs, &me->runs[r], sizeof(run_t) * (me->nruns - r));
+    me->nruns -= r;
+    me->runs[0].first_idx = me->base;
+}
+
+void log_reset(log_t* me_, raft_index_t base)
+{
+    log_private_t* me = (void*)me_;
+    log_empty(me_);
+    me->ops.truncate_prefix(me->store, base - 1);
+    me->base = base;
+}
+
+raft_index_t log_get_base(log_t* me_)
+{
+    return ((log_private_t*)me_)->base;
 }
 
 void log_empty(log_t * me_)
 {
     log_private_t* me = (void*)me_;
+    me->ops.truncate_suffix(me->store, me->base);
     me->count = 0;
+    me->head = 0;
+    me->nruns = 0;
 }
 
 void log_free(log_t * me_)
 {
     log_private_t* me = (void*)me_;
     
-    free(me->entries);
+    me->ops.free(me->store);
+    free(me->num_nodes);
+    free(me->runs);
     free(me);
 }
 
-void log_mark_node_has_committed(log_t* me_, int idx)
+void log_mark_node_has_committed(log_t* me_, raft_index_t idx)
 {
-    raft_entry_t* e;
+    unsigned int* n = __num_nodes((void*)me_, idx);
     
-    if ((e = log_get_from_idx(me_,idx)))
-    {
-        e->num_nodes += 1;
-    }
+    if (n)
+        *n += 1;
 }
 
+void log_unmark_node_has_committed(log_t* me_, raft_index_t idx)
+{
+    unsigned int* n = __num_nodes((void*)me_, idx);
+    
+    if (n && 0 < *n)
+        *n -= 1;
+}
+
+void log_clear_num_nodes(log_t* me_, raft_index_t idx)
+{
+    log_private_t* me = (void*)me_;
+    unsigned int* n;
+    
+    for (; (n = __num_nodes(me, idx)); idx++)
+        *n = 0;
+}
@@ -3,8 +3,14 @@
 
 typedef void* log_t;
 
-log_t* log_new();
+/**
+ * @param ops Functions of the storage backend that keeps the entries
+ * @param store The backend's state. Entries it holds become our log
+ * @return NULL on error */
+log_t* log_new(const raft_log_ops_t* ops, void* store);
 
+/**
+ * Free the log and its backend, leaving stored entries in place */
 void log_free(log_t* me_);
 
 /**
@@ -14,26 +20,82 @@ void log_free(log_t* me_);
  * @return 0 if unsucessful; 1 otherwise */
 int log_append_entry(log_t* me_, raft_entry_t* c);
 
+/**
+ * Make appended entries durable
+ * @return 0 on error */
+int log_sync(log_t* me_);
+
+/**
+ * Durably record our term and vote, if the backend keeps them
+ * @return 0 on error */
+int log_save_state(log_t* me_, raft_term_t term, int voted_for);
+
+/**
+ * Fill in the term and vote the backend kept, if any */
+void log_load_state(log_t* me_, raft_term_t* term, int* voted_for);
+
 /**
  * @return number of entries held within log */
 int log_count(log_t* me_);
 
 /**
  * Delete all logs from this log onwards */
-void log_delete(log_t* me_, int idx);
+void log_delete(log_t* me_, raft_index_t idx);
 
 /**
  * Empty the queue. */
 void log_empty(log_t * me_);
 
-raft_entry_t* log_get_from_idx(log_t* me_, int idx);
+/**
+ * @return term of the entry at idx; -1 if it doesn't exist or has been
+ * compacted */
+raft_term_t log_get_term(log_t* me_, raft_index_t idx);
+
+/**
+ * Appending never moves entries, so the pointer stays valid until the entry
+ * is deleted or compacted
+ * @return payload of the entry at idx; NULL if it doesn't exist or has been
+ * compacted */
+msg_entry_t* log_get_entry(log_t* me_, raft_index_t idx);
+
+/**
+ * @return number of nodes counted as holding the entry at idx */
+unsigned int log_get_num_nodes(log_t* me_, raft_index_t idx);
+
+void log_mark_node_has_committed(log_t* me_, raft_index_t idx);
+
+/**
+ * Stop counting a node as holding the entry at idx */
+void log_unmark_node_has_committed(log_t* me_, raft_index_t idx);
 
 /**
- * @return youngest entry */
-raft_entry_t *log_peektail(log_t * me_);
+ * Forget which nodes were counted as holding the entries from idx on */
+void log_clear_num_nodes(log_t* me_, raft_index_t idx);
 
-void log_mark_node_has_committed(log_t* me_, int idx);
+/**
+ * @return idx of the oldest entry we hold with the same term as the entry
+ * at idx; -1 if we don't hold idx */
+raft_index_t log_get_first_idx_of_run(log_t* me_, raft_index_t idx);
 
-void log_delete(log_t* me_, int idx);
+/**
+ * Discard all entries up to and including idx.
+ * Used once those entries have been captured in a snapshot */
+void log_compact(log_t* me_, raft_index_t idx);
+
+/**
+ * Empty the log. The next appended entry will have index 'base' */
+void log_reset(log_t* me_, raft_index_t base);
+
+/**
+ * @return idx of the oldest entry still held within the log */
+raft_index_t log_get_base(log_t* me_);
+
+/**
+ * @return state of a storage backend that keeps entries in memory */
+void* log_memory_new();
+
+/**
+ * Fill in the in-memory backend's functions */
+void log_memory_set_ops(raft_log_ops_t* ops);
 
 #endif /* RAFT_LOG_H_ */
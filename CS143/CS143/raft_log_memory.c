@@ -0,0 +1,230 @@
+/**
+ * Copyright (c) 2013, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Log storage backend that keeps entries in memory
+ * @version 0.1
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "raft.h"
+#include "raft_log.h"
+
+#define INITIAL_CAPACITY 10
+
+/* entries per chunk */
+#define CHUNK_SIZE 256
+
+/* most freed chunks we hold on to for reuse */
+#define SPARE_CHUNKS 4
+
+/* Terms and payloads are held as separate arrays rather than an array of
+ * raft_entry_t, so that term checks only touch the terms */
+typedef struct chunk_s
+{
+    raft_term_t terms[CHUNK_SIZE];
+    msg_entry_t entries[CHUNK_SIZE];
+    
+    /* next spare chunk */
+    struct chunk_s* next;
+} chunk_t;
+
+/* Entries are held in fixed size chunks. Growing never moves an entry, so
+ * pointers to entries stay valid until they are truncated away */
+typedef struct
+{
+    /* idx of the first entry we hold */
+    raft_index_t base;
+    int count;
+    
+    /* the first entry is at this slot of chunks[0] */
+    int offset;
+    
+    chunk_t** chunks;
+    int nchunks;
+    int chunks_size;
+    
+    /* freed chunks, kept for reuse */
+    chunk_t* spare;
+    int nspare;
+} log_memory_t;
+
+static void __release_chunk(log_memory_t* me, chunk_t* c)
+{
+    if (SPARE_CHUNKS <= me->nspare)
+    {
+        free(c);
+        return;
+    }
+    c->next = me->spare;
+    me->spare = c;
+    me->nspare++;
+}
+
+/**
+ * Release chunks past the first 'n' */
+static void __truncate_chunks(log_memory_t* me, int n)
+{
+    while (n < me->nchunks)
+        __release_chunk(me, me->chunks[--me->nchunks]);
+}
+
+static int __add_chunk(log_memory_t* me)
+{
+    chunk_t* c;
+    
+    if (me->nchunks == me->chunks_size)
+    {
+        chunk_t** temp = realloc(me->chunks, sizeof(chunk_t*) * me->chunks_size * 2);
+        if (!temp)
+            return 0;
+        me->chunks = temp;
+        me->chunks_size *= 2;
+    }
+    
+    if (me->spare)
+    {
+        c = me->spare;
+        me->spare = c->next;
+        me->nspare--;
+    }
+    else if (!(c = malloc(sizeof(chunk_t))))
+        return 0;
+    
+    me->chunks[me->nchunks++] = c;
+    return 1;
+}
+
+static int __append(void* me_, raft_index_t idx, raft_term_t term,
+                    const msg_entry_t* entry)
+{
+    log_memory_t* me = me_;
+    chunk_t* c;
+    int pos;
+    
+    if (0 == me->count)
+    {
+        __truncate_chunks(me, 0);
+        me->offset = 0;
+        me->base = idx;
+    }
+    assert(idx == me->base + me->count);
+    
+    pos = me->offset + me->count;
+    if (pos / CHUNK_SIZE == me->nchunks && 0 == __add_chunk(me))
+        return 0;
+    
+    c = me->chunks[pos / CHUNK_SIZE];
+    c->terms[pos % CHUNK_SIZE] = term;
+    c->entries[pos % CHUNK_SIZE] = *entry;
+    me->count++;
+    return 1;
+}
+
+static msg_entry_t* __get(void* me_, raft_index_t idx, raft_term_t* term)
+{
+    log_memory_t* me = me_;
+    chunk_t* c;
+    int pos;
+    
+    if (idx < me->base || me->base + me->count <= idx)
+        return NULL;
+    
+    pos = me->offset + (int)(idx - me->base);
+    c = me->chunks[pos / CHUNK_SIZE];
+    *term = c->terms[pos % CHUNK_SIZE];
+    return &c->entries[pos % CHUNK_SIZE];
+}
+
+static void __truncate_suffix(void* me_, raft_index_t idx)
+{
+    log_memory_t* me = me_;
+    
+    if (idx < me->base)
+        idx = me->base;
+    if (me->base + me->count <= idx)
+        return;
+    me->count = (int)(idx - me->base);
+    __truncate_chunks(me, (me->offset + me->count + CHUNK_SIZE - 1) / CHUNK_SIZE);
+}
+
+static void __truncate_prefix(void* me_, raft_index_t idx)
+{
+    log_memory_t* me = me_;
+    int n, drop, i;
+    
+    if (idx < me->base)
+        return;
+    if (me->base + me->count <= idx)
+        n = me->count;
+    else
+        n = (int)(idx - me->base + 1);
+    
+    me->count -= n;
+    me->base = idx + 1 < me->base + n ? me->base + n : idx + 1;
+    me->offset += n;
+    
+    /* chunks that are now wholly before the first entry */
+    drop = me->offset / CHUNK_SIZE;
+    if (me->nchunks < drop)
+        drop = me->nchunks;
+    for (i = 0; i < drop; i++)
+        __release_chunk(me, me->chunks[i]);
+    memmove(me->chunks, &me->chunks[drop], sizeof(chunk_t*) * (me->nchunks - drop));
+    me->nchunks -= drop;
+    me->offset %= CHUNK_SIZE;
+}
+
+static raft_index_t __range(void* me_, raft_index_t* first)
+{
+    log_memory_t* me = me_;
+    *first = me->base;
+    return me->count;
+}
+
+static void __free(void* me_)
+{
+    log_memory_t* me = me_;
+    
+    __truncate_chunks(me, 0);
+    while (me->spare)
+    {
+        chunk_t* c = me->spare;
+        me->spare = c->next;
+        free(c);
+    }
+    free(me->chunks);
+    free(me);
+}
+
+void* log_memory_new()
+{
+    log_memory_t* me;
+    
+    if (!(me = calloc(1, sizeof(log_memory_t))))
+        return NULL;
+    me->chunks_size = INITIAL_CAPACITY;
+    if (!(me->chunks = calloc(me->chunks_size, sizeof(chunk_t*))))
+    {
+        free(me);
+        return NULL;
+    }
+    return me;
+}
+
+void log_memory_set_ops(raft_log_ops_t* ops)
+{
+    memset(ops, 0, sizeof(raft_log_ops_t));
+    ops->append = __append;
+    ops->get = __get;
+    ops->truncate_suffix = __truncate_suffix;
+    ops->truncate_prefix = __truncate_prefix;
+    ops->range = __range;
+    ops->free = __free;
+}
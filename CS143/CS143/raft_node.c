@@ -14,28 +14,443 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "raft.h"
 
 typedef struct {
-    int next_idx;
+    raft_index_t next_idx;
+    
+    /* 0 if this node is a learner */
+    int voting;
+    
+    raft_index_t match_idx;
+    
+    /* catch-up mode streaming state */
+    int catchup;
+    raft_index_t catchup_idx;
+    
+    /* the entry we last asked the node to ack at once, and how long the
+     * node may hold its acks */
+    raft_index_t ack_now_idx;
+    int ack_delay;
+    
+    /* wire encoding state */
+    int codecs;
+    raft_index_t codec_noref_idx;
+    
+    /* progress of the snapshot transfer to this node */
+    raft_index_t snapshot_last_idx;
+    int snapshot_offset;
+    
+    /* link quality. rtt is -1 until measured, and rtt_var is its mean
+     * deviation; loss is in thousandths */
+    int rtt;
+    int rtt_var;
+    int loss;
+    
+    /* one request at a time is timed to spot loss */
+    int probe;
+    int probe_sent;
+    
+    /* not needed for the fastest quorum, so served after those that are */
+    int slow;
+    
+    /* milliseconds the node has been further behind than the lag threshold,
+     * and whether we've reported it */
+    int lag_elapsed;
+    int lagging;
+    
+    /* entries acknowledged since the ack rate was last refreshed */
+    int acked;
+    int ack_rate;
+    
+    /* milliseconds since we last sent the node anything, since it last
+     * answered, and since we last sent it a heartbeat */
+    int send_elapsed;
+    int ack_elapsed;
+    int heartbeat_elapsed;
+    
+    /* times we've sent the node entries again since it last answered */
+    int retransmits;
 } raft_node_private_t;
 
 raft_node_t* raft_node_new()
 {
     raft_node_private_t* me;
     me = calloc(1,sizeof(raft_node_private_t));
+    if (!me)
+        return NULL;
+    me->voting = 1;
+    me->match_idx = -1;
+    me->ack_now_idx = -1;
+    me->codec_noref_idx = -1;
+    me->rtt = -1;
     return (void*)me;
 }
 
-int raft_node_get_next_idx(raft_node_t* me_)
+raft_index_t raft_node_get_next_idx(raft_node_t* me_)
 {
     raft_node_private_t* me = (void*)me_;
     return me->next_idx;
 }
 
-void raft_node_set_next_idx(raft_node_t* me_, int nextIdx)
+void raft_node_set_next_idx(raft_node_t* me_, raft_index_t nextIdx)
 {
     raft_node_private_t* me = (void*)me_;
     me->next_idx = nextIdx;
 }
+
+int raft_node_is_voting(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->voting;
+}
+
+void raft_node_set_voting(raft_node_t* me_, int voting)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->voting = voting;
+}
+
+raft_index_t raft_node_get_match_idx(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->match_idx;
+}
+
+void raft_node_set_match_idx(raft_node_t* me_, raft_index_t matchIdx)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->match_idx = matchIdx;
+}
+
+int raft_node_is_catching_up(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->catchup;
+}
+
+void raft_node_set_catching_up(raft_node_t* me_, int catchup)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->catchup = catchup;
+}
+
+raft_index_t raft_node_get_catchup_idx(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->catchup_idx;
+}
+
+void raft_node_set_catchup_idx(raft_node_t* me_, raft_index_t idx)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->catchup_idx = idx;
+}
+
+raft_index_t raft_node_get_ack_now_idx(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->ack_now_idx;
+}
+
+void raft_node_set_ack_now_idx(raft_node_t* me_, raft_index_t idx)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->ack_now_idx = idx;
+}
+
+int raft_node_get_ack_delay(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->ack_delay;
+}
+
+void raft_node_set_ack_delay(raft_node_t* me_, int msec)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->ack_delay = msec;
+}
+
+int raft_node_get_codecs(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->codecs;
+}
+
+void raft_node_set_codecs(raft_node_t* me_, int codecs)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->codecs = codecs;
+}
+
+raft_index_t raft_node_get_codec_noref_idx(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->codec_noref_idx;
+}
+
+void raft_node_set_codec_noref_idx(raft_node_t* me_, raft_index_t idx)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->codec_noref_idx = idx;
+}
+
+raft_index_t raft_node_get_snapshot_last_idx(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->snapshot_last_idx;
+}
+
+int raft_node_get_snapshot_offset(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->snapshot_offset;
+}
+
+void raft_node_set_snapshot_offset(raft_node_t* me_, raft_index_t last_idx,
+                                   int offset)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->snapshot_last_idx = last_idx;
+    me->snapshot_offset = offset;
+}
+
+int raft_node_get_rtt(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->rtt;
+}
+
+int raft_node_get_loss(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->loss;
+}
+
+int raft_node_get_cost(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    int loss = me->loss;
+    
+    if (-1 == me->rtt)
+        return -1;
+    
+    /* a lost request costs us another round trip */
+    if (900 < loss)
+        loss = 900;
+    return me->rtt * 1000 / (1000 - loss);
+}
+
+int raft_node_is_slow(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->slow;
+}
+
+void raft_node_set_slow(raft_node_t* me_, int slow)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->slow = slow;
+}
+
+int raft_node_is_lagging(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->lagging;
+}
+
+void raft_node_set_lagging(raft_node_t* me_, int lagging)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->lagging = lagging;
+}
+
+int raft_node_get_lag_elapsed(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->lag_elapsed;
+}
+
+void raft_node_set_lag_elapsed(raft_node_t* me_, int msec)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->lag_elapsed = msec;
+}
+
+void raft_node_add_acked(raft_node_t* me_, int nentries)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->acked += nentries;
+}
+
+void raft_node_update_ack_rate(raft_node_t* me_, int msec)
+{
+    raft_node_private_t* me = (void*)me_;
+    
+    me->ack_rate = (me->ack_rate * 3 + me->acked * 1000 / msec) / 4;
+    me->acked = 0;
+}
+
+int raft_node_get_ack_rate(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->ack_rate;
+}
+
+void raft_node_add_rtt_sample(raft_node_t* me_, int msec)
+{
+    raft_node_private_t* me = (void*)me_;
+    
+    /* smoothed like TCP's SRTT and RTTVAR */
+    if (-1 == me->rtt)
+    {
+        me->rtt = msec;
+        me->rtt_var = msec / 2;
+    }
+    else
+    {
+        int dev = msec < me->rtt ? me->rtt - msec : msec - me->rtt;
+        me->rtt_var = (me->rtt_var * 3 + dev) / 4;
+        me->rtt = (me->rtt * 7 + msec) / 8;
+    }
+}
+
+int raft_node_get_retransmit_timeout(raft_node_t* me_, int slack, int max)
+{
+    raft_node_private_t* me = (void*)me_;
+    int rto, i;
+    
+    if (-1 == me->rtt)
+        return max;
+    
+    rto = me->rtt + (slack < 4 * me->rtt_var ? 4 * me->rtt_var : slack);
+    
+    /* back off while the node doesn't answer */
+    for (i = 0; i < me->retransmits && rto < max; i++)
+        rto *= 2;
+    return rto < max ? rto : max;
+}
+
+void raft_node_add_loss_sample(raft_node_t* me_, int lost)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->loss = (me->loss * 15 + (lost ? 1000 : 0)) / 16;
+}
+
+void raft_node_probe_start(raft_node_t* me_, int now)
+{
+    raft_node_private_t* me = (void*)me_;
+    
+    if (me->probe)
+        return;
+    me->probe = 1;
+    me->probe_sent = now;
+}
+
+void raft_node_probe_check(raft_node_t* me_, int now, int timeout)
+{
+    raft_node_private_t* me = (void*)me_;
+    
+    if (!me->probe || ((now - me->probe_sent) & RAFT_TIMESTAMP_MASK) < timeout)
+        return;
+    raft_node_add_loss_sample(me_, 1);
+    me->probe = 0;
+}
+
+void raft_node_probe_response(raft_node_t* me_, int now, int sent)
+{
+    raft_node_private_t* me = (void*)me_;
+    
+    raft_node_add_rtt_sample(me_, (now - sent) & RAFT_TIMESTAMP_MASK);
+    
+    /* answers the request being timed, or one sent after it */
+    if (me->probe && ((sent - me->probe_sent) & RAFT_TIMESTAMP_MASK) <=
+        ((now - me->probe_sent) & RAFT_TIMESTAMP_MASK))
+    {
+        raft_node_add_loss_sample(me_, 0);
+        me->probe = 0;
+    }
+}
+
+int raft_node_is_probing(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->probe;
+}
+
+void raft_node_probe_clear(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->probe = 0;
+}
+
+static int __add_elapsed(int elapsed, int msec)
+{
+    return elapsed < INT_MAX - msec ? elapsed + msec : INT_MAX;
+}
+
+void raft_node_tick(raft_node_t* me_, int msec)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->send_elapsed = __add_elapsed(me->send_elapsed, msec);
+    me->ack_elapsed = __add_elapsed(me->ack_elapsed, msec);
+    me->heartbeat_elapsed = __add_elapsed(me->heartbeat_elapsed, msec);
+}
+
+void raft_node_sent(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->send_elapsed = 0;
+}
+
+void raft_node_answered(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->ack_elapsed = 0;
+    me->retransmits = 0;
+}
+
+int raft_node_get_send_elapsed(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    return me->send_elapsed;
+}
+
+int raft_node_retransmit_check(raft_node_t* me_, int timeout)
+{
+    raft_node_private_t* me = (void*)me_;
+    
+    if (me->send_elapsed < timeout || me->ack_elapsed < timeout)
+        return 0;
+    
+    me->heartbeat_elapsed = 0;
+    me->retransmits++;
+    return 1;
+}
+
+int raft_node_heartbeat_check(raft_node_t* me_, int timeout)
+{
+    raft_node_private_t* me = (void*)me_;
+    
+    if (me->heartbeat_elapsed < timeout)
+        return 0;
+    
+    /* what we've sent lately does the heartbeat's job, unless the node
+     * isn't answering it */
+    if (me->send_elapsed < timeout && me->ack_elapsed < timeout)
+        return 0;
+    
+    me->heartbeat_elapsed = 0;
+    return 1;
+}
+
+void raft_node_heartbeat_clear(raft_node_t* me_)
+{
+    raft_node_private_t* me = (void*)me_;
+    me->send_elapsed = 0;
+    me->ack_elapsed = 0;
+    me->heartbeat_elapsed = 0;
+    me->retransmits = 0;
+}
@@ -14,6 +14,78 @@
 
 #define REQUEST_TIMEOUT 1000
 #define ELECTION_TIMEOUT 5000
+#define LEARNER_THRESHOLD 5
+
+/* followers further behind than this are streamed to in catch-up mode */
+#define CATCHUP_THRESHOLD 10
+/* catch-up appendentries we may send per second, across all followers */
+#define CATCHUP_RATE 500
+/* most catch-up appendentries we may send back-to-back */
+#define CATCHUP_BURST 10
+
+/* most entries we'll hold that haven't been committed */
+#define UNCOMMITTED_LIMIT 128
+
+/* our election timeout is stretched by this many times our quorum RTT, so
+ * that well connected nodes tend to time out and win first */
+#define ELECTION_RTT_BIAS 4
+/* hand leadership over when a follower's quorum RTT is below this many
+ * thousandths of ours, once we have led for an election timeout */
+#define TRANSFER_RTT_RATIO 600
+
+/* followers whose RTT is over this many thousandths of our quorum RTT are
+ * sent to after the rest */
+#define SLOW_RTT_RATIO 2000
+/* report followers that stay further behind than this many entries */
+#define LAG_THRESHOLD 64
+/* how often per-follower ack rates are refreshed, in milliseconds */
+#define ACK_RATE_PERIOD 1000
+/* least time we allow over a follower's RTT for it to answer before we send
+ * it entries again, in milliseconds */
+#define RETRANSMIT_SLACK 10
+
+/* most proposals a follower holds for the leader */
+#define FORWARD_MAX 16
+/* how long a proposal may wait for an appendentries response to ride on */
+#define FORWARD_TIMEOUT 100
+
+/* Build with RAFT_NUM_NODES defined, e.g. -DRAFT_NUM_NODES=5, to fix the
+ * cluster at that many nodes. The tables with an element per node are then
+ * arrays within the server rather than allocated, and loops over the nodes
+ * have a constant bound. raft_set_configuration turns any other number of
+ * nodes away */
+#ifdef RAFT_NUM_NODES
+#define NODE_ARRAY(type, name, n) type name[n]
+#define NUM_NODES(me) RAFT_NUM_NODES
+#else
+#define NODE_ARRAY(type, name, n) type* name
+#define NUM_NODES(me) ((me)->num_nodes)
+#endif
+
+/* the transport's and state machine's callbacks; see RAFT_STATIC_HOOKS */
+#ifdef RAFT_STATIC_HOOKS
+#define HOOK(me, name) raft_hook_##name
+#define HAS_HOOK(me, name) 1
+#else
+#define HOOK(me, name) ((me)->cb.name)
+#define HAS_HOOK(me, name) (NULL != (me)->cb.name)
+#endif
+
+
+/* nodes per word of the votes_for_me bitset, and words for n nodes */
+#define VOTE_BITS (sizeof(unsigned long) * 8)
+#define VOTE_WORDS(n) (((n) + VOTE_BITS - 1) / VOTE_BITS)
+
+/* An entry held for the leader, or sent to it and not yet seen back */
+typedef struct {
+    msg_entry_t entry;
+    
+    /* what applylog_tentative was told; 0 if proposed to another node */
+    int id;
+    
+    /* milliseconds since it was sent */
+    int elapsed;
+} raft_forward_t;
 
 enum {
     RAFT_STATE_NONE,
@@ -27,7 +99,7 @@ typedef struct {
     
     /* the server's best guess of what the current term is
      * starts at zero */
-    int current_term;
+    raft_term_t current_term;
     
     /* The candidate the server voted for in its current term,
      * or Nil if it hasn't voted for any.  */
@@ -39,47 +111,195 @@ typedef struct {
     /* Volatile state: */
     
     /* idx of highest log entry known to be committed */
-    int commit_idx;
+    raft_index_t commit_idx;
     
     /* idx of highest log entry applied to state machine */
-    int last_applied_idx;
+    raft_index_t last_applied_idx;
     
     /* follower/leader/candidate indicator */
     int state;
     
     /* next open index in our log, also indicates size of the log */
-    int current_idx;
+    raft_index_t current_idx;
     
     /* amount of time left till timeout */
     int timeout_elapsed;
     
-    /* who has voted for me. This is an array with N = 'num_nodes' elements */
-    int *votes_for_me;
+    /* time spent as leader this term, in milliseconds */
+    int leader_elapsed;
+    
+    /* milliseconds since we started; only used modulo RAFT_TIMESTAMP_MASK */
+    int clock;
+    
+    /* cached result of raft_get_quorum_rtt, refreshed by raft_periodic */
+    int quorum_rtt;
+    NODE_ARRAY(int, rtt_scratch, RAFT_NUM_NODES);
+    
+    /* node indices, fastest first, so that the quorum hears from us first.
+     * Refreshed by raft_periodic */
+    NODE_ARRAY(int, send_order, RAFT_NUM_NODES);
+    
+    /* nodes we are about to send appendentries to, and the group of them
+     * being sent the same message */
+    NODE_ARRAY(int, send_scratch, RAFT_NUM_NODES);
+    NODE_ARRAY(int, send_group, RAFT_NUM_NODES);
     
-    raft_node_t* nodes;
+    /* report followers that stay this many entries behind */
+    int lag_threshold;
+    
+    /* time since the per-follower ack rates were refreshed */
+    int ack_rate_elapsed;
+    
+    /* who has voted for me, one bit per node */
+    NODE_ARRAY(unsigned long, votes_for_me, VOTE_WORDS(RAFT_NUM_NODES));
+    
+    /* voting nodes, besides ourselves, who have voted for me */
+    int nvotes;
+    
+    /* voting nodes, counting ourselves unless we are a learner */
+    int num_voting;
+    
+    NODE_ARRAY(raft_node_t, nodes, RAFT_NUM_NODES);
     int num_nodes;
     
     int election_timeout;
     int request_timeout;
     
+    /* our most recent snapshot. Entries up through snapshot_last_idx have
+     * been compacted out of the log */
+    unsigned char* snapshot;
+    int snapshot_len;
+    raft_index_t snapshot_last_idx;
+    raft_term_t snapshot_last_term;
+    
+    /* take a snapshot once this many applied entries are in the log */
+    int snapshot_threshold;
+    
+    /* promote a learner once it is missing no more than this many entries */
+    int learner_threshold;
+    
+    /* the nodes that don't vote, as sent in appendentries */
+    int n_learners;
+    int learners[RAFT_LEARNERS_MAX];
+    
+    /* a further learner is only promoted once the entry at this idx has
+     * committed. By then a majority has taken on the last change */
+    raft_index_t learners_idx;
+    
+    /* catch-up mode settings. The budget is in thousandths of a message and
+     * is refilled by raft_periodic at catchup_rate messages per second */
+    int catchup_threshold;
+    int catchup_rate;
+    int catchup_budget;
+    
+    /* admission control. busy is set once we've turned an entry away, so
+     * that the capacity callback fires when there is room again */
+    int uncommitted_limit;
+    int busy;
+    
+    /* entries proposed to us that entry_done hasn't reported yet, oldest
+     * first. A ring; the oldest is at slot 'pending_head' */
+    msg_entry_response_t* pending;
+    int pending_size;
+    int pending_head;
+    int npending;
+    
+    /* proposals waiting to be sent to the leader. A ring; the oldest is at
+     * slot 'forward_head' */
+    raft_forward_t forward[FORWARD_MAX];
+    int forward_head;
+    int nforward;
+    
+    /* tentatively applied proposals we've sent to the leader, which we
+     * watch for in its appendentries. A ring like 'forward' */
+    raft_forward_t unseen[FORWARD_MAX];
+    int unseen_head;
+    int nunseen;
+    
+    /* id last given to a tentatively applied proposal */
+    int proposal_id;
+    
+    /* milliseconds the oldest proposal has waited */
+    int forward_elapsed;
+    int forward_timeout;
+    
+    /* successful appendentries responses the leader doesn't want at once
+     * are held back for up to ack_delay milliseconds or ack_max responses,
+     * and sent as the one in 'ack' */
+    int ack_delay;
+    int ack_max;
+    msg_appendentries_response_t ack;
+    int ack_node;
+    int nacks;
+    int ack_elapsed;
+    
+    /* the entry the leader last asked voters to ack at once, and how many
+     * of those asked haven't acked it yet */
+    raft_index_t ack_now_entry;
+    int ack_now_pending;
+    
+    /* the node we last took appendentries from, or -1 */
+    int leader_id;
+    
+    /* RAFT_CODEC_* mask of codecs we send with and advertise */
+    int codecs;
+    
+    /* field layout of entry payloads, for RAFT_CODEC_DELTA */
+    char entry_layout[sizeof(msg_entry_t) + 1];
+    
+    /* we received an entry encoded against one we don't hold */
+    int codec_missing_ref;
+    
+    /* bytes of an entry that hold its compaction key; a length of 0 leaves
+     * snapshots to the snapshot_save callback */
+    int compaction_key_offset;
+    int compaction_key_len;
+    
+    /* snapshot that the leader is streaming to us */
+    unsigned char* snapshot_recv;
+    int snapshot_recv_len;
+    int snapshot_recv_size;
+    raft_index_t snapshot_recv_last_idx;
+    raft_term_t snapshot_recv_last_term;
+    
     /* callbacks */
     raft_cbs_t cb;
+    void* udata;
     
     /* my node ID */
     int nodeid;
+    
+    /* for randomised election timeouts. Our own, so that a replay of a
+     * trace draws the same timeouts as the traced server did */
+    unsigned int seed;
+    
+    /* raft_trace_t recording our inputs, or NULL */
+    void* trace;
 } raft_server_private_t;
 
 void raft_election_start(raft_server_t* me);
 
+/**
+ * raft_recv_entry, for entries that reach us within another input and so
+ * mustn't be traced as an input of their own
+ * @param proposal Number to report the entry by if it was proposed to us
+ * while speculating, else 0. The entry is applied tentatively unless the
+ * number has been used before */
+int raft_accept_entry(raft_server_t* me, int node, msg_entry_t* e,
+                      int proposal, msg_entry_response_t* r);
+
 void raft_become_leader(raft_server_t* me);
 
 void raft_become_follower(raft_server_t* me);
 
-void raft_vote(raft_server_t* me, int node);
+/**
+ * Vote for node in the current term, storing the vote
+ * @return 0 if it couldn't be stored */
+int raft_vote(raft_server_t* me, int node);
 
-void raft_set_current_term(raft_server_t* me,int term);
+void raft_set_current_term(raft_server_t* me, raft_term_t term);
 
-void raft_set_current_idx(raft_server_t* me,int idx);
+void raft_set_current_idx(raft_server_t* me, raft_index_t idx);
 
 /**
  * @return 0 on error */
@@ -87,8 +307,44 @@ int raft_send_requestvote(raft_server_t* me, int node);
 
 void raft_send_appendentries(raft_server_t* me, int node);
 
+/**
+ * Send the node an appendentries carrying the entry at idx */
+void raft_send_appendentries_idx(raft_server_t* me_, int node, raft_index_t idx);
+
+/**
+ * Stream entries to nodes that are in catch-up mode, for as long as the
+ * catch-up budget allows */
+void raft_send_catchup(raft_server_t* me_);
+
 void raft_send_appendentries_all(raft_server_t* me_);
 
+/**
+ * Send appendentries to the first nnodes nodes listed in send_scratch.
+ * Nodes that would be sent the same message are sent it with a single
+ * broadcast, if we have the callback for it. Clobbers send_scratch */
+void raft_send_appendentries_scratch(raft_server_t* me_, int nnodes);
+
+/**
+ * Send the next chunk of our snapshot to the node */
+void raft_send_installsnapshot(raft_server_t* me_, int node);
+
+/**
+ * Build a snapshot of the entries up to last_applied_idx that no later
+ * entry with the same compaction key supersedes. Takes over from the
+ * snapshot_save callback when a compaction key is set
+ * @param data Set to the snapshot, allocated with malloc
+ * @param len Set to the number of bytes within data
+ * @return 0 on error */
+int raft_compact_save(raft_server_t* me_, unsigned char** data, int* len);
+
+/**
+ * Apply the entries of a snapshot built by raft_compact_save that follow
+ * an index, in place of the snapshot_load callback
+ * @param idx Entries up to this index have been applied already
+ * @return 0 on error */
+int raft_compact_load(raft_server_t* me_, const unsigned char* data, int len,
+                      raft_index_t idx);
+
 /**
  * Apply entry at lastApplied + 1. Entry becomes 'committed'.
  * @return 1 if entry committed, 0 otherwise */
@@ -100,17 +356,179 @@ int raft_apply_entry(raft_server_t* me_);
  * @return 0 if unsuccessful */
 int raft_append_entry(raft_server_t* me_, raft_entry_t* c);
 
-void raft_set_commit_idx(raft_server_t* me, int commit_idx);
-int raft_get_commit_idx(raft_server_t* me_);
+void raft_set_commit_idx(raft_server_t* me, raft_index_t commit_idx);
+raft_index_t raft_get_commit_idx(raft_server_t* me_);
 
-void raft_set_last_applied_idx(raft_server_t* me, int idx);
+void raft_set_last_applied_idx(raft_server_t* me, raft_index_t idx);
 
 void raft_set_state(raft_server_t* me_, int state);
 int raft_get_state(raft_server_t* me_);
 
 raft_node_t* raft_node_new();
 
-void raft_node_set_next_idx(raft_node_t* node, int nextIdx);
+void raft_node_set_next_idx(raft_node_t* node, raft_index_t nextIdx);
+
+void raft_node_set_voting(raft_node_t* node, int voting);
+
+/**
+ * @return highest idx this node has been counted as holding */
+raft_index_t raft_node_get_match_idx(raft_node_t* node);
+
+void raft_node_set_match_idx(raft_node_t* node, raft_index_t matchIdx);
+
+/**
+ * @return 1 if we are streaming entries to this node in catch-up mode */
+int raft_node_is_catching_up(raft_node_t* node);
+
+void raft_node_set_catching_up(raft_node_t* node, int catchup);
+
+/**
+ * @return idx of the next entry to stream to this node. This runs ahead of
+ * next_idx, which only advances as the node acknowledges entries */
+raft_index_t raft_node_get_catchup_idx(raft_node_t* node);
+
+void raft_node_set_catchup_idx(raft_node_t* node, raft_index_t idx);
+
+/**
+ * @return idx of the entry we last asked the node to ack at once, as its
+ * ack completed a quorum; -1 if none */
+raft_index_t raft_node_get_ack_now_idx(raft_node_t* node);
+
+void raft_node_set_ack_now_idx(raft_node_t* node, raft_index_t idx);
+
+/**
+ * @return milliseconds the node told us it may hold its acks for */
+int raft_node_get_ack_delay(raft_node_t* node);
+
+void raft_node_set_ack_delay(raft_node_t* node, int msec);
+
+/**
+ * @return RAFT_CODEC_* mask of codecs the node has advertised */
+int raft_node_get_codecs(raft_node_t* node);
+
+void raft_node_set_codecs(raft_node_t* node, int codecs);
+
+/**
+ * @return highest idx that the node may not hold, so that entries following
+ * it must not be encoded against it */
+raft_index_t raft_node_get_codec_noref_idx(raft_node_t* node);
+
+void raft_node_set_codec_noref_idx(raft_node_t* node, raft_index_t idx);
+
+/**
+ * @return the last_idx of the snapshot we are streaming to this node */
+raft_index_t raft_node_get_snapshot_last_idx(raft_node_t* node);
+
+/**
+ * @return byte offset of the next snapshot chunk to send to this node */
+int raft_node_get_snapshot_offset(raft_node_t* node);
+
+void raft_node_set_snapshot_offset(raft_node_t* node, raft_index_t last_idx,
+                                   int offset);
+
+/**
+ * @return the node's RTT allowing for loss; -1 if we haven't measured it */
+int raft_node_get_cost(raft_node_t* node);
+
+/**
+ * @return 1 if the fastest quorum doesn't need the node, so that it is sent
+ * new entries one at a time, as it acknowledges them */
+int raft_node_is_slow(raft_node_t* node);
+
+void raft_node_set_slow(raft_node_t* node, int slow);
+
+/**
+ * @return 1 if we've reported that the node is lagging */
+int raft_node_is_lagging(raft_node_t* node);
+
+void raft_node_set_lagging(raft_node_t* node, int lagging);
+
+/**
+ * @return milliseconds the node has been beyond the lag threshold */
+int raft_node_get_lag_elapsed(raft_node_t* node);
+
+void raft_node_set_lag_elapsed(raft_node_t* node, int msec);
+
+void raft_node_add_acked(raft_node_t* node, int nentries);
+
+/**
+ * Fold the entries acknowledged over the last msec milliseconds into the
+ * node's ack rate */
+void raft_node_update_ack_rate(raft_node_t* node, int msec);
+
+void raft_node_add_rtt_sample(raft_node_t* node, int msec);
+
+/**
+ * How long to wait for the node to answer before sending it again what it
+ * hasn't acknowledged. As with TCP's RTO, that is its RTT plus four
+ * deviations or the slack, whichever is more, doubled for each
+ * retransmission it hasn't answered
+ * @param slack Least time to allow over the RTT, e.g. our timer's
+ * granularity
+ * @param max Timeout to return if the RTT isn't known, and the most to
+ * return otherwise
+ * @return the timeout in milliseconds */
+int raft_node_get_retransmit_timeout(raft_node_t* node, int slack, int max);
+
+/**
+ * @param lost 1 if a request to the node went unanswered */
+void raft_node_add_loss_sample(raft_node_t* node, int lost);
+
+/**
+ * Time a request to the node for loss, unless one is already being timed
+ * @param now Our clock, in milliseconds */
+void raft_node_probe_start(raft_node_t* node, int now);
+
+/**
+ * Count the timed request as lost once timeout ms have passed */
+void raft_node_probe_check(raft_node_t* node, int now, int timeout);
+
+/**
+ * The node answered a request we sent at time 'sent'. Take an RTT sample
+ * and settle the timed request if this answers it */
+void raft_node_probe_response(raft_node_t* node, int now, int sent);
+
+/**
+ * @return 1 if a request to the node is awaiting an answer */
+int raft_node_is_probing(raft_node_t* node);
+
+/**
+ * Forget the timed request, e.g. after the node reconnects */
+void raft_node_probe_clear(raft_node_t* node);
+
+/**
+ * Advance the node's send, answer and heartbeat timers */
+void raft_node_tick(raft_node_t* node, int msec);
+
+/**
+ * We sent the node an appendentries or installsnapshot */
+void raft_node_sent(raft_node_t* node);
+
+/**
+ * The node answered one of our requests */
+void raft_node_answered(raft_node_t* node);
+
+/**
+ * @return milliseconds since we last sent the node anything */
+int raft_node_get_send_elapsed(raft_node_t* node);
+
+/**
+ * A node needs a heartbeat once timeout ms have passed since its last one,
+ * and either we've sent it nothing for as long or it hasn't answered for
+ * as long. Restarts the heartbeat timer if so
+ * @return 1 if the node should be sent a heartbeat now */
+int raft_node_heartbeat_check(raft_node_t* node, int timeout);
+
+/**
+ * A node that hasn't acknowledged all we've sent it is sent it again once
+ * we've sent it nothing and it hasn't answered for timeout ms. Restarts
+ * the heartbeat timer and counts the retransmission if so
+ * @return 1 if the node should be sent its entries again now */
+int raft_node_retransmit_check(raft_node_t* node, int timeout);
+
+/**
+ * Restart the node's timers, e.g. when we become leader */
+void raft_node_heartbeat_clear(raft_node_t* node);
 
 int raft_votes_is_majority(const int nnodes, const int nvotes);
 
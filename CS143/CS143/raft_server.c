@@ -21,6 +21,7 @@
 #include "raft.h"
 #include "raft_log.h"
 #include "raft_private.h"
+#include "raft_trace.h"
 
 #define DEBUG 0
 
@@ -38,22 +39,246 @@ static void __log(raft_server_t *me_, const char *fmt, ...)
 #endif
 }
 
+/**
+ * Make room to track one more proposal */
+static int __pending_reserve(raft_server_private_t* me)
+{
+    msg_entry_response_t* temp;
+    int size;
+    
+    if (me->npending < me->pending_size)
+        return 1;
+    
+    /* unroll the ring as we grow it */
+    size = me->pending_size ? me->pending_size * 2 : 16;
+    if (!(temp = malloc(sizeof(msg_entry_response_t) * size)))
+        return 0;
+    if (me->pending)
+    {
+        memcpy(temp, &me->pending[me->pending_head],
+               sizeof(msg_entry_response_t) * (me->pending_size - me->pending_head));
+        memcpy(&temp[me->pending_size - me->pending_head], me->pending,
+               sizeof(msg_entry_response_t) * me->pending_head);
+        free(me->pending);
+    }
+    me->pending = temp;
+    me->pending_size = size;
+    me->pending_head = 0;
+    return 1;
+}
+
+static msg_entry_response_t* __pending_oldest(raft_server_private_t* me)
+{
+    return 0 < me->npending ? &me->pending[me->pending_head] : NULL;
+}
+
+static msg_entry_response_t* __pending_newest(raft_server_private_t* me)
+{
+    if (0 == me->npending)
+        return NULL;
+    return &me->pending[(me->pending_head + me->npending - 1) % me->pending_size];
+}
+
+/**
+ * Stop tracking the oldest proposal, and report what became of it. It is
+ * off the ring before the callback runs, so the callback may propose */
+static void __pending_done_oldest(raft_server_t* me_, int result)
+{
+    raft_server_private_t* me = (void*)me_;
+    msg_entry_response_t r = me->pending[me->pending_head];
+    
+    me->pending_head = (me->pending_head + 1) % me->pending_size;
+    me->npending--;
+    me->cb.entry_done(me_, &r, result);
+}
+
+static void __pending_done_newest(raft_server_t* me_, int result)
+{
+    raft_server_private_t* me = (void*)me_;
+    msg_entry_response_t r = *__pending_newest(me);
+    
+    me->npending--;
+    me->cb.entry_done(me_, &r, result);
+}
+
+/**
+ * @return 1 if entries proposed to us are applied before they commit */
+static int __speculating(raft_server_private_t* me)
+{
+    return me->cb.applylog_tentative && me->cb.entry_done;
+}
+
+/**
+ * @return the number for the next entry proposed to us, or 0 if we aren't
+ * speculating */
+static int __next_proposal(raft_server_private_t* me)
+{
+    return __speculating(me) ? me->proposal_id + 1 : 0;
+}
+
+/**
+ * Report a tentatively applied proposal that won't reach the log through
+ * us. We can't say where it would have gone */
+static void __proposal_done(raft_server_t* me_, int proposal, int result)
+{
+    raft_server_private_t* me = (void*)me_;
+    msg_entry_response_t r;
+    
+    r.term = -1;
+    r.idx = -1;
+    r.id = proposal;
+    me->cb.entry_done(me_, &r, result);
+}
+
+/**
+ * Hold on to a proposal until it can go to the leader
+ * @param proposal What applylog_tentative was told of it, or 0 */
+static int __forward(raft_server_private_t* me, msg_entry_t* e, int proposal)
+{
+    raft_forward_t* f;
+    
+    /* ours need room to be watched for once they're sent */
+    if (FORWARD_MAX == me->nforward ||
+        (proposal && FORWARD_MAX <= me->nforward + me->nunseen))
+        return RAFT_ERR_BUSY;
+    f = &me->forward[(me->forward_head + me->nforward) % FORWARD_MAX];
+    f->entry = *e;
+    f->id = proposal;
+    f->elapsed = 0;
+    me->nforward++;
+    return 1;
+}
+
+static raft_forward_t __forward_take(raft_server_private_t* me)
+{
+    raft_forward_t f = me->forward[me->forward_head];
+    
+    me->forward_head = (me->forward_head + 1) % FORWARD_MAX;
+    me->nforward--;
+    return f;
+}
+
+/**
+ * Watch for a proposal we've just sent the leader coming back in its
+ * appendentries, if it was applied tentatively */
+static void __unseen_add(raft_server_private_t* me, raft_forward_t* f)
+{
+    if (!f->id)
+        return;
+    me->unseen[(me->unseen_head + me->nunseen) % FORWARD_MAX] = *f;
+    me->nunseen++;
+}
+
+static void __unseen_done_oldest(raft_server_t* me_, int result)
+{
+    raft_server_private_t* me = (void*)me_;
+    int proposal = me->unseen[me->unseen_head].id;
+    
+    me->unseen_head = (me->unseen_head + 1) % FORWARD_MAX;
+    me->nunseen--;
+    __proposal_done(me_, proposal, result);
+}
+
+/**
+ * Look for an entry the leader sent us among the proposals we sent it.
+ * The leader appends one node's proposals in the order they reach it, so
+ * any sent before the one found were turned away or lost on the way */
+static void __unseen_check(raft_server_t* me_, raft_entry_t* ety,
+                           raft_index_t idx)
+{
+    raft_server_private_t* me = (void*)me_;
+    msg_entry_response_t r;
+    int i;
+    
+    for (i=0; i<me->nunseen; i++)
+    {
+        raft_forward_t* f = &me->unseen[(me->unseen_head + i) % FORWARD_MAX];
+        if (0 == memcmp(&f->entry, &ety->entry, sizeof(msg_entry_t)))
+            break;
+    }
+    if (i == me->nunseen)
+        return;
+    
+    while (0 < i--)
+        __unseen_done_oldest(me_, RAFT_ENTRY_UNKNOWN);
+    
+    r.term = ety->term;
+    r.idx = idx;
+    r.id = me->unseen[me->unseen_head].id;
+    me->unseen_head = (me->unseen_head + 1) % FORWARD_MAX;
+    me->nunseen--;
+    
+    /* from here on it is tracked as if we had proposed it as leader */
+    if (0 == __pending_reserve(me))
+    {
+        __proposal_done(me_, r.id, RAFT_ENTRY_UNKNOWN);
+        return;
+    }
+    me->npending++;
+    *__pending_newest(me) = r;
+}
+
 raft_server_t* raft_new(int nodeid)
+{
+    raft_log_ops_t ops;
+    void* store;
+    raft_server_t* me;
+    
+    log_memory_set_ops(&ops);
+    if (!(store = log_memory_new()))
+        return NULL;
+    if (!(me = raft_new_with_log(nodeid, &ops, store)))
+        ops.free(store);
+    return me;
+}
+
+raft_server_t* raft_new_with_log(int nodeid, const raft_log_ops_t* ops,
+                                 void* store)
 {
     raft_server_private_t* me;
+    raft_index_t base;
+    
+    /* the entries before a compacted log's first were applied from a
+     * snapshot we no longer have, so we couldn't apply anything after them */
+    ops->range(store, &base);
+    if (0 < base)
+        return NULL;
     
     if (!(me = calloc(1, sizeof(raft_server_private_t))))
         return NULL;
+    if (!(me->log = log_new(ops, store)))
+    {
+        free(me);
+        return NULL;
+    }
     
     me->current_term = 0;
     me->voted_for = -1;
-    me->current_idx = 0;
+    /* pick up where the stored log ends, and in the term and with the vote
+     * we had */
+    me->current_idx = log_get_base(me->log) + log_count(me->log);
+    if (0 < log_count(me->log))
+        me->current_term = log_get_term(me->log, me->current_idx - 1);
+    log_load_state(me->log, &me->current_term, &me->voted_for);
     me->commit_idx = -1;
     me->last_applied_idx = -1;
     me->timeout_elapsed = 0;
     me->request_timeout = REQUEST_TIMEOUT;
     me->election_timeout = ELECTION_TIMEOUT;
-    me->log = log_new();
+    me->snapshot_last_idx = -1;
+    me->snapshot_last_term = -1;
+    me->snapshot_recv_last_idx = -1;
+    me->learner_threshold = LEARNER_THRESHOLD;
+    me->learners_idx = -1;
+    me->ack_now_entry = -1;
+    me->catchup_threshold = CATCHUP_THRESHOLD;
+    me->catchup_rate = CATCHUP_RATE;
+    me->uncommitted_limit = UNCOMMITTED_LIMIT;
+    me->forward_timeout = FORWARD_TIMEOUT;
+    me->leader_id = -1;
+    me->lag_threshold = LAG_THRESHOLD;
+    me->quorum_rtt = -1;
+    me->seed = rand();
     me->nodeid = nodeid;
     raft_set_state((void*)me, RAFT_STATE_FOLLOWER);
     __log((void*)me, "created new server");
@@ -66,22 +291,40 @@ void raft_set_callbacks(raft_server_t* me_, raft_cbs_t* funcs)
     memcpy(&me->cb, funcs, sizeof(raft_cbs_t));
 }
 
-void raft_free(raft_server_t* me_)
+/**
+ * Free the tables with an element per node. Built with RAFT_NUM_NODES,
+ * they are part of the server */
+static void __free_tables(raft_server_private_t* me)
 {
-    raft_server_private_t* me = (void*)me_;
-    
-    log_free(me->log);
-    free(me_);
+#ifndef RAFT_NUM_NODES
+    free(me->nodes);
+    free(me->votes_for_me);
+    free(me->rtt_scratch);
+    free(me->send_order);
+    free(me->send_scratch);
+    free(me->send_group);
+    me->nodes = NULL;
+    me->votes_for_me = NULL;
+    me->rtt_scratch = NULL;
+    me->send_order = NULL;
+    me->send_scratch = NULL;
+    me->send_group = NULL;
+#endif
 }
 
-void raft_election_start(raft_server_t* me_)
+void raft_free(raft_server_t* me_)
 {
     raft_server_private_t* me = (void*)me_;
+    int i;
     
-    __log(me_, "election starting: %d %d, term: %d",
-          me->election_timeout, me->timeout_elapsed, me->current_term);
-    
-    raft_become_candidate(me_);
+    for (i = 0; i < me->num_nodes; i++)
+        free(me->nodes[i]);
+    __free_tables(me);
+    log_free(me->log);
+    free(me->snapshot);
+    free(me->snapshot_recv);
+    free(me->pending);
+    free(me_);
 }
 
 void raft_become_leader(raft_server_t* me_)
@@ -91,42 +334,103 @@ void raft_become_leader(raft_server_t* me_)
     __log(me_, "becoming leader");
     
     raft_set_state(me_,RAFT_STATE_LEADER);
-    me->voted_for = -1;
-    for (i=0; i<me->num_nodes; i++)
+    me->catchup_budget = 0;
+    /* we don't know that a majority holds our learners either */
+    me->learners_idx = me->current_idx;
+    me->leader_elapsed = 0;
+    me->ack_now_entry = -1;
+    me->ack_now_pending = 0;
+    for (i=0; i<NUM_NODES(me); i++)
     {
         if (me->nodeid == i) continue;
         raft_node_t* p = raft_get_node(me_, i);
         raft_node_set_next_idx(p, raft_get_current_idx(me_));
+        raft_node_set_match_idx(p, -1);
+        raft_node_set_ack_now_idx(p, -1);
+        raft_node_set_catching_up(p, 0);
+        raft_node_set_lag_elapsed(p, 0);
+        raft_node_set_lagging(p, 0);
+        raft_node_heartbeat_clear(p);
         raft_send_appendentries(me_, i);
     }
+    
+    /* counts left from an earlier time we led are stale; nodes are counted
+     * afresh as their first responses tell us how much of our log they hold */
+    log_clear_num_nodes(me->log, me->last_applied_idx + 1);
+    
+    /* ones we sent the last leader that it didn't send back are gone,
+     * unless another node took them from it before it fell */
+    while (0 < me->nunseen)
+        __unseen_done_oldest(me_, RAFT_ENTRY_UNKNOWN);
+    
+    /* proposals we were holding for the last leader are ours to append */
+    me->leader_id = -1;
+    while (0 < me->nforward)
+    {
+        raft_forward_t f = __forward_take(me);
+        if (1 != raft_accept_entry(me_, me->nodeid, &f.entry, f.id, NULL) &&
+            f.id)
+            __proposal_done(me_, f.id, RAFT_ENTRY_LOST);
+    }
+    me->forward_elapsed = 0;
 }
 
-void raft_become_candidate(raft_server_t* me_)
+static void __become_candidate(raft_server_t* me_)
 {
     raft_server_private_t* me = (void*)me_;
     int i;
     
     __log(me_, "becoming candidate");
     
-    memset(me->votes_for_me, 0, sizeof(int) * me->num_nodes);
+    memset(me->votes_for_me, 0,
+           sizeof(unsigned long) * VOTE_WORDS(NUM_NODES(me)));
+    me->nvotes = 0;
     me->current_term += 1;
-    raft_vote(me_, me->nodeid);
+    me->leader_id = -1;
+    if (0 == raft_vote(me_, me->nodeid))
+    {
+        /* we could vote for someone else in this term after a restart */
+        __log(me_, "can't store our vote, not standing");
+        me->timeout_elapsed = 0;
+        return;
+    }
     raft_set_state(me_, RAFT_STATE_CANDIDATE);
     
     /* we need a random factor here to prevent simultaneous candidates */
-    me->timeout_elapsed = rand() % 500;
+    me->timeout_elapsed = rand_r(&me->seed) % 500;
     
-    for (i=0; i<me->num_nodes; i++)
+    for (i=0; i<NUM_NODES(me); i++)
     {
         if (me->nodeid == i) continue;
+        if (!raft_node_is_voting(me->nodes[i])) continue;
         raft_send_requestvote(me_, i);
     }
     
     /* so that when there is one device only, automatically become master */
-    if (raft_votes_is_majority(me->num_nodes, raft_get_nvotes_for_me(me_)))
+    if (raft_votes_is_majority(me->num_voting,
+                               raft_get_nvotes_for_me(me_)))
         raft_become_leader(me_);
 }
 
+void raft_become_candidate(raft_server_t* me_)
+{
+    raft_server_private_t* me = (void*)me_;
+    
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_BECOME_CANDIDATE, -1, NULL);
+    __become_candidate(me_);
+}
+
+void raft_election_start(raft_server_t* me_)
+{
+    raft_server_private_t* me = (void*)me_;
+    
+    __log(me_, "election starting: %d %d, term: %lld",
+          me->election_timeout, me->timeout_elapsed, me->current_term);
+    
+    __become_candidate(me_);
+}
+
 void raft_become_follower(raft_server_t* me_)
 {
     raft_server_private_t* me = (void*)me_;
@@ -134,14 +438,313 @@ void raft_become_follower(raft_server_t* me_)
     __log(me_, "becoming follower");
     
     raft_set_state(me_, RAFT_STATE_FOLLOWER);
-    me->voted_for = -1;
+    
+    /* clients that were waiting on us must now propose elsewhere */
+    if (me->busy)
+    {
+        me->busy = 0;
+        if (me->cb.capacity)
+            me->cb.capacity(me_);
+    }
+}
+
+/**
+ * Heartbeat the nodes that have been idle for a request timeout. Nodes we
+ * are replicating to already know we lead, so their links are left to
+ * carry entries. Those that haven't acknowledged all we've sent are sent
+ * it again sooner, once they've been quiet for their retransmit timeout */
+static void __send_heartbeats(raft_server_t* me_, int msec)
+{
+    raft_server_private_t* me = (void*)me_;
+    int i, n;
+    
+    for (i=0, n=0; i<NUM_NODES(me); i++)
+    {
+        int node = me->send_order[i];
+        raft_node_t* p = me->nodes[node];
+        
+        if (me->nodeid == node) continue;
+        raft_node_tick(p, msec);
+        if (raft_node_get_next_idx(p) < me->current_idx)
+        {
+            /* answers arrive between our periodic calls, so allow for one */
+            int slack = msec < RETRANSMIT_SLACK ? RETRANSMIT_SLACK : msec;
+            int timeout = raft_node_get_retransmit_timeout(p, slack,
+                                                           me->request_timeout);
+            if (!raft_node_retransmit_check(p, timeout) &&
+                !raft_node_heartbeat_check(p, me->request_timeout))
+                continue;
+        }
+        else if (!raft_node_heartbeat_check(p, me->request_timeout))
+            continue;
+        
+        /* a stream quiet for this long lost whatever it sent that hasn't
+         * been acked; no rejection will say so if nothing followed it */
+        if (raft_node_is_catching_up(p) &&
+            raft_node_get_next_idx(p) < raft_node_get_catchup_idx(p))
+            raft_node_set_catchup_idx(p, raft_node_get_next_idx(p) + 1);
+        me->send_scratch[n++] = node;
+    }
+    raft_send_appendentries_scratch(me_, n);
+}
+
+/**
+ * Send the proposals we're holding to the leader on their own, as no
+ * appendentries response came along for them to ride on */
+static void __send_proposals(raft_server_t* me_)
+{
+    raft_server_private_t* me = (void*)me_;
+    
+    if (!me->cb.send_proposal || -1 == me->leader_id)
+        return;
+    while (0 < me->nforward)
+    {
+        raft_forward_t f = __forward_take(me);
+        __unseen_add(me, &f);
+        me->cb.send_proposal(me_, me->leader_id, &f.entry);
+    }
+    me->forward_elapsed = 0;
+}
+
+/**
+ * Send the appendentries response we've been holding back, unless its term
+ * has since ended */
+static void __send_held_ack(raft_server_t* me_)
+{
+    raft_server_private_t* me = (void*)me_;
+    
+    if (0 == me->nacks)
+        return;
+    __log(me_, "SENDING %d COALESCED ACKS to %d", me->nacks, me->ack_node);
+    me->nacks = 0;
+    if (me->ack.term != me->current_term)
+        return;
+    
+    if (HAS_HOOK(me, send_appendentries_response))
+        HOOK(me, send_appendentries_response)(me_, me->ack_node, &me->ack);
+}
+
+/**
+ * Hold back a successful appendentries response, to be merged with those
+ * that follow it into one cumulative response. Within a term the leader's
+ * log only grows, so the highest current_idx we've acked still holds
+ * @return 1 if the response was held; 0 if it must go out now */
+static int __hold_ack(raft_server_t* me_, int node, msg_appendentries_t* ae,
+                      msg_appendentries_response_t* r)
+{
+    raft_server_private_t* me = (void*)me_;
+    
+    if (0 == me->ack_delay || !r->success || r->n_proposals)
+        return 0;
+    
+    if (0 < me->nacks && (me->ack_node != node || me->ack.term != r->term))
+        __send_held_ack(me_);
+    
+    /* the leader is waiting on this to commit. Nor can a response to
+     * something that brought us nothing new while the leader has committed
+     * entries we don't hold: what it sent them in was lost, and this tells
+     * it where to resend from */
+    if (ae->ack_now ||
+        (me->current_idx <= ae->leader_commit &&
+         (0 == ae->n_entries || r->current_idx < me->current_idx)))
+    {
+        /* this response covers what we've held */
+        if (0 < me->nacks && r->current_idx < me->ack.current_idx)
+            r->current_idx = me->ack.current_idx;
+        me->nacks = 0;
+        return 0;
+    }
+    
+    if (0 == me->nacks)
+    {
+        me->ack = *r;
+        me->ack_node = node;
+        me->ack_elapsed = 0;
+    }
+    else
+    {
+        if (me->ack.current_idx < r->current_idx)
+            me->ack.current_idx = r->current_idx;
+        me->ack.quorum_rtt = r->quorum_rtt;
+        /* the oldest timestamp, so that the leader's RTT counts the time we
+         * hold acks for and it doesn't resend what we're holding */
+    }
+    
+    me->nacks++;
+    if (0 < me->ack_max && me->ack_max <= me->nacks)
+        __send_held_ack(me_);
+    return 1;
+}
+
+/**
+ * @return the k-th smallest of the 'n' ints in 'a', reordering them. This
+ * is linear on average, where sorting would grow faster than the cluster */
+static int __select_int(int* a, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+    
+    while (lo < hi)
+    {
+        int pivot = a[lo + (hi - lo) / 2];
+        int i = lo, j = hi;
+        
+        while (i <= j)
+        {
+            while (a[i] < pivot) i++;
+            while (pivot < a[j]) j--;
+            if (i <= j)
+            {
+                int t = a[i];
+                a[i++] = a[j];
+                a[j--] = t;
+            }
+        }
+        if (k <= j)
+            hi = j;
+        else if (i <= k)
+            lo = i;
+        else
+            break;
+    }
+    return a[k];
+}
+
+static int __quorum_rtt(raft_server_t* me_)
+{
+    raft_server_private_t* me = (void*)me_;
+    /* acks, besides our own, that make a majority */
+    int k = me->num_voting / 2;
+    int i, n;
+    
+    if (0 == k)
+        return 0;
+    
+    for (i=0, n=0; i<NUM_NODES(me); i++)
+    {
+        raft_node_t* p = me->nodes[i];
+        
+        if (me->nodeid == i || !raft_node_is_voting(p)) continue;
+        if (-1 == raft_node_get_cost(p)) continue;
+        me->rtt_scratch[n++] = raft_node_get_cost(p);
+    }
+    
+    if (n < k)
+        return -1;
+    return __select_int(me->rtt_scratch, n, k - 1);
+}
+
+/**
+ * @return how much longer than the election timeout we wait before standing
+ * for election. Nodes we don't know to be well connected wait longest */
+static int __election_bias(raft_server_t* me_)
+{
+    raft_server_private_t* me = (void*)me_;
+    int bias;
+    
+    if (-1 == me->quorum_rtt)
+        return me->election_timeout / 2;
+    bias = me->quorum_rtt * ELECTION_RTT_BIAS;
+    if (me->election_timeout / 2 < bias)
+        bias = me->election_timeout / 2;
+    return bias;
+}
+
+/**
+ * @return 1 if the leader has told us we are a learner */
+static int __is_learner(raft_server_t* me_)
+{
+    raft_node_t* p = raft_get_node(me_, raft_get_nodeid(me_));
+    return p && !raft_node_is_voting(p);
+}
+
+/**
+ * @return sort key for sending; nodes we haven't measured go last */
+static unsigned int __send_key(raft_server_t* me_, int node)
+{
+    raft_server_private_t* me = (void*)me_;
+    return (unsigned int)raft_node_get_cost(me->nodes[node]);
+}
+
+static void __schedule(raft_server_t* me_, int msec)
+{
+    raft_server_private_t* me = (void*)me_;
+    int i, j, refresh;
+    
+    /* insertion sort, as the order rarely changes between calls */
+    for (i=1; i<NUM_NODES(me); i++)
+    {
+        int node = me->send_order[i];
+        unsigned int key = __send_key(me_, node);
+        
+        for (j=i; 0 < j && key < __send_key(me_, me->send_order[j - 1]); j--)
+            me->send_order[j] = me->send_order[j - 1];
+        me->send_order[j] = node;
+    }
+    
+    me->ack_rate_elapsed += msec;
+    refresh = ACK_RATE_PERIOD <= me->ack_rate_elapsed;
+    
+    for (i=0; i<NUM_NODES(me); i++)
+    {
+        raft_node_t* p = me->nodes[i];
+        int cost = raft_node_get_cost(p);
+        
+        if (me->nodeid == i) continue;
+        
+        if (refresh)
+            raft_node_update_ack_rate(p, me->ack_rate_elapsed);
+        
+        raft_node_set_slow(p, 0 < me->quorum_rtt && -1 != cost &&
+                           me->quorum_rtt * SLOW_RTT_RATIO < cost * 1000);
+        
+        if (0 < me->lag_threshold &&
+            me->lag_threshold < me->current_idx - raft_node_get_next_idx(p))
+        {
+            raft_node_set_lag_elapsed(p, raft_node_get_lag_elapsed(p) + msec);
+            if (!raft_node_is_lagging(p) &&
+                me->election_timeout <= raft_node_get_lag_elapsed(p))
+            {
+                __log(me_, "node %d is lagging", i);
+                raft_node_set_lagging(p, 1);
+                if (me->cb.node_lagging)
+                    me->cb.node_lagging(me_, i, 1);
+            }
+        }
+        else
+        {
+            raft_node_set_lag_elapsed(p, 0);
+            if (raft_node_is_lagging(p))
+            {
+                __log(me_, "node %d has caught up", i);
+                raft_node_set_lagging(p, 0);
+                if (me->cb.node_lagging)
+                    me->cb.node_lagging(me_, i, 0);
+            }
+        }
+    }
+    
+    if (refresh)
+        me->ack_rate_elapsed = 0;
 }
 
 int raft_periodic(raft_server_t* me_, int msec_since_last_period)
 {
     raft_server_private_t* me = (void*)me_;
+    int i;
+    
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_PERIODIC, -1,
+                         &msec_since_last_period);
     
     me->timeout_elapsed += msec_since_last_period;
+    me->clock = (me->clock + msec_since_last_period) & RAFT_TIMESTAMP_MASK;
+    
+    for (i=0; i<NUM_NODES(me); i++)
+    {
+        if (me->nodeid == i) continue;
+        raft_node_probe_check(me->nodes[i], me->clock, me->request_timeout);
+    }
+    me->quorum_rtt = __quorum_rtt(me_);
     
     if (me->state == RAFT_STATE_FOLLOWER) {
         if (me->last_applied_idx < me->commit_idx)
@@ -151,16 +754,54 @@ int raft_periodic(raft_server_t* me_, int msec_since_last_period)
         }
     }
     
+    if (0 < me->snapshot_threshold &&
+        me->snapshot_threshold <= me->last_applied_idx - me->snapshot_last_idx)
+    {
+        if (0 == raft_snapshot(me_))
+            return 0;
+    }
+    
     if (me->state == RAFT_STATE_LEADER) {
-        if (me->request_timeout <= me->timeout_elapsed)
-        {
-            raft_send_appendentries_all(me_);
-            me->timeout_elapsed = 0;
-        }
+        me->leader_elapsed += msec_since_last_period;
+        __schedule(me_, msec_since_last_period);
+        
+        /* heartbeats are timed per node */
+        me->timeout_elapsed = 0;
+        __send_heartbeats(me_, msec_since_last_period);
+        
+        me->catchup_budget += msec_since_last_period * me->catchup_rate;
+        if (CATCHUP_BURST * 1000 < me->catchup_budget)
+            me->catchup_budget = CATCHUP_BURST * 1000;
+        raft_send_catchup(me_);
     }
     else
     {
-        if (me->election_timeout <= me->timeout_elapsed)
+        if (0 < me->nforward)
+        {
+            me->forward_elapsed += msec_since_last_period;
+            if (me->forward_timeout <= me->forward_elapsed)
+                __send_proposals(me_);
+        }
+        
+        if (0 < me->nacks)
+        {
+            me->ack_elapsed += msec_since_last_period;
+            if (me->ack_delay <= me->ack_elapsed)
+                __send_held_ack(me_);
+        }
+        
+        /* a leader that hasn't sent back a proposal by now has turned it
+         * away, or lost it along with its leadership */
+        for (i=0; i<me->nunseen; i++)
+            me->unseen[(me->unseen_head + i) % FORWARD_MAX].elapsed +=
+                msec_since_last_period;
+        while (0 < me->nunseen &&
+               me->election_timeout <= me->unseen[me->unseen_head].elapsed)
+            __unseen_done_oldest(me_, RAFT_ENTRY_UNKNOWN);
+        
+        /* learners don't stand for election */
+        if (me->election_timeout + __election_bias(me_) <= me->timeout_elapsed &&
+            !__is_learner(me_))
         {
             raft_election_start(me_);
         }
@@ -169,10 +810,66 @@ int raft_periodic(raft_server_t* me_, int msec_since_last_period)
     return 1;
 }
 
-raft_entry_t* raft_get_entry_from_idx(raft_server_t* me_, int etyidx)
+int raft_get_entry_from_idx(raft_server_t* me_, raft_index_t etyidx,
+                            raft_entry_t* ety)
 {
     raft_server_private_t* me = (void*)me_;
-    return log_get_from_idx(me->log, etyidx);
+    msg_entry_t* e;
+    
+    if (!(e = log_get_entry(me->log, etyidx)))
+        return 0;
+    ety->term = log_get_term(me->log, etyidx);
+    ety->entry = *e;
+    ety->num_nodes = log_get_num_nodes(me->log, etyidx);
+    return 1;
+}
+
+msg_entry_t* raft_get_entry_data_from_idx(raft_server_t* me_, raft_index_t etyidx)
+{
+    raft_server_private_t* me = (void*)me_;
+    return log_get_entry(me->log, etyidx);
+}
+
+/**
+ * Stop counting the node as holding the entries it has acked. Its acks for
+ * entries we haven't applied were counted from last_applied_idx + 1 up to
+ * its match_idx */
+static void __unmark_acks(raft_server_private_t* me, raft_node_t* p)
+{
+    raft_index_t i;
+    
+    if (!raft_is_leader((void*)me) || !raft_node_is_voting(p))
+        return;
+    for (i = me->last_applied_idx + 1; i <= raft_node_get_match_idx(p); i++)
+        log_unmark_node_has_committed(me->log, i);
+    
+    /* nor wait on an ack we asked it for */
+    if (raft_node_get_ack_now_idx(p) == me->ack_now_entry &&
+        raft_node_get_match_idx(p) < me->ack_now_entry &&
+        0 < me->ack_now_pending)
+        me->ack_now_pending--;
+}
+
+/**
+ * Make the node a voter or a learner, keeping our counts in step */
+static void __set_voting(raft_server_private_t* me, int node, int voting)
+{
+    raft_node_t* p = me->nodes[node];
+    int i;
+    
+    if (raft_node_is_voting(p) == voting)
+        return;
+    if (!voting)
+        __unmark_acks(me, p);
+    raft_node_set_voting(p, voting);
+    me->num_voting += voting ? 1 : -1;
+    if (me->votes_for_me[node / VOTE_BITS] & (1UL << (node % VOTE_BITS)))
+        me->nvotes += voting ? 1 : -1;
+    
+    me->n_learners = 0;
+    for (i = 0; i < NUM_NODES(me) && me->n_learners < RAFT_LEARNERS_MAX; i++)
+        if (!raft_node_is_voting(me->nodes[i]))
+            me->learners[me->n_learners++] = i;
 }
 
 int raft_recv_appendentries_response(raft_server_t* me_,
@@ -181,192 +878,591 @@ int raft_recv_appendentries_response(raft_server_t* me_,
     raft_server_private_t* me = (void*)me_;
     raft_node_t* p;
     
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_RECV_APPENDENTRIES_RESPONSE,
+                         node, r);
+    
     __log(me_, "RECEIVED APPENDENTRIES RESPONSE FROM: %d", node);
     __log(me_, "success %d", r->success);
-    __log(me_, "current_idx %d", r->current_idx);
-    __log(me_, "first_idx %d", r->first_idx);
+    __log(me_, "current_idx %lld", r->current_idx);
+    __log(me_, "first_idx %lld", r->first_idx);
     
     p = raft_get_node(me_, node);
+    raft_node_probe_response(p, me->clock, r->timestamp);
+    raft_node_answered(p);
+    raft_node_set_ack_delay(p, r->ack_delay);
+    
+    /* the node has moved on to a later term, so we no longer lead. Without
+     * this a deposed leader would keep resending to nodes that reject it */
+    if (me->current_term < r->term)
+    {
+        raft_set_current_term(me_, r->term);
+        raft_become_follower(me_);
+    }
+    
+    /* an entry proposed to the node, riding with the ack */
+    if (r->n_proposals)
+    {
+        if (!raft_is_leader(me_))
+            __forward(me, &r->proposal, 0);
+        else if (RAFT_ERR_BUSY == raft_accept_entry(me_, node, &r->proposal, 0, NULL))
+            __log(me_, "too many uncommitted entries, dropping proposal from %d", node);
+    }
+    
+    if (!raft_is_leader(me_))
+        return 1;
+    
+    /* a markedly better placed node holds everything we do. Stop sending
+     * heartbeats, so that its shorter election timeout hands it leadership.
+     * Having our whole log, it is sure to win, and commits what we haven't */
+    if (r->success && me->current_idx <= r->current_idx &&
+        raft_node_is_voting(p) &&
+        me->election_timeout <= me->leader_elapsed &&
+        0 < me->quorum_rtt && 0 <= r->quorum_rtt &&
+        r->quorum_rtt * 1000 < me->quorum_rtt * TRANSFER_RTT_RATIO)
+    {
+        __log(me_, "handing leadership to %d, quorum rtt %d vs our %d",
+              node, r->quorum_rtt, me->quorum_rtt);
+        /* we keep our vote for ourselves, so can't vote again this term.
+         * The node is elected in the next */
+        raft_become_follower(me_);
+        me->timeout_elapsed = 0;
+        return 1;
+    }
     
     if (r->success == 0)
     {
         /* If AppendEntries fails because of log inconsistency:
-         decrement nextIndex and retry (§5.3) */
+         decrement nextIndex and retry (Â§5.3) */
         assert(-1 <= raft_node_get_next_idx(p));
-        // TODO does this have test coverage?
-        // TODO can jump back to where node is different instead of iterating
-        raft_node_set_next_idx(p, raft_node_get_next_idx(p)-1);
+        raft_index_t next_idx = raft_node_get_next_idx(p) - 1;
+        
+        /* the node is missing entries rather than holding conflicting ones,
+         * so jump straight back to where its log ends */
+        if (r->current_idx < next_idx)
+            next_idx = r->current_idx;
+        
+        /* an empty log still agrees with ours */
+        if (next_idx < 0)
+            next_idx = 0;
+        
+        if (raft_node_is_catching_up(p))
+        {
+            /* an entry we streamed was lost, so everything we streamed after
+             * it is rejected too. Only rewind once per gap */
+            if (r->current_idx == raft_node_get_next_idx(p) &&
+                r->current_idx < raft_node_get_catchup_idx(p))
+                raft_node_set_catchup_idx(p, r->current_idx);
+            return 1;
+        }
+        
+        raft_node_set_next_idx(p, next_idx);
         raft_send_appendentries(me_, node);
         return 1;
     }
     
     // the node didn't change its current_idx
-    // we have nothing to do
     if (raft_node_get_next_idx(p) == r->current_idx) {
+        /* what we last sent should have reached it by now, so it was lost.
+         * Anything sent within an RTT may still be on its way */
+        if (r->current_idx < me->current_idx &&
+            !raft_node_is_catching_up(p) &&
+            -1 != raft_node_get_rtt(p) &&
+            raft_node_get_rtt(p) < raft_node_get_send_elapsed(p))
+        {
+            __log(me_, "node %d made no progress, sending again", node);
+            raft_send_appendentries(me_, node);
+        }
+        return 1;
+    }
+    
+    // acks for streamed entries can arrive after later ones
+    if (raft_node_is_catching_up(p) &&
+        r->current_idx < raft_node_get_next_idx(p)) {
         return 1;
     }
     
     // set to 1 if we updated our commit_idx
     int committedNewEntry = 0;
     
-    for (int i=r->first_idx; i<r->current_idx; i++) {
-        __log(me_, "marking index %d as committed", i);
-        // TODO! we need to keep track of which nodes have committed so we don't double count...
-        log_mark_node_has_committed(me->log, i);
+    if (raft_node_is_voting(p))
+    {
+        /* only count entries we haven't already counted for this node. A
+         * success vouches for the node's whole log up to current_idx, which
+         * includes entries left over from earlier terms */
+        raft_index_t first_idx = raft_node_get_match_idx(p) + 1;
+        if (first_idx <= me->last_applied_idx)
+            first_idx = me->last_applied_idx + 1;
+        
+        for (raft_index_t i=first_idx; i<r->current_idx; i++) {
+            __log(me_, "marking index %lld as committed", i);
+            log_mark_node_has_committed(me->log, i);
+        }
     }
+    /* one change at a time: two changes a majority hasn't yet heard of
+     * could leave two disjoint majorities */
+    else if (me->current_idx - me->learner_threshold <= r->current_idx &&
+             me->learners_idx <= me->commit_idx)
+    {
+        __log(me_, "promoting learner %d", node);
+        __set_voting(me, node, 1);
+        me->learners_idx = me->current_idx;
+        
+        /* the learner's earlier acks weren't counted. Count them up to
+         * match_idx, as __unmark_acks takes them away again */
+        raft_index_t end_idx = r->current_idx;
+        if (end_idx <= raft_node_get_match_idx(p))
+            end_idx = raft_node_get_match_idx(p) + 1;
+        for (raft_index_t i=me->last_applied_idx + 1; i<end_idx; i++)
+            log_mark_node_has_committed(me->log, i);
+    }
+    
+    /* an ack we asked for has come */
+    if (raft_node_get_ack_now_idx(p) == me->ack_now_entry &&
+        raft_node_get_match_idx(p) < me->ack_now_entry &&
+        me->ack_now_entry < r->current_idx && 0 < me->ack_now_pending)
+        me->ack_now_pending--;
     
+    if (raft_node_get_match_idx(p) < r->current_idx - 1)
+    {
+        raft_node_add_acked(p, (int)(r->current_idx - 1 - raft_node_get_match_idx(p)));
+        raft_node_set_match_idx(p, r->current_idx - 1);
+    }
     raft_node_set_next_idx(p, r->current_idx);
     
-    // TODO! rewrite this yucky code
-    while (1)
+    if (raft_node_is_catching_up(p))
     {
-        raft_entry_t* e;
-        
-        e = log_get_from_idx(me->log, me->last_applied_idx + 1);
-        
-        /* majority has this */
-        if (e) {
-            __log(me_, "entry %d has %d commits", me->last_applied_idx + 1, e->num_nodes);
-        }
-        if (e && me->num_nodes / 2 <= e->num_nodes)
+        /* we've streamed everything we have; ordinary replication takes
+         * over from here */
+        if (me->current_idx <= raft_node_get_catchup_idx(p))
         {
-            if (0 == raft_apply_entry(me_)) break;
-            else committedNewEntry = 1;
+            __log(me_, "node %d leaving catch-up", node);
+            raft_node_set_catching_up(p, 0);
         }
-        else
-        {
+    }
+    else if (0 < me->catchup_threshold &&
+             me->catchup_threshold < me->current_idx - r->current_idx)
+    {
+        __log(me_, "node %d entering catch-up", node);
+        raft_node_set_catching_up(p, 1);
+        if (raft_node_get_catchup_idx(p) < r->current_idx ||
+            me->current_idx < raft_node_get_catchup_idx(p))
+            raft_node_set_catchup_idx(p, r->current_idx);
+        raft_send_catchup(me_);
+    }
+    
+    /* entries a majority holds. One from an earlier term only commits
+     * along with an entry of ours that follows it (§5.4.2) */
+    raft_index_t commit_idx = me->last_applied_idx;
+    for (raft_index_t idx = me->last_applied_idx + 1; ; idx++)
+    {
+        raft_term_t term = log_get_term(me->log, idx);
+        unsigned int num_nodes = log_get_num_nodes(me->log, idx);
+        
+        if (-1 == term || num_nodes < me->num_voting / 2)
             break;
-        }
+        __log(me_, "entry %lld has %d commits", idx, num_nodes);
+        if (term == me->current_term)
+            commit_idx = idx;
     }
+    while (me->last_applied_idx < commit_idx && raft_apply_entry(me_))
+        committedNewEntry = 1;
     
     // optimization
+    if (raft_node_is_catching_up(p))
+        return 1;
     if (committedNewEntry || raft_node_get_next_idx(p) < me->current_idx)
         raft_send_appendentries(me_, node);
     
     return 1;
 }
 
+/**
+ * Take on the leader's learners, so that we agree with it on who votes. We
+ * may be one of them ourselves */
+static void __adopt_learners(raft_server_private_t* me, msg_appendentries_t* ae)
+{
+    int i, n = 0;
+    
+    for (i = 0; i < ae->n_learners; i++)
+    {
+        int node = ae->learners[i];
+        
+        if (node < 0 || NUM_NODES(me) <= node)
+            continue;
+        __set_voting(me, node, 0);
+        n++;
+    }
+    
+    /* we hold a learner the leader has since promoted */
+    if (me->num_voting + n < NUM_NODES(me))
+    {
+        for (i = 0; i < NUM_NODES(me); i++)
+            __set_voting(me, i, 1);
+        for (i = 0; i < ae->n_learners; i++)
+            if (0 <= ae->learners[i] && ae->learners[i] < NUM_NODES(me))
+                __set_voting(me, ae->learners[i], 0);
+    }
+}
+
 int raft_recv_appendentries(raft_server_t* me_, const int node, msg_appendentries_t* ae)
 {
     raft_server_private_t* me = (void*)me_;
     msg_appendentries_response_t r;
     
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_RECV_APPENDENTRIES, node, ae);
+    
     me->timeout_elapsed = 0;
     
+    memset(&r, 0, sizeof(msg_appendentries_response_t));
+    /* a rejection still tells the leader where our log ends */
+    r.term = me->current_term;
+    r.current_idx = raft_get_current_idx(me_);
+    r.first_idx = ae->prev_log_idx + 1;
+    r.quorum_rtt = me->quorum_rtt;
+    r.timestamp = ae->timestamp;
+    r.ack_delay = me->ack_delay;
+    
     __log(me_, "RECEIVED APPENDENTRIES FROM: %d", node);
-    __log(me_, "term %d", ae->term);
+    __log(me_, "term %lld", ae->term);
     __log(me_, "leader_id %d", ae->leader_id);
-    __log(me_, "prev_log_idx %d", ae->prev_log_idx);
-    __log(me_, "prev_log_term %d", ae->prev_log_term);
+    __log(me_, "prev_log_idx %lld", ae->prev_log_idx);
+    __log(me_, "prev_log_term %lld", ae->prev_log_term);
     __log(me_, "n_entries %d", ae->n_entries);
-    __log(me_, "entry_term %d", ae->entry_term);
-    __log(me_, "leader_commit %d", ae->leader_commit);
+    __log(me_, "entry_term %lld", ae->entry_term);
+    __log(me_, "leader_commit %lld", ae->leader_commit);
     
     /* we've found a leader who is legitimate */
     if (raft_is_leader(me_) && me->current_term <= ae->term)
         raft_become_follower(me_);
     
-    /* 1. Reply false if term < currentTerm (§5.1) */
+    /* 1. Reply false if term < currentTerm (Â§5.1) */
     if (ae->term < me->current_term)
     {
-        __log(me_, "AE term %d is less than current term %d", ae->term, me->current_term);
+        __log(me_, "AE term %lld is less than current term %lld", ae->term, me->current_term);
         r.success = 0;
         goto done;
     }
+    me->leader_id = node;
+    __adopt_learners(me, ae);
     
     /* not the first appendentries we've received */
     if (-1 != ae->prev_log_idx)
     {
-        raft_entry_t* e;
+        raft_term_t term;
         
-        if ((e = raft_get_entry_from_idx(me_, ae->prev_log_idx)))
+        /* entries within our snapshot are committed, so they can't conflict */
+        if (ae->prev_log_idx == me->snapshot_last_idx)
         {
-            /* 2. Reply false if log doesnt contain an entry at prevLogIndex
-             whose term matches prevLogTerm (§5.3) */
-            if (e->term != ae->prev_log_term)
+            if (me->snapshot_last_term != ae->prev_log_term)
+            {
+                __log(me_, "AE term doesn't match snapshot");
+                r.success = 0;
+                goto done;
+            }
+        }
+        else if (me->snapshot_last_idx < ae->prev_log_idx)
+        {
+            term = log_get_term(me->log, ae->prev_log_idx);
+            if (-1 == term)
+            {
+                __log(me_, "AE no log at prev_idx");
+                r.success = 0;
+                goto done;
+            }
+            
+            /* 2. Reply false if log doesnÂt contain an entry at prevLogIndex
+             whose term matches prevLogTerm (Â§5.3) */
+            if (term != ae->prev_log_term)
             {
                 __log(me_, "AE term doesn't match prev_idx");
                 r.success = 0;
+                /* the rest of that term is likely to conflict too, so have
+                 * the leader back up to where it started. Committed entries
+                 * can't conflict, so go no further back than those */
+                r.current_idx = log_get_first_idx_of_run(me->log, ae->prev_log_idx);
+                if (r.current_idx <= me->commit_idx)
+                    r.current_idx = me->commit_idx + 1;
                 goto done;
             }
+        }
+        
+        /* 3. If an existing entry conflicts with a new one (same index
+         but different terms), delete the existing entry and all that
+         follow it (Â§5.3) */
+        term = log_get_term(me->log, ae->prev_log_idx+1);
+        if (-1 != term)
+        {
+            if (term != ae->entry_term) {
+                __log(me_, "AE deleting term because of inconsistency");
+                log_delete(me->log, ae->prev_log_idx+1);
+                me->current_idx = ae->prev_log_idx+1;
+                
+                /* entries we proposed that a new leader overwrote */
+                while (__pending_newest(me) &&
+                       ae->prev_log_idx+1 <= __pending_newest(me)->idx)
+                    __pending_done_newest(me_, RAFT_ENTRY_LOST);
+            }
+        }
+    }
+    
+    /* 5. If leaderCommit > commitIndex, set commitIndex =
+     min(leaderCommit, index of last new entry). Entries beyond those this
+     appendentries vouched for may still conflict with the leader's */
+    raft_index_t myCommitIndex = raft_get_commit_idx(me_);
+    if (myCommitIndex < ae->leader_commit)
+    {
+        raft_index_t newCommitIndex = ae->prev_log_idx + ae->n_entries;
+        if (me->current_idx - 1 < newCommitIndex)
+            newCommitIndex = me->current_idx - 1;
+        if (ae->leader_commit < newCommitIndex)
+            newCommitIndex = ae->leader_commit;
+        
+        if (newCommitIndex > myCommitIndex) {
+            raft_set_commit_idx(me_, newCommitIndex);
+            while (1 == raft_apply_entry(me_));
+        }
+    }
+    
+    if (raft_is_candidate(me_))
+        raft_become_follower(me_);
+    
+    raft_set_current_term(me_, ae->term);
+    
+    raft_entry_t c;
+    
+    if (ae->n_entries == 1) {
+        if (raft_get_current_idx(me_) >  ae->prev_log_idx + 1) {
+            __log(me_, "AE got duplicate message");
+            r.success = 1;
+            r.current_idx = ae->prev_log_idx + 2;
+            r.first_idx = ae->prev_log_idx + 1;
+            goto done;
+        }
+        
+        c.term = ae->entry_term;
+        c.entry = ae->entry;
+        if (0 == raft_append_entry(me_, &c) || 0 == log_sync(me->log))
+        {
+            __log(me_, "AE failure; couldn't append entry");
+            r.success = 0;
+            goto done;
+        }
+        if (0 < me->nunseen)
+            __unseen_check(me_, &c, me->current_idx - 1);
+    }
+    
+    
+    r.term = me->current_term;
+    r.success = 1;
+    /* only vouch for what the leader has checked; anything after it in our
+     * log may be left over from an old term */
+    r.current_idx = ae->prev_log_idx + 1 + ae->n_entries;
+    r.first_idx = ae->prev_log_idx + 1;
+
+done:
+    /* a proposal we're holding rides along to the leader */
+    if (0 < me->nforward && node == me->leader_id)
+    {
+        raft_forward_t f = __forward_take(me);
+        __unseen_add(me, &f);
+        r.n_proposals = 1;
+        r.proposal = f.entry;
+        if (0 == me->nforward)
+            me->forward_elapsed = 0;
+    }
+    
+    if (__hold_ack(me_, node, ae, &r))
+        return 1;
+    __send_held_ack(me_);
+    
+    __log(me_, "SENDING APPENDENTRIES RESPONSE to %d", node);
+    __log(me_, "term: %lld", r.term);
+    __log(me_, "success: %d", r.success);
+    __log(me_, "current_idx: %lld", r.current_idx);
+    __log(me_, "first_idx: %lld", r.first_idx);
+    if (HAS_HOOK(me, send_appendentries_response))
+        HOOK(me, send_appendentries_response)(me_, node, &r);
+    return 1;
+}
+
+int raft_recv_installsnapshot(raft_server_t* me_, int node,
+                              msg_installsnapshot_t* is)
+{
+    raft_server_private_t* me = (void*)me_;
+    msg_installsnapshot_response_t r;
+    int kept;
+    
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_RECV_INSTALLSNAPSHOT, node, is);
+    
+    me->timeout_elapsed = 0;
+    
+    __log(me_, "RECEIVED INSTALLSNAPSHOT FROM: %d", node);
+    __log(me_, "last_idx %lld", is->last_idx);
+    __log(me_, "offset %d", is->offset);
+    __log(me_, "len %d", is->len);
+    
+    r.term = me->current_term;
+    r.last_idx = is->last_idx;
+    r.offset = 0;
+    r.complete = 0;
+    
+    if (is->term < me->current_term)
+        goto done;
+    
+    if (raft_is_leader(me_) || raft_is_candidate(me_))
+        raft_become_follower(me_);
+    raft_set_current_term(me_, is->term);
+    r.term = me->current_term;
+    
+    /* we already have everything this snapshot covers */
+    if (is->last_idx <= me->commit_idx)
+    {
+        r.offset = is->offset + is->len;
+        r.complete = 1;
+        goto done;
+    }
+    
+    /* the leader has started streaming a different snapshot */
+    if (me->snapshot_recv_last_idx != is->last_idx ||
+        me->snapshot_recv_last_term != is->last_term)
+    {
+        me->snapshot_recv_last_idx = is->last_idx;
+        me->snapshot_recv_last_term = is->last_term;
+        me->snapshot_recv_len = 0;
+    }
+    
+    /* only accept the chunk that continues what we hold. Anything else is a
+     * duplicate or arrived after a gap; our reply tells the leader where to
+     * resume from */
+    if (is->offset == me->snapshot_recv_len &&
+        0 <= is->len && is->len <= RAFT_SNAPSHOT_CHUNK_SIZE)
+    {
+        if (me->snapshot_recv_size < me->snapshot_recv_len + is->len)
+        {
+            int size = me->snapshot_recv_size * 2 + is->len;
+            unsigned char* temp = realloc(me->snapshot_recv, size);
+            if (!temp)
+                return 0;
+            me->snapshot_recv = temp;
+            me->snapshot_recv_size = size;
+        }
+        memcpy(me->snapshot_recv + me->snapshot_recv_len, is->data, is->len);
+        me->snapshot_recv_len += is->len;
+        
+        if (is->done)
+        {
+            __log(me_, "restoring snapshot up to %lld", is->last_idx);
+            
+            if (me->compaction_key_len)
+            {
+                if (0 == raft_compact_load(me_, me->snapshot_recv,
+                                           me->snapshot_recv_len,
+                                           me->last_applied_idx))
+                    return 0;
+            }
+            else if (me->cb.snapshot_load &&
+                     0 == me->cb.snapshot_load(me_, me->snapshot_recv,
+                                               me->snapshot_recv_len))
+                return 0;
             
-            /* 3. If an existing entry conflicts with a new one (same index
-             but different terms), delete the existing entry and all that
-             follow it (§5.3) */
-            raft_entry_t* e2;
-            if ((e2 = raft_get_entry_from_idx(me_, ae->prev_log_idx+1)))
+            /* keep entries that follow the snapshot if our log agrees with
+             * it; otherwise the snapshot replaces our entire log */
+            kept = log_get_term(me->log, is->last_idx) == is->last_term;
+            if (kept)
+            {
+                log_compact(me->log, is->last_idx);
+            }
+            else
             {
-                if (e2->term != ae->entry_term) {
-                    __log(me_, "AE deleting term because of inconsistency");
-                    log_delete(me->log, ae->prev_log_idx+1);
-                }
+                log_reset(me->log, is->last_idx + 1);
+                me->current_idx = is->last_idx + 1;
             }
-        }
-        else
-        {
-            __log(me_, "AE no log at prev_idx");
-            r.success = 0;
+            
+            free(me->snapshot);
+            me->snapshot = me->snapshot_recv;
+            me->snapshot_len = me->snapshot_recv_len;
+            me->snapshot_last_idx = is->last_idx;
+            me->snapshot_last_term = is->last_term;
+            me->commit_idx = is->last_idx;
+            me->last_applied_idx = is->last_idx;
+            
+            /* entries we proposed that the snapshot holds are committed
+             * if our log agreed with it. If it didn't, we can't tell
+             * whether the entries we dropped made it into the leader's log */
+            while (__pending_oldest(me) &&
+                   (!kept || __pending_oldest(me)->idx <= is->last_idx))
+                __pending_done_oldest(me_, kept ? RAFT_ENTRY_COMMITTED
+                                                : RAFT_ENTRY_UNKNOWN);
+            
+            me->snapshot_recv = NULL;
+            me->snapshot_recv_size = 0;
+            me->snapshot_recv_len = 0;
+            me->snapshot_recv_last_idx = -1;
+            
+            r.offset = me->snapshot_len;
+            r.complete = 1;
             goto done;
         }
     }
     
-    /* 5. If leaderCommit > commitIndex, set commitIndex =
-     min(leaderCommit, last log index) */
-    int myCommitIndex = raft_get_commit_idx(me_);
-    if (myCommitIndex < ae->leader_commit)
-    {
-        int newCommitIndex = me->current_idx - 1 < ae->leader_commit ?
-            me->current_idx - 1 : ae->leader_commit;
-        
-        if (newCommitIndex > myCommitIndex) {
-            raft_set_commit_idx(me_, newCommitIndex);
-            while (1 == raft_apply_entry(me_));
-        }
-    }
+    r.offset = me->snapshot_recv_len;
+
+done:
+    __log(me_, "SENDING INSTALLSNAPSHOT RESPONSE to %d", node);
+    __log(me_, "offset: %d", r.offset);
+    __log(me_, "complete: %d", r.complete);
+    if (HAS_HOOK(me, send_installsnapshot_response))
+        HOOK(me, send_installsnapshot_response)(me_, node, &r);
+    return 1;
+}
+
+int raft_recv_installsnapshot_response(raft_server_t* me_, int node,
+                                       msg_installsnapshot_response_t* r)
+{
+    raft_server_private_t* me = (void*)me_;
+    raft_node_t* p;
     
-    if (raft_is_candidate(me_))
-        raft_become_follower(me_);
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_RECV_INSTALLSNAPSHOT_RESPONSE,
+                         node, r);
     
-    raft_set_current_term(me_, ae->term);
+    __log(me_, "RECEIVED INSTALLSNAPSHOT RESPONSE FROM: %d", node);
+    __log(me_, "offset %d", r->offset);
+    __log(me_, "complete %d", r->complete);
     
-    msg_entry_t cmd = ae->entry;
-    raft_entry_t* c;
+    if (!raft_is_leader(me_))
+        return 1;
     
-    if (ae->n_entries == 1) {
-        if (raft_get_current_idx(me_) >  ae->prev_log_idx + 1) {
-            __log(me_, "AE got duplicate message");
-            r.success = 1;
-            r.current_idx = raft_get_current_idx(me_);
-            r.first_idx = ae->prev_log_idx + 1;
-            goto done;
-        }
-        
-        /* TODO: replace malloc with mempoll/arena */
-        c = malloc(sizeof(raft_entry_t));
-        c->term = ae->entry_term;
-        c->entry = cmd;
-        if (0 == raft_append_entry(me_, c))
-        {
-            __log(me_, "AE failure; couldn't append entry");
-            r.success = 0;
-            goto done;
-        }
+    if (me->current_term < r->term)
+    {
+        raft_set_current_term(me_, r->term);
+        raft_become_follower(me_);
+        return 1;
     }
     
-
-    r.term = me->current_term;
-    r.success = 1;
-    r.current_idx = raft_get_current_idx(me_);
-    r.first_idx = ae->prev_log_idx + 1;
+    if (!(p = raft_get_node(me_, node)))
+        return 0;
+    raft_node_answered(p);
     
-done:
-    __log(me_, "SENDING APPENDENTRIES RESPONSE to %d", node);
-    __log(me_, "term: %d", r.term);
-    __log(me_, "success: %d", r.success);
-    __log(me_, "current_idx: %d", r.current_idx);
-    __log(me_, "first_idx: %d", r.first_idx);
-    if (me->cb.send_appendentries_response)
-        me->cb.send_appendentries_response(me_, node, &r);
+    /* a response to a snapshot we have since replaced */
+    if (r->last_idx != me->snapshot_last_idx)
+        return 1;
+    
+    if (r->complete)
+    {
+        raft_node_set_snapshot_offset(p, -1, 0);
+        if (raft_node_get_next_idx(p) <= r->last_idx)
+            raft_node_set_next_idx(p, r->last_idx + 1);
+    }
+    else
+    {
+        raft_node_set_snapshot_offset(p, r->last_idx, r->offset);
+    }
+    
+    raft_send_appendentries(me_, node);
     return 1;
 }
 
@@ -375,9 +1471,15 @@ int raft_recv_requestvote(raft_server_t* me_, int node, msg_requestvote_t* vr)
     raft_server_private_t* me = (void*)me_;
     msg_requestvote_response_t r;
     
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_RECV_REQUESTVOTE, node, vr);
+    
+    /* a later term, in which we haven't voted yet */
     if (raft_get_current_term(me_) < vr->term)
     {
-        me->voted_for = -1;
+        raft_set_current_term(me_, vr->term);
+        if (!raft_is_follower(me_))
+            raft_become_follower(me_);
     }
     
     if (vr->term < raft_get_current_term(me_) ||
@@ -389,9 +1491,14 @@ int raft_recv_requestvote(raft_server_t* me_, int node, msg_requestvote_t* vr)
         r.vote_granted = 0;
         return 0;
     }
+    else if (0 == raft_vote(me_, node))
+    {
+        /* a vote we might forget isn't one we can give */
+        r.vote_granted = 0;
+        return 0;
+    }
     else
     {
-        raft_vote(me_,node);
         r.vote_granted = 1;
     }
     
@@ -401,8 +1508,8 @@ int raft_recv_requestvote(raft_server_t* me_, int node, msg_requestvote_t* vr)
           node, r.vote_granted == 1 ? "granted" : "not granted");
     
     r.term = raft_get_current_term(me_);
-    if (me->cb.send_requestvote_response)
-        me->cb.send_requestvote_response(me_, node, &r);
+    if (HAS_HOOK(me, send_requestvote_response))
+        HOOK(me, send_requestvote_response)(me_, node, &r);
     
     return 0;
 }
@@ -422,52 +1529,154 @@ int raft_recv_requestvote_response(raft_server_t* me_, int node,
 {
     raft_server_private_t* me = (void*)me_;
     
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_RECV_REQUESTVOTE_RESPONSE,
+                         node, r);
+    
     __log(me_, "node %d responded to requestvote: %s",
           node, r->vote_granted == 1 ? "granted" : "not granted");
     
     if (raft_is_leader(me_))
         return 0;
     
-    assert(node < me->num_nodes);
+    assert(node < NUM_NODES(me));
     
     if (1 == r->vote_granted)
     {
+        unsigned long bit = 1UL << (node % VOTE_BITS);
         int votes;
         
-        me->votes_for_me[node] = 1;
+        /* tally as votes come in, so that each response costs the same
+         * however big the cluster is */
+        if (!(me->votes_for_me[node / VOTE_BITS] & bit))
+        {
+            me->votes_for_me[node / VOTE_BITS] |= bit;
+            if (me->nodeid != node && raft_node_is_voting(me->nodes[node]))
+                me->nvotes++;
+        }
         votes = raft_get_nvotes_for_me(me_);
-        __log(me_, "now have %d of %d votes", votes, me->num_nodes);
-        if (raft_votes_is_majority(me->num_nodes, votes))
+        __log(me_, "now have %d of %d votes", votes,
+              me->num_voting);
+        if (raft_votes_is_majority(me->num_voting, votes))
             raft_become_leader(me_);
     }
     
     return 0;
 }
 
-int raft_recv_entry(raft_server_t* me_, int node, msg_entry_t* e)
+int raft_recv_entry(raft_server_t* me_, int node, msg_entry_t* e,
+                    msg_entry_response_t* r)
+{
+    raft_server_private_t* me = (void*)me_;
+    
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_RECV_ENTRY, node, e);
+    
+    return raft_accept_entry(me_, node, e, __next_proposal(me), r);
+}
+
+int raft_forward_entry(raft_server_t* me_, msg_entry_t* e)
+{
+    raft_server_private_t* me = (void*)me_;
+    int proposal;
+    
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_FORWARD_ENTRY, -1, e);
+    
+    if (raft_is_leader(me_))
+        return raft_accept_entry(me_, me->nodeid, e, __next_proposal(me), NULL);
+    
+    proposal = __next_proposal(me);
+    if (RAFT_ERR_BUSY == __forward(me, e, proposal))
+        return RAFT_ERR_BUSY;
+    if (proposal)
+    {
+        msg_entry_response_t r;
+        
+        r.term = -1;
+        r.idx = -1;
+        r.id = proposal;
+        me->proposal_id = proposal;
+        me->cb.applylog_tentative(me_, &r, e);
+    }
+    
+    /* the leader has gone quiet, so no appendentries is due soon */
+    if (me->forward_timeout <= me->timeout_elapsed)
+        __send_proposals(me_);
+    return 1;
+}
+
+int raft_accept_entry(raft_server_t* me_, int node, msg_entry_t* e,
+                      int proposal, msg_entry_response_t* r)
 {
     raft_server_private_t* me = (void*)me_;
     raft_entry_t ety;
-    int res, i;
+    msg_entry_response_t id;
+    int res, i, n;
     
     __log(me_, "RECEIVED ENTRY FROM: %d", node);
     
+    if (0 < me->uncommitted_limit &&
+        me->uncommitted_limit <= me->current_idx - 1 - me->commit_idx)
+    {
+        __log(me_, "too many uncommitted entries, turning entry away");
+        me->busy = 1;
+        return RAFT_ERR_BUSY;
+    }
+    
+    if (me->cb.entry_done && 0 == __pending_reserve(me))
+        return 0;
+    
     ety.term = me->current_term;
     ety.entry = *e;
     ety.num_nodes = 0;
-    res = raft_append_entry(me_, &ety);
-    for (i=0; i<me->num_nodes; i++)
+    if (0 == (res = raft_append_entry(me_, &ety)) || 0 == log_sync(me->log))
+        return 0;
+    
+    id.term = ety.term;
+    id.idx = me->current_idx - 1;
+    id.id = proposal;
+    if (r)
+        *r = id;
+    if (me->cb.entry_done)
     {
-        if (me->nodeid == i) continue;
-        raft_send_appendentries(me_,i);
+        me->npending++;
+        *__pending_newest(me) = id;
+    }
+    
+    /* ones held for an old leader were applied when they were proposed */
+    if (me->proposal_id < proposal)
+    {
+        me->proposal_id = proposal;
+        me->cb.applylog_tentative(me_, &id, e);
+    }
+    
+    for (i=0, n=0; i<NUM_NODES(me); i++)
+    {
+        int node = me->send_order[i];
+        raft_node_t* p = me->nodes[node];
+        
+        if (me->nodeid == node) continue;
+        /* the entry will be streamed to them in order */
+        if (raft_node_is_catching_up(p)) continue;
+        /* stragglers get the entry when they answer what they already have,
+         * so that they don't take link time from the quorum */
+        if (raft_node_is_slow(p) && raft_node_is_probing(p)) continue;
+        /* as do nodes that hold their acks back, while they haven't
+         * answered entries we've sent. Sending from next_idx would only
+         * repeat those */
+        if (0 < raft_node_get_ack_delay(p) && raft_node_is_probing(p) &&
+            raft_node_get_next_idx(p) < me->current_idx - 1) continue;
+        me->send_scratch[n++] = node;
     }
+    raft_send_appendentries_scratch(me_, n);
     
     // Handle case with 1 server
-    if (me->num_nodes == 1)
+    if (me->num_voting == 1)
     {
         raft_apply_entry(me_);
     }
-    return 0;
+    return 1;
 }
 
 int raft_send_requestvote(raft_server_t* me_, int node)
@@ -479,8 +1688,8 @@ int raft_send_requestvote(raft_server_t* me_, int node)
     
     rv.term = me->current_term;
     rv.last_log_idx = raft_get_current_idx(me_);
-    if (me->cb.send_requestvote)
-        me->cb.send_requestvote(me_, node, &rv);
+    if (HAS_HOOK(me, send_requestvote))
+        HOOK(me, send_requestvote)(me_, node, &rv);
     return 1;
 }
 
@@ -490,7 +1699,7 @@ int raft_append_entry(raft_server_t* me_, raft_entry_t* c)
     
     if (1 == log_append_entry(me->log,c))
     {
-        __log(me_, "appended entry to log: %d", me->current_idx);
+        __log(me_, "appended entry to log: %lld", me->current_idx);
         me->current_idx += 1;
         return 1;
     }
@@ -500,39 +1709,57 @@ int raft_append_entry(raft_server_t* me_, raft_entry_t* c)
 int raft_apply_entry(raft_server_t* me_)
 {
     raft_server_private_t* me = (void*)me_;
-    raft_entry_t* e;
+    msg_entry_t* e;
     
-    if (!(e = log_get_from_idx(me->log, me->last_applied_idx+1)))
+    if (!(e = log_get_entry(me->log, me->last_applied_idx+1)))
         return 0;
     
-    __log(me_, "APPLYING LOG: %d", me->last_applied_idx + 1);
+    __log(me_, "APPLYING LOG: %lld", me->last_applied_idx + 1);
     
     me->last_applied_idx++;
     if (me->commit_idx < me->last_applied_idx)
         me->commit_idx = me->last_applied_idx;
-    if (me->cb.applylog)
-        me->cb.applylog(me_, e->entry);
+    if (HAS_HOOK(me, applylog))
+        HOOK(me, applylog)(me_, *e);
+    
+    if (__pending_oldest(me) && __pending_oldest(me)->idx == me->last_applied_idx)
+        __pending_done_oldest(me_, RAFT_ENTRY_COMMITTED);
+    
+    if (me->busy && (0 == me->uncommitted_limit ||
+                     me->current_idx - 1 - me->commit_idx < me->uncommitted_limit))
+    {
+        me->busy = 0;
+        if (me->cb.capacity)
+            me->cb.capacity(me_);
+    }
     return 1;
 }
 
 void raft_send_appendentries(raft_server_t* me_, int node)
+{
+    raft_node_t* p = raft_get_node(me_, node);
+    raft_send_appendentries_idx(me_, node, raft_node_get_next_idx(p));
+}
+
+/**
+ * Fill in an appendentries for a node whose log ends at node_next_idx */
+static void __build_appendentries(raft_server_t* me_, raft_index_t node_next_idx,
+                                  msg_appendentries_t* out)
 {
     raft_server_private_t* me = (void*)me_;
-    
-    if (!(me->cb.send_appendentries))
-        return;
-    
     msg_appendentries_t ae;
-    raft_node_t* p = raft_get_node(me_, node);
     
+    /* heartbeats leave the entry unset, and trace and shm copy it */
+    memset(&ae, 0, sizeof(msg_appendentries_t));
     ae.term = me->current_term;
     ae.leader_id = me->nodeid;
     ae.leader_commit = me->commit_idx;
-    int node_next_idx = raft_node_get_next_idx(p);
     ae.prev_log_idx = node_next_idx - 1;
-    if (ae.prev_log_idx != -1) {
-        raft_entry_t *entry = log_get_from_idx(me->log, ae.prev_log_idx);
-        ae.prev_log_term = entry->term;
+    if (ae.prev_log_idx == me->snapshot_last_idx) {
+        ae.prev_log_term = me->snapshot_last_term;
+    }
+    else if (ae.prev_log_idx != -1) {
+        ae.prev_log_term = log_get_term(me->log, ae.prev_log_idx);
     }
     else {
         ae.prev_log_term = -1;
@@ -540,83 +1767,388 @@ void raft_send_appendentries(raft_server_t* me_, int node)
     
     if (me->current_idx > node_next_idx) {
         ae.n_entries = 1;
-        raft_entry_t *next_entry = log_get_from_idx(me->log, node_next_idx);
-        ae.entry = next_entry->entry;
-        ae.entry_term = next_entry->term;
+        ae.entry = *log_get_entry(me->log, node_next_idx);
+        ae.entry_term = log_get_term(me->log, node_next_idx);
     }
     else {
         ae.n_entries = 0;
     }
-        
-    __log(me_, "SENDING APPENDENTRIES TO: %d", node);
-    __log(me_, "current_idx %d", me->current_idx);
-    __log(me_, "node_next_idx %d", node_next_idx);
     
-    __log(me_, "term %d", ae.term);
+    __log(me_, "current_idx %lld", me->current_idx);
+    __log(me_, "node_next_idx %lld", node_next_idx);
+    
+    __log(me_, "term %lld", ae.term);
     __log(me_, "leader_id %d", ae.leader_id);
-    __log(me_, "prev_log_idx %d", ae.prev_log_idx);
-    __log(me_, "prev_log_term %d", ae.prev_log_term);
+    __log(me_, "prev_log_idx %lld", ae.prev_log_idx);
+    __log(me_, "prev_log_term %lld", ae.prev_log_term);
     __log(me_, "n_entries %d", ae.n_entries);
-    __log(me_, "leader_commit %d", ae.leader_commit);
+    __log(me_, "leader_commit %lld", ae.leader_commit);
+    
+    ae.timestamp = me->clock;
+    ae.n_learners = me->n_learners;
+    memcpy(ae.learners, me->learners, sizeof(int) * me->n_learners);
+    *out = ae;
+}
+
+/**
+ * @return 1 if the node should answer an appendentries for node_next_idx at
+ * once rather than coalesce its ack, as the ack is one of those we still
+ * need for a quorum on the entry we are waiting on to commit. We ask as many
+ * voters as there are acks missing, once each per entry; while we stream,
+ * later appendentries overtake the ack we asked for */
+static int __ack_now(raft_server_t* me_, raft_node_t* p,
+                     raft_index_t node_next_idx)
+{
+    raft_server_private_t* me = (void*)me_;
+    raft_index_t idx = me->commit_idx + 1;
+    
+    if (!raft_node_is_voting(p) || me->current_idx <= idx ||
+        node_next_idx < idx || idx <= raft_node_get_match_idx(p) ||
+        idx <= raft_node_get_ack_now_idx(p))
+        return 0;
+    if (me->ack_now_entry != idx)
+    {
+        me->ack_now_entry = idx;
+        me->ack_now_pending = 0;
+    }
+    if (me->num_voting / 2 <=
+        log_get_num_nodes(me->log, idx) + me->ack_now_pending)
+        return 0;
+    me->ack_now_pending++;
+    raft_node_set_ack_now_idx(p, idx);
+    return 1;
+}
+
+void raft_send_appendentries_idx(raft_server_t* me_, int node,
+                                 raft_index_t node_next_idx)
+{
+    raft_server_private_t* me = (void*)me_;
+    msg_appendentries_t ae;
+    
+    if (!HAS_HOOK(me, send_appendentries))
+        return;
+    
+    /* the node is behind what our log still holds */
+    if (me->snapshot && node_next_idx - 1 < me->snapshot_last_idx)
+    {
+        raft_send_installsnapshot(me_, node);
+        return;
+    }
+    
+    __log(me_, "SENDING APPENDENTRIES TO: %d", node);
+    __build_appendentries(me_, node_next_idx, &ae);
+    ae.ack_now = __ack_now(me_, me->nodes[node], node_next_idx);
+    raft_node_probe_start(me->nodes[node], me->clock);
+    raft_node_sent(me->nodes[node]);
+    HOOK(me, send_appendentries)(me_, node, &ae);
+}
+
+void raft_send_catchup(raft_server_t* me_)
+{
+    raft_server_private_t* me = (void*)me_;
+    int i, sent;
+    
+    /* round robin, one entry per node per pass, so that one follower can't
+     * use up the whole budget */
+    do
+    {
+        for (i=0, sent=0; i<NUM_NODES(me) && 1000 <= me->catchup_budget; i++)
+        {
+            raft_node_t* p;
+            raft_index_t idx;
+            
+            if (me->nodeid == i) continue;
+            p = me->nodes[i];
+            if (!raft_node_is_catching_up(p)) continue;
+            
+            idx = raft_node_get_catchup_idx(p);
+            if (me->current_idx <= idx) continue;
+            
+            /* the node needs a snapshot first */
+            if (idx - 1 < me->snapshot_last_idx)
+            {
+                raft_node_set_catching_up(p, 0);
+                continue;
+            }
+            
+            raft_send_appendentries_idx(me_, i, idx);
+            raft_node_set_catchup_idx(p, idx + 1);
+            me->catchup_budget -= 1000;
+            sent += 1;
+        }
+    }
+    while (sent && 1000 <= me->catchup_budget);
+}
+
+void raft_send_installsnapshot(raft_server_t* me_, int node)
+{
+    raft_server_private_t* me = (void*)me_;
+    msg_installsnapshot_t is;
+    raft_node_t* p = raft_get_node(me_, node);
+    int offset;
+    
+    if (!HAS_HOOK(me, send_installsnapshot) || !me->snapshot)
+        return;
+    
+    /* restart the transfer if we've taken a newer snapshot since */
+    if (raft_node_get_snapshot_last_idx(p) != me->snapshot_last_idx)
+        raft_node_set_snapshot_offset(p, me->snapshot_last_idx, 0);
+    offset = raft_node_get_snapshot_offset(p);
+    if (me->snapshot_len < offset)
+        offset = 0;
+    
+    is.term = me->current_term;
+    is.leader_id = me->nodeid;
+    is.last_idx = me->snapshot_last_idx;
+    is.last_term = me->snapshot_last_term;
+    is.offset = offset;
+    is.len = me->snapshot_len - offset;
+    if (RAFT_SNAPSHOT_CHUNK_SIZE < is.len)
+        is.len = RAFT_SNAPSHOT_CHUNK_SIZE;
+    is.done = offset + is.len == me->snapshot_len;
+    memcpy(is.data, me->snapshot + offset, is.len);
+    
+    __log(me_, "SENDING INSTALLSNAPSHOT TO: %d", node);
+    __log(me_, "last_idx %lld", is.last_idx);
+    __log(me_, "offset %d", is.offset);
+    __log(me_, "len %d", is.len);
+    
+    raft_node_sent(p);
+    HOOK(me, send_installsnapshot)(me_, node, &is);
+}
+
+int raft_snapshot(raft_server_t* me_)
+{
+    raft_server_private_t* me = (void*)me_;
+    raft_term_t term;
+    unsigned char* data;
+    int len;
+    
+    if (!(me->cb.snapshot_save) && 0 == me->compaction_key_len)
+        return 0;
+    
+    /* nothing has been applied since our last snapshot */
+    if (me->last_applied_idx <= me->snapshot_last_idx)
+        return 1;
+    
+    if (-1 == (term = log_get_term(me->log, me->last_applied_idx)))
+        return 0;
+    
+    if (me->compaction_key_len)
+    {
+        if (0 == raft_compact_save(me_, &data, &len))
+            return 0;
+    }
+    else if (0 == me->cb.snapshot_save(me_, &data, &len))
+        return 0;
+    
+    __log(me_, "took snapshot up to %lld", me->last_applied_idx);
     
-    if (me->cb.send_appendentries)
-        me->cb.send_appendentries(me_, node, &ae);
+    free(me->snapshot);
+    me->snapshot = data;
+    me->snapshot_len = len;
+    me->snapshot_last_idx = me->last_applied_idx;
+    me->snapshot_last_term = term;
+    log_compact(me->log, me->snapshot_last_idx);
+    return 1;
 }
 
 void raft_send_appendentries_all(raft_server_t* me_)
 {
     raft_server_private_t* me = (void*)me_;
-    int i;
+    int i, n;
     
-    for (i=0; i<me->num_nodes; i++)
+    for (i=0, n=0; i<NUM_NODES(me); i++)
     {
-        if (me->nodeid == i) continue;
-        raft_send_appendentries(me_, i);
+        if (me->nodeid == me->send_order[i]) continue;
+        me->send_scratch[n++] = me->send_order[i];
     }
+    raft_send_appendentries_scratch(me_, n);
+}
+
+/**
+ * @return 1 if the nodes would be sent the same appendentries, down to how
+ * it is encoded */
+static int __same_appendentries(raft_server_t* me_, int a, int b)
+{
+    raft_server_private_t* me = (void*)me_;
+    raft_node_t* p = me->nodes[a];
+    raft_node_t* q = me->nodes[b];
+    raft_index_t prev_log_idx = raft_node_get_next_idx(p) - 1;
+    
+    return raft_node_get_next_idx(p) == raft_node_get_next_idx(q) &&
+        raft_node_get_codecs(p) == raft_node_get_codecs(q) &&
+        (raft_node_get_codec_noref_idx(p) < prev_log_idx) ==
+        (raft_node_get_codec_noref_idx(q) < prev_log_idx);
 }
 
-void raft_set_configuration(raft_server_t* me_, int num_nodes)
+void raft_send_appendentries_scratch(raft_server_t* me_, int nnodes)
 {
     raft_server_private_t* me = (void*)me_;
     
-    me->num_nodes = num_nodes;
-    me->nodes = malloc(sizeof(raft_node_t) * num_nodes);
-    for (int i = 0; i < num_nodes; i++) {
-        me->nodes[i] = raft_node_new();
+    if (!me->cb.send_appendentries_broadcast)
+    {
+        for (int i=0; i<nnodes; i++)
+            raft_send_appendentries(me_, me->send_scratch[i]);
+        return;
     }
     
-    me->votes_for_me = calloc(num_nodes, sizeof(int));
+    while (0 < nnodes)
+    {
+        int node = me->send_scratch[0];
+        raft_index_t next_idx = raft_node_get_next_idx(me->nodes[node]);
+        msg_appendentries_t ae;
+        int i, n, left;
+        
+        /* take out the nodes that get the same message as the first one,
+         * keeping the rest in order */
+        me->send_group[0] = node;
+        for (i=1, n=1, left=0; i<nnodes; i++)
+        {
+            int other = me->send_scratch[i];
+            if (__same_appendentries(me_, node, other))
+                me->send_group[n++] = other;
+            else
+                me->send_scratch[left++] = other;
+        }
+        nnodes = left;
+        
+        /* lone nodes, and those that need a snapshot, go unicast */
+        if (1 == n || next_idx - 1 < me->snapshot_last_idx)
+        {
+            for (i=0; i<n; i++)
+                raft_send_appendentries(me_, me->send_group[i]);
+            continue;
+        }
+        
+        __build_appendentries(me_, next_idx, &ae);
+        __log(me_, "BROADCASTING APPENDENTRIES TO %d NODES", n);
+        for (i=0; i<n; i++)
+        {
+            if (__ack_now(me_, me->nodes[me->send_group[i]], next_idx))
+                ae.ack_now = 1;
+            raft_node_probe_start(me->nodes[me->send_group[i]], me->clock);
+            raft_node_sent(me->nodes[me->send_group[i]]);
+        }
+        me->cb.send_appendentries_broadcast(me_, me->send_group, n, &ae);
+    }
 }
 
-int raft_get_nvotes_for_me(raft_server_t* me_)
+int raft_set_configuration(raft_server_t* me_, int num_nodes)
 {
     raft_server_private_t* me = (void*)me_;
-    int i, votes;
+    int i;
     
-    for (i=0, votes=0; i<me->num_nodes; i++)
+    /* once only: starting over would promote our learners, and we don't
+     * know what the nodes we already have would become */
+    if (0 < me->num_nodes || num_nodes <= 0)
+        return 0;
+
+#ifdef RAFT_NUM_NODES
+    /* the tables are sized for this many already */
+    if (RAFT_NUM_NODES != num_nodes)
+        return 0;
+#else
+    me->nodes = calloc(num_nodes, sizeof(raft_node_t));
+    me->votes_for_me = calloc(VOTE_WORDS(num_nodes), sizeof(unsigned long));
+    me->rtt_scratch = calloc(num_nodes, sizeof(int));
+    me->send_order = calloc(num_nodes, sizeof(int));
+    me->send_scratch = calloc(num_nodes, sizeof(int));
+    me->send_group = calloc(num_nodes, sizeof(int));
+    if (!me->nodes || !me->votes_for_me || !me->rtt_scratch ||
+        !me->send_order || !me->send_scratch || !me->send_group)
     {
-        if (me->nodeid == i) continue;
-        if (1 == me->votes_for_me[i])
-            votes += 1;
+        __free_tables(me);
+        return 0;
+    }
+#endif
+    
+    for (i = 0; i < num_nodes; i++)
+    {
+        if (!(me->nodes[i] = raft_node_new()))
+        {
+            while (0 < i--)
+            {
+                free(me->nodes[i]);
+                me->nodes[i] = NULL;
+            }
+            __free_tables(me);
+            return 0;
+        }
     }
     
+    me->num_nodes = num_nodes;
+    me->nvotes = 0;
+    me->num_voting = num_nodes;
+    me->n_learners = 0;
+    for (i = 0; i < num_nodes; i++) {
+        me->send_order[i] = i;
+    }
+    return 1;
+}
+
+int raft_get_nvotes_for_me(raft_server_t* me_)
+{
+    raft_server_private_t* me = (void*)me_;
+    
     if (me->voted_for == me->nodeid)
-        votes += 1;
+        return me->nvotes + 1;
+    return me->nvotes;
+}
+
+int raft_get_num_voting_nodes(raft_server_t* me_)
+{
+    raft_server_private_t* me = (void*)me_;
+    return me->num_voting;
+}
+
+int raft_set_learner(raft_server_t* me_, int node)
+{
+    raft_server_private_t* me = (void*)me_;
+    
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_SET_LEARNER, node, NULL);
+    
+    if (me->nodeid == node || node < 0 || NUM_NODES(me) <= node)
+        return 0;
+    if (!raft_node_is_voting(me->nodes[node]))
+        return 1;
+    /* one change at a time, as when promoting */
+    if (RAFT_LEARNERS_MAX <= me->n_learners ||
+        me->commit_idx < me->learners_idx)
+        return 0;
+    __set_voting(me, node, 0);
+    me->learners_idx = me->current_idx;
+    return 1;
+}
+
+void raft_add_rtt_sample(raft_server_t* me_, int node, int msec)
+{
+    raft_server_private_t* me = (void*)me_;
+    raft_node_t* p = raft_get_node(me_, node);
     
-    return votes;
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_RTT_SAMPLE, node, &msec);
+    
+    if (!p)
+        return;
+    if (-1 != msec)
+        raft_node_add_rtt_sample(p, msec);
+    raft_node_add_loss_sample(p, -1 == msec);
 }
 
-void raft_vote(raft_server_t* me_, int node)
+int raft_vote(raft_server_t* me_, int node)
 {
     raft_server_private_t* me = (void*)me_;
     me->voted_for = node;
+    return log_save_state(me->log, me->current_term, node);
 }
 
 raft_node_t* raft_get_node(raft_server_t *me_, int nodeid)
 {
     raft_server_private_t* me = (void*)me_;
     
-    if (nodeid < 0 || me->num_nodes <= nodeid)
+    if (nodeid < 0 || NUM_NODES(me) <= nodeid)
         return NULL;
     return me->nodes[nodeid];
 }
@@ -639,7 +2171,20 @@ int raft_is_candidate(raft_server_t* me_)
 void raft_clear_node(raft_server_t* me_, int idx)
 {
     raft_server_private_t* me = (void*)me_;
+    
+    if (me->trace)
+        raft_trace_input(me->trace, RAFT_TRACE_CLEAR_NODE, idx, NULL);
+    
+    /* the next node to take the slot holds none of what this one acked */
+    __unmark_acks(me, me->nodes[idx]);
     raft_node_set_next_idx(me->nodes[idx], 0);
+    raft_node_set_match_idx(me->nodes[idx], -1);
+    raft_node_set_ack_now_idx(me->nodes[idx], -1);
+    raft_node_set_catching_up(me->nodes[idx], 0);
+    raft_node_set_codecs(me->nodes[idx], 0);
+    raft_node_set_codec_noref_idx(me->nodes[idx], -1);
+    raft_node_set_snapshot_offset(me->nodes[idx], -1, 0);
+    raft_node_probe_clear(me->nodes[idx]);
 }
 
 
@@ -21,6 +21,17 @@
 #include "raft_log.h"
 #include "raft_private.h"
 
+void raft_set_udata(raft_server_t* me_, void* udata)
+{
+    raft_server_private_t* me = (void*)me_;
+    me->udata = udata;
+}
+
+void* raft_get_udata(raft_server_t* me_)
+{
+    return ((raft_server_private_t*)me_)->udata;
+}
+
 void raft_set_election_timeout(raft_server_t* me_, int millisec)
 {
     raft_server_private_t* me = (void*)me_;
@@ -33,6 +44,60 @@ void raft_set_request_timeout(raft_server_t* me_, int millisec)
     me->request_timeout = millisec;
 }
 
+void raft_set_snapshot_threshold(raft_server_t* me_, int nentries)
+{
+    raft_server_private_t* me = (void*)me_;
+    me->snapshot_threshold = nentries;
+}
+
+void raft_set_learner_threshold(raft_server_t* me_, int nentries)
+{
+    raft_server_private_t* me = (void*)me_;
+    me->learner_threshold = nentries;
+}
+
+void raft_set_catchup(raft_server_t* me_, int nentries, int msgs_per_sec)
+{
+    raft_server_private_t* me = (void*)me_;
+    me->catchup_threshold = nentries;
+    me->catchup_rate = msgs_per_sec;
+}
+
+void raft_set_ack_delay(raft_server_t* me_, int msec, int nacks)
+{
+    raft_server_private_t* me = (void*)me_;
+    me->ack_delay = msec;
+    me->ack_max = nacks;
+}
+
+void raft_set_uncommitted_limit(raft_server_t* me_, int nentries)
+{
+    raft_server_private_t* me = (void*)me_;
+    me->uncommitted_limit = nentries;
+}
+
+void raft_set_forward_timeout(raft_server_t* me_, int msec)
+{
+    raft_server_private_t* me = (void*)me_;
+    me->forward_timeout = msec;
+}
+
+void raft_set_lag_threshold(raft_server_t* me_, int nentries)
+{
+    raft_server_private_t* me = (void*)me_;
+    me->lag_threshold = nentries;
+}
+
+raft_index_t raft_get_snapshot_last_idx(raft_server_t* me_)
+{
+    return ((raft_server_private_t*)me_)->snapshot_last_idx;
+}
+
+int raft_get_quorum_rtt(raft_server_t* me_)
+{
+    return ((raft_server_private_t*)me_)->quorum_rtt;
+}
+
 int raft_get_nodeid(raft_server_t* me_)
 {
     return ((raft_server_private_t*)me_)->nodeid;
@@ -70,24 +135,30 @@ int raft_get_voted_for(raft_server_t* me_)
     return ((raft_server_private_t*)me_)->voted_for;
 }
 
-void raft_set_current_term(raft_server_t* me_, int term)
+void raft_set_current_term(raft_server_t* me_, raft_term_t term)
 {
     raft_server_private_t* me = (void*)me_;
+    /* we have a fresh vote in each new term, and only one */
+    if (me->current_term < term)
+    {
+        me->voted_for = -1;
+        log_save_state(me->log, term, -1);
+    }
     me->current_term = term;
 }
 
-int raft_get_current_term(raft_server_t* me_)
+raft_term_t raft_get_current_term(raft_server_t* me_)
 {
     return ((raft_server_private_t*)me_)->current_term;
 }
 
-void raft_set_current_idx(raft_server_t* me_, int idx)
+void raft_set_current_idx(raft_server_t* me_, raft_index_t idx)
 {
     raft_server_private_t* me = (void*)me_;
     me->current_idx = idx;
 }
 
-int raft_get_current_idx(raft_server_t* me_)
+raft_index_t raft_get_current_idx(raft_server_t* me_)
 {
     return ((raft_server_private_t*)me_)->current_idx;
 }
@@ -97,24 +168,24 @@ int raft_get_my_id(raft_server_t* me_)
     return ((raft_server_private_t*)me_)->nodeid;
 }
 
-void raft_set_commit_idx(raft_server_t* me_, int idx)
+void raft_set_commit_idx(raft_server_t* me_, raft_index_t idx)
 {
     raft_server_private_t* me = (void*)me_;
     me->commit_idx = idx;
 }
 
-void raft_set_last_applied_idx(raft_server_t* me_, int idx)
+void raft_set_last_applied_idx(raft_server_t* me_, raft_index_t idx)
 {
     raft_server_private_t* me = (void*)me_;
     me->last_applied_idx = idx;
 }
 
-int raft_get_last_applied_idx(raft_server_t* me_)
+raft_index_t raft_get_last_applied_idx(raft_server_t* me_)
 {
     return ((raft_server_private_t*)me_)->last_applied_idx;
 }
 
-int raft_get_commit_idx(raft_server_t* me_)
+raft_index_t raft_get_commit_idx(raft_server_t* me_)
 {
     return ((raft_server_private_t*)me_)->commit_idx;
 }
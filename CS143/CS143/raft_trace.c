@@ -0,0 +1,874 @@
+/**
+ * Copyright (c) 2013, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Recording a Raft server's inputs so they can be replayed offline
+ * @version 0.1
+ *
+ * A trace is a header holding the server's configuration, followed by
+ * records. Each record is its type byte and the peer as a varint. Inputs
+ * go on with the microseconds since the previous input and the message,
+ * field by field, as varints. Outputs carry nothing more, except for
+ * snapshot saves, which carry the snapshot's size so that a replay can
+ * produce one of the same size.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "raft.h"
+#include "raft_log.h"
+#include "raft_private.h"
+#include "raft_trace.h"
+
+#define TRACE_MAGIC "RTR7"
+
+/* bits of the header's callback mask */
+enum {
+    CB_SEND_REQUESTVOTE = 1 << 0,
+    CB_SEND_REQUESTVOTE_RESPONSE = 1 << 1,
+    CB_SEND_APPENDENTRIES = 1 << 2,
+    CB_SEND_APPENDENTRIES_RESPONSE = 1 << 3,
+    CB_APPLYLOG = 1 << 4,
+    CB_SEND_INSTALLSNAPSHOT = 1 << 5,
+    CB_SEND_INSTALLSNAPSHOT_RESPONSE = 1 << 6,
+    CB_SNAPSHOT_SAVE = 1 << 7,
+    CB_SNAPSHOT_LOAD = 1 << 8,
+    CB_CAPACITY = 1 << 9,
+    CB_NODE_LAGGING = 1 << 10,
+    CB_SEND_APPENDENTRIES_BROADCAST = 1 << 11,
+    CB_ENTRY_DONE = 1 << 12,
+    CB_SEND_PROPOSAL = 1 << 13,
+    CB_APPLYLOG_TENTATIVE = 1 << 14
+};
+
+/* Fields of a message. Integers are written as zigzag varints; a negative
+ * size is a byte array written as is */
+typedef struct {
+    short offset;
+    short size;
+} field_t;
+
+#define INT(type, f) { offsetof(type, f), sizeof(((type*)0)->f) }
+#define RAW(type, f) { offsetof(type, f), -(short)sizeof(((type*)0)->f) }
+
+static const field_t rv_fields[] = {
+    INT(msg_requestvote_t, term),
+    INT(msg_requestvote_t, last_log_idx),
+    RAW(msg_requestvote_t, uuid),
+    { 0, 0 }
+};
+
+static const field_t rvr_fields[] = {
+    INT(msg_requestvote_response_t, term),
+    INT(msg_requestvote_response_t, vote_granted),
+    RAW(msg_requestvote_response_t, uuid),
+    { 0, 0 }
+};
+
+static const field_t ae_fields[] = {
+    INT(msg_appendentries_t, term),
+    INT(msg_appendentries_t, leader_id),
+    INT(msg_appendentries_t, prev_log_idx),
+    INT(msg_appendentries_t, prev_log_term),
+    INT(msg_appendentries_t, n_entries),
+    RAW(msg_appendentries_t, entry),
+    INT(msg_appendentries_t, entry_term),
+    INT(msg_appendentries_t, leader_commit),
+    INT(msg_appendentries_t, timestamp),
+    INT(msg_appendentries_t, ack_now),
+    INT(msg_appendentries_t, n_learners),
+    RAW(msg_appendentries_t, learners),
+    { 0, 0 }
+};
+
+static const field_t aer_fields[] = {
+    INT(msg_appendentries_response_t, term),
+    INT(msg_appendentries_response_t, success),
+    INT(msg_appendentries_response_t, current_idx),
+    INT(msg_appendentries_response_t, first_idx),
+    INT(msg_appendentries_response_t, quorum_rtt),
+    INT(msg_appendentries_response_t, timestamp),
+    INT(msg_appendentries_response_t, ack_delay),
+    INT(msg_appendentries_response_t, n_proposals),
+    RAW(msg_appendentries_response_t, proposal),
+    { 0, 0 }
+};
+
+static const field_t is_fields[] = {
+    INT(msg_installsnapshot_t, term),
+    INT(msg_installsnapshot_t, leader_id),
+    INT(msg_installsnapshot_t, last_idx),
+    INT(msg_installsnapshot_t, last_term),
+    INT(msg_installsnapshot_t, offset),
+    INT(msg_installsnapshot_t, len),
+    INT(msg_installsnapshot_t, done),
+    RAW(msg_installsnapshot_t, data),
+    { 0, 0 }
+};
+
+static const field_t isr_fields[] = {
+    INT(msg_installsnapshot_response_t, term),
+    INT(msg_installsnapshot_response_t, last_idx),
+    INT(msg_installsnapshot_response_t, offset),
+    INT(msg_installsnapshot_response_t, complete),
+    { 0, 0 }
+};
+
+static const field_t entry_fields[] = {
+    RAW(msg_entry_t, data),
+    { 0, 0 }
+};
+
+static const field_t msec_fields[] = {
+    { 0, sizeof(int) },
+    { 0, 0 }
+};
+
+static const field_t none_fields[] = {
+    { 0, 0 }
+};
+
+static const field_t* __fields(int type)
+{
+    switch (type)
+    {
+        case RAFT_TRACE_PERIODIC: return msec_fields;
+        case RAFT_TRACE_RECV_REQUESTVOTE: return rv_fields;
+        case RAFT_TRACE_RECV_REQUESTVOTE_RESPONSE: return rvr_fields;
+        case RAFT_TRACE_RECV_APPENDENTRIES: return ae_fields;
+        case RAFT_TRACE_RECV_APPENDENTRIES_RESPONSE: return aer_fields;
+        case RAFT_TRACE_RECV_INSTALLSNAPSHOT: return is_fields;
+        case RAFT_TRACE_RECV_INSTALLSNAPSHOT_RESPONSE: return isr_fields;
+        case RAFT_TRACE_RECV_ENTRY: return entry_fields;
+        case RAFT_TRACE_FORWARD_ENTRY: return entry_fields;
+        case RAFT_TRACE_RTT_SAMPLE: return msec_fields;
+        default: return none_fields;
+    }
+}
+
+static void __put_varint(FILE* fp, int64_t v)
+{
+    /* zigzag, so that small negative values stay small */
+    uint64_t u = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+
+    do
+    {
+        putc((u & 0x7f) | (0x7f < u ? 0x80 : 0), fp);
+        u >>= 7;
+    }
+    while (u);
+}
+
+static int __get_varint(FILE* fp, int64_t* v)
+{
+    uint64_t u = 0;
+    int shift, c;
+
+    for (shift = 0; shift < 64; shift += 7)
+    {
+        if (EOF == (c = getc(fp)))
+            return 0;
+        u |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+        {
+            *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void __put_fields(FILE* fp, const field_t* f, const void* msg)
+{
+    const char* p = msg;
+
+    for (; f->size; f++)
+    {
+        if (f->size < 0)
+            fwrite(p + f->offset, 1, -f->size, fp);
+        else if (f->size == sizeof(int))
+            __put_varint(fp, *(const int*)(p + f->offset));
+        else
+            __put_varint(fp, *(const long long*)(p + f->offset));
+    }
+}
+
+static int __get_fields(FILE* fp, const field_t* f, void* msg)
+{
+    char* p = msg;
+    int64_t v;
+
+    for (; f->size; f++)
+    {
+        if (f->size < 0)
+        {
+            if (fread(p + f->offset, 1, -f->size, fp) != (size_t)-f->size)
+                return 0;
+            continue;
+        }
+        if (!__get_varint(fp, &v))
+            return 0;
+        if (f->size == sizeof(int))
+            *(int*)(p + f->offset) = (int)v;
+        else
+            *(long long*)(p + f->offset) = v;
+    }
+    return 1;
+}
+
+static long long __now_usec()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*--------------------------------------------------------------------------*/
+/* Recording */
+
+typedef struct {
+    raft_server_t* raft;
+    FILE* fp;
+
+    /* the server's own callbacks, which ours pass everything on to */
+    raft_cbs_t cb;
+
+    long long last_usec;
+} raft_trace_private_t;
+
+static raft_trace_private_t* __trace(raft_server_t* raft)
+{
+    return ((raft_server_private_t*)raft)->trace;
+}
+
+static void __output(raft_server_t* raft, int type, int node)
+{
+    FILE* fp = __trace(raft)->fp;
+
+    putc(type, fp);
+    __put_varint(fp, node);
+}
+
+static int __send_requestvote(raft_server_t* raft, int node,
+                              msg_requestvote_t* msg)
+{
+    __output(raft, RAFT_TRACE_SEND_REQUESTVOTE, node);
+    return __trace(raft)->cb.send_requestvote(raft, node, msg);
+}
+
+static int __send_requestvote_response(raft_server_t* raft, int node,
+                                       msg_requestvote_response_t* msg)
+{
+    __output(raft, RAFT_TRACE_SEND_REQUESTVOTE_RESPONSE, node);
+    return __trace(raft)->cb.send_requestvote_response(raft, node, msg);
+}
+
+static int __send_appendentries(raft_server_t* raft, int node,
+                                msg_appendentries_t* msg)
+{
+    __output(raft, RAFT_TRACE_SEND_APPENDENTRIES, node);
+    return __trace(raft)->cb.send_appendentries(raft, node, msg);
+}
+
+static int __send_appendentries_response(raft_server_t* raft, int node,
+                                         msg_appendentries_response_t* msg)
+{
+    __output(raft, RAFT_TRACE_SEND_APPENDENTRIES_RESPONSE, node);
+    return __trace(raft)->cb.send_appendentries_response(raft, node, msg);
+}
+
+static int __send_installsnapshot(raft_server_t* raft, int node,
+                                  msg_installsnapshot_t* msg)
+{
+    __output(raft, RAFT_TRACE_SEND_INSTALLSNAPSHOT, node);
+    return __trace(raft)->cb.send_installsnapshot(raft, node, msg);
+}
+
+static int __send_installsnapshot_response(raft_server_t* raft, int node,
+                                           msg_installsnapshot_response_t* msg)
+{
+    __output(raft, RAFT_TRACE_SEND_INSTALLSNAPSHOT_RESPONSE, node);
+    return __trace(raft)->cb.send_installsnapshot_response(raft, node, msg);
+}
+
+static int __applylog(raft_server_t* raft, msg_entry_t entry)
+{
+    __output(raft, RAFT_TRACE_APPLYLOG, -1);
+    return __trace(raft)->cb.applylog(raft, entry);
+}
+
+static int __snapshot_save(raft_server_t* raft, unsigned char** data, int* len)
+{
+    raft_trace_private_t* me = __trace(raft);
+
+    if (0 == me->cb.snapshot_save(raft, data, len))
+        return 0;
+    __output(raft, RAFT_TRACE_SNAPSHOT_SAVE, -1);
+    __put_varint(me->fp, *len);
+    return 1;
+}
+
+static int __snapshot_load(raft_server_t* raft, unsigned char* data, int len)
+{
+    __output(raft, RAFT_TRACE_SNAPSHOT_LOAD, -1);
+    return __trace(raft)->cb.snapshot_load(raft, data, len);
+}
+
+static void __capacity(raft_server_t* raft)
+{
+    __output(raft, RAFT_TRACE_CAPACITY, -1);
+    __trace(raft)->cb.capacity(raft);
+}
+
+static void __node_lagging(raft_server_t* raft, int node, int lagging)
+{
+    __output(raft, RAFT_TRACE_NODE_LAGGING, node);
+    __trace(raft)->cb.node_lagging(raft, node, lagging);
+}
+
+static int __send_appendentries_broadcast(raft_server_t* raft,
+                                          const int* nodes, int nnodes,
+                                          msg_appendentries_t* msg)
+{
+    int i;
+
+    for (i = 0; i < nnodes; i++)
+        __output(raft, RAFT_TRACE_SEND_APPENDENTRIES_BROADCAST, nodes[i]);
+    return __trace(raft)->cb.send_appendentries_broadcast(raft, nodes, nnodes,
+                                                          msg);
+}
+
+static void __entry_done(raft_server_t* raft, msg_entry_response_t* r,
+                         int result)
+{
+    __output(raft, RAFT_TRACE_ENTRY_DONE, -1);
+    __trace(raft)->cb.entry_done(raft, r, result);
+}
+
+static int __send_proposal(raft_server_t* raft, int node, msg_entry_t* entry)
+{
+    __output(raft, RAFT_TRACE_SEND_PROPOSAL, node);
+    return __trace(raft)->cb.send_proposal(raft, node, entry);
+}
+
+static void __applylog_tentative(raft_server_t* raft, msg_entry_response_t* r,
+                                 msg_entry_t* entry)
+{
+    __output(raft, RAFT_TRACE_APPLYLOG_TENTATIVE, -1);
+    __trace(raft)->cb.applylog_tentative(raft, r, entry);
+}
+
+raft_trace_t* raft_trace_new(raft_server_t* raft, FILE* fp)
+{
+    raft_server_private_t* r = (void*)raft;
+    raft_trace_private_t* me;
+    raft_cbs_t* cb = &r->cb;
+    int i, mask = 0;
+
+#ifdef RAFT_STATIC_HOOKS
+    /* the hooks are called directly, so we couldn't see them */
+    return NULL;
+#endif
+    if (!(me = calloc(1, sizeof(raft_trace_private_t))))
+        return NULL;
+    me->raft = raft;
+    me->fp = fp;
+    me->cb = r->cb;
+    me->last_usec = __now_usec();
+
+    /* only wrap what the server was given; it checks for missing ones */
+#define WRAP(name, bit) \
+    if (cb->name) { cb->name = __##name; mask |= bit; }
+    WRAP(send_requestvote, CB_SEND_REQUESTVOTE);
+    WRAP(send_requestvote_response, CB_SEND_REQUESTVOTE_RESPONSE);
+    WRAP(send_appendentries, CB_SEND_APPENDENTRIES);
+    WRAP(send_appendentries_response, CB_SEND_APPENDENTRIES_RESPONSE);
+    WRAP(applylog, CB_APPLYLOG);
+    WRAP(send_installsnapshot, CB_SEND_INSTALLSNAPSHOT);
+    WRAP(send_installsnapshot_response, CB_SEND_INSTALLSNAPSHOT_RESPONSE);
+    WRAP(snapshot_save, CB_SNAPSHOT_SAVE);
+    WRAP(snapshot_load, CB_SNAPSHOT_LOAD);
+    WRAP(capacity, CB_CAPACITY);
+    WRAP(node_lagging, CB_NODE_LAGGING);
+    WRAP(send_appendentries_broadcast, CB_SEND_APPENDENTRIES_BROADCAST);
+    WRAP(entry_done, CB_ENTRY_DONE);
+    WRAP(send_proposal, CB_SEND_PROPOSAL);
+    WRAP(applylog_tentative, CB_APPLYLOG_TENTATIVE);
+#undef WRAP
+
+    fwrite(TRACE_MAGIC, 1, 4, fp);
+    __put_varint(fp, r->nodeid);
+    __put_varint(fp, r->num_nodes);
+    __put_varint(fp, r->seed);
+    __put_varint(fp, mask);
+    __put_varint(fp, r->election_timeout);
+    __put_varint(fp, r->request_timeout);
+    __put_varint(fp, r->snapshot_threshold);
+    __put_varint(fp, r->learner_threshold);
+    __put_varint(fp, r->catchup_threshold);
+    __put_varint(fp, r->catchup_rate);
+    __put_varint(fp, r->uncommitted_limit);
+    __put_varint(fp, r->lag_threshold);
+    __put_varint(fp, r->codecs);
+    __put_varint(fp, r->compaction_key_offset);
+    __put_varint(fp, r->compaction_key_len);
+    __put_varint(fp, r->ack_delay);
+    __put_varint(fp, r->ack_max);
+    __put_varint(fp, sizeof(msg_entry_t));
+    __put_varint(fp, strlen(r->entry_layout));
+    fwrite(r->entry_layout, 1, strlen(r->entry_layout), fp);
+    for (i = 0; i < r->num_nodes; i++)
+        putc(raft_node_is_voting(r->nodes[i]), fp);
+
+    r->trace = me;
+    return (void*)me;
+}
+
+void raft_trace_free(raft_trace_t* me_)
+{
+    raft_trace_private_t* me = (void*)me_;
+    raft_server_private_t* r = (void*)me->raft;
+
+    r->cb = me->cb;
+    r->trace = NULL;
+    fflush(me->fp);
+    free(me);
+}
+
+void raft_trace_input(raft_trace_t* me_, int type, int node, const void* msg)
+{
+    raft_trace_private_t* me = (void*)me_;
+    long long now = __now_usec();
+
+    putc(type, me->fp);
+    __put_varint(me->fp, node);
+    __put_varint(me->fp, now - me->last_usec);
+    me->last_usec = now;
+    __put_fields(me->fp, __fields(type), msg);
+}
+
+/*--------------------------------------------------------------------------*/
+/* Replaying */
+
+typedef struct {
+    int type;
+    int node;
+    int len;
+} output_t;
+
+typedef struct {
+    FILE* fp;
+    raft_server_t* raft;
+
+    /* callbacks the traced server made for the current input */
+    output_t* expected;
+    int nexpected;
+    int expected_size;
+
+    /* and those we've made replaying it */
+    output_t* actual;
+    int nactual;
+    int actual_size;
+} raft_replay_private_t;
+
+static output_t* __push(output_t** array, int* n, int* size)
+{
+    if (*n == *size)
+    {
+        output_t* temp = realloc(*array, sizeof(output_t) * *size * 2);
+        if (!temp)
+            return NULL;
+        *array = temp;
+        *size *= 2;
+    }
+    return &(*array)[(*n)++];
+}
+
+static output_t* __replayed(raft_server_t* raft, int type, int node)
+{
+    raft_replay_private_t* me = raft_get_udata(raft);
+    output_t* o = __push(&me->actual, &me->nactual, &me->actual_size);
+
+    if (o)
+    {
+        o->type = type;
+        o->node = node;
+        o->len = 0;
+    }
+    return o;
+}
+
+static int __replay_requestvote(raft_server_t* raft, int node,
+                                msg_requestvote_t* msg)
+{
+    __replayed(raft, RAFT_TRACE_SEND_REQUESTVOTE, node);
+    return 1;
+}
+
+static int __replay_requestvote_response(raft_server_t* raft, int node,
+                                         msg_requestvote_response_t* msg)
+{
+    __replayed(raft, RAFT_TRACE_SEND_REQUESTVOTE_RESPONSE, node);
+    return 1;
+}
+
+static int __replay_appendentries(raft_server_t* raft, int node,
+                                  msg_appendentries_t* msg)
+{
+    __replayed(raft, RAFT_TRACE_SEND_APPENDENTRIES, node);
+    return 1;
+}
+
+static int __replay_appendentries_response(raft_server_t* raft, int node,
+                                           msg_appendentries_response_t* msg)
+{
+    __replayed(raft, RAFT_TRACE_SEND_APPENDENTRIES_RESPONSE, node);
+    return 1;
+}
+
+static int __replay_installsnapshot(raft_server_t* raft, int node,
+                                    msg_installsnapshot_t* msg)
+{
+    __replayed(raft, RAFT_TRACE_SEND_INSTALLSNAPSHOT, node);
+    return 1;
+}
+
+static int __replay_installsnapshot_response(raft_server_t* raft, int node,
+                                             msg_installsnapshot_response_t* msg)
+{
+    __replayed(raft, RAFT_TRACE_SEND_INSTALLSNAPSHOT_RESPONSE, node);
+    return 1;
+}
+
+static int __replay_applylog(raft_server_t* raft, msg_entry_t entry)
+{
+    __replayed(raft, RAFT_TRACE_APPLYLOG, -1);
+    return 1;
+}
+
+static int __replay_snapshot_save(raft_server_t* raft, unsigned char** data,
+                                  int* len)
+{
+    raft_replay_private_t* me = raft_get_udata(raft);
+    output_t* o = __replayed(raft, RAFT_TRACE_SNAPSHOT_SAVE, -1);
+    int i;
+
+    /* we don't have the state machine, only the size of its snapshot */
+    *len = 0;
+    for (i = 0; i < me->nexpected; i++)
+        if (RAFT_TRACE_SNAPSHOT_SAVE == me->expected[i].type)
+        {
+            *len = me->expected[i].len;
+            break;
+        }
+    if (o)
+        o->len = *len;
+    return NULL != (*data = calloc(1, *len + 1));
+}
+
+static int __replay_snapshot_load(raft_server_t* raft, unsigned char* data,
+                                  int len)
+{
+    __replayed(raft, RAFT_TRACE_SNAPSHOT_LOAD, -1);
+    return 1;
+}
+
+static void __replay_capacity(raft_server_t* raft)
+{
+    __replayed(raft, RAFT_TRACE_CAPACITY, -1);
+}
+
+static void __replay_node_lagging(raft_server_t* raft, int node, int lagging)
+{
+    __replayed(raft, RAFT_TRACE_NODE_LAGGING, node);
+}
+
+static int __replay_appendentries_broadcast(raft_server_t* raft,
+                                            const int* nodes, int nnodes,
+                                            msg_appendentries_t* msg)
+{
+    int i;
+
+    for (i = 0; i < nnodes; i++)
+        __replayed(raft, RAFT_TRACE_SEND_APPENDENTRIES_BROADCAST, nodes[i]);
+    return 1;
+}
+
+static void __replay_entry_done(raft_server_t* raft, msg_entry_response_t* r,
+                                int result)
+{
+    __replayed(raft, RAFT_TRACE_ENTRY_DONE, -1);
+}
+
+static int __replay_send_proposal(raft_server_t* raft, int node,
+                                  msg_entry_t* entry)
+{
+    __replayed(raft, RAFT_TRACE_SEND_PROPOSAL, node);
+    return 1;
+}
+
+static void __replay_applylog_tentative(raft_server_t* raft,
+                                        msg_entry_response_t* r,
+                                        msg_entry_t* entry)
+{
+    __replayed(raft, RAFT_TRACE_APPLYLOG_TENTATIVE, -1);
+}
+
+raft_replay_t* raft_replay_new(FILE* fp)
+{
+    raft_replay_private_t* me;
+    raft_server_private_t* r;
+    raft_cbs_t cb;
+    char magic[4], layout[sizeof(msg_entry_t) + 1];
+    int64_t v[19];
+    int i;
+
+#ifdef RAFT_STATIC_HOOKS
+    return NULL;
+#endif
+    if (4 != fread(magic, 1, 4, fp) || memcmp(magic, TRACE_MAGIC, 4))
+        return NULL;
+    for (i = 0; i < 19; i++)
+        if (!__get_varint(fp, &v[i]))
+            return NULL;
+    if (v[1] <= 0 || v[18] < 0 || (int64_t)sizeof(layout) <= v[18] ||
+        fread(layout, 1, v[18], fp) != (size_t)v[18])
+        return NULL;
+    layout[v[18]] = 0;
+
+    /* traced by a server built for other entries or another cluster */
+    if ((int64_t)sizeof(msg_entry_t) != v[17])
+        return NULL;
+#ifdef RAFT_NUM_NODES
+    if (RAFT_NUM_NODES != v[1])
+        return NULL;
+#endif
+
+    if (!(me = calloc(1, sizeof(raft_replay_private_t))))
+        return NULL;
+    me->fp = fp;
+    me->expected_size = me->actual_size = 16;
+    me->expected = malloc(sizeof(output_t) * me->expected_size);
+    me->actual = malloc(sizeof(output_t) * me->actual_size);
+    if (!(me->raft = raft_new((int)v[0])))
+    {
+        free(me->expected);
+        free(me->actual);
+        free(me);
+        return NULL;
+    }
+    if (!raft_set_configuration(me->raft, (int)v[1]))
+    {
+        raft_replay_free((void*)me);
+        return NULL;
+    }
+
+    memset(&cb, 0, sizeof(cb));
+#define STUB(name, stub, bit) \
+    if (v[3] & bit) cb.name = stub;
+    STUB(send_requestvote, __replay_requestvote, CB_SEND_REQUESTVOTE);
+    STUB(send_requestvote_response, __replay_requestvote_response,
+         CB_SEND_REQUESTVOTE_RESPONSE);
+    STUB(send_appendentries, __replay_appendentries, CB_SEND_APPENDENTRIES);
+    STUB(send_appendentries_response, __replay_appendentries_response,
+         CB_SEND_APPENDENTRIES_RESPONSE);
+    STUB(send_installsnapshot, __replay_installsnapshot,
+         CB_SEND_INSTALLSNAPSHOT);
+    STUB(send_installsnapshot_response, __replay_installsnapshot_response,
+         CB_SEND_INSTALLSNAPSHOT_RESPONSE);
+    STUB(applylog, __replay_applylog, CB_APPLYLOG);
+    STUB(snapshot_save, __replay_snapshot_save, CB_SNAPSHOT_SAVE);
+    STUB(snapshot_load, __replay_snapshot_load, CB_SNAPSHOT_LOAD);
+    STUB(capacity, __replay_capacity, CB_CAPACITY);
+    STUB(node_lagging, __replay_node_lagging, CB_NODE_LAGGING);
+    STUB(send_appendentries_broadcast, __replay_appendentries_broadcast,
+         CB_SEND_APPENDENTRIES_BROADCAST);
+    STUB(entry_done, __replay_entry_done, CB_ENTRY_DONE);
+    STUB(send_proposal, __replay_send_proposal, CB_SEND_PROPOSAL);
+    STUB(applylog_tentative, __replay_applylog_tentative,
+         CB_APPLYLOG_TENTATIVE);
+#undef STUB
+    raft_set_callbacks(me->raft, &cb);
+    raft_set_udata(me->raft, me);
+
+    r = (void*)me->raft;
+    r->seed = (unsigned int)v[2];
+    raft_set_election_timeout(me->raft, (int)v[4]);
+    raft_set_request_timeout(me->raft, (int)v[5]);
+    raft_set_snapshot_threshold(me->raft, (int)v[6]);
+    raft_set_learner_threshold(me->raft, (int)v[7]);
+    raft_set_catchup(me->raft, (int)v[8], (int)v[9]);
+    raft_set_uncommitted_limit(me->raft, (int)v[10]);
+    raft_set_lag_threshold(me->raft, (int)v[11]);
+    raft_set_codecs(me->raft, (int)v[12]);
+    raft_set_compaction_key(me->raft, (int)v[13], (int)v[14]);
+    raft_set_ack_delay(me->raft, (int)v[15], (int)v[16]);
+    if (layout[0])
+        raft_set_entry_layout(me->raft, layout);
+    for (i = 0; i < v[1]; i++)
+    {
+        int voting = getc(fp);
+        if (EOF == voting)
+        {
+            raft_replay_free((void*)me);
+            return NULL;
+        }
+        /* the trace says who the learners are, not whether their changes
+         * have committed */
+        r->learners_idx = -1;
+        if (!voting)
+            raft_set_learner(me->raft, i);
+    }
+
+    return (void*)me;
+}
+
+void raft_replay_free(raft_replay_t* me_)
+{
+    raft_replay_private_t* me = (void*)me_;
+
+    raft_free(me->raft);
+    free(me->expected);
+    free(me->actual);
+    free(me);
+}
+
+raft_server_t* raft_replay_get_server(raft_replay_t* me_)
+{
+    return ((raft_replay_private_t*)me_)->raft;
+}
+
+int raft_replay_next(raft_replay_t* me_, raft_trace_event_t* ev)
+{
+    raft_replay_private_t* me = (void*)me_;
+    int64_t v;
+    int c;
+
+    if (EOF == (c = getc(me->fp)))
+        return 0;
+    if (RAFT_TRACE_NINPUTS <= c)
+        return -1;
+
+    memset(ev, 0, sizeof(raft_trace_event_t));
+    ev->type = c;
+    if (!__get_varint(me->fp, &v))
+        return -1;
+    ev->node = (int)v;
+    if (!__get_varint(me->fp, &v))
+        return -1;
+    ev->usec = v;
+    if (!__get_fields(me->fp, __fields(ev->type), &ev->u))
+        return -1;
+
+    /* the callbacks made while handling it follow, up to the next input */
+    me->nexpected = 0;
+    while (EOF != (c = getc(me->fp)))
+    {
+        output_t* o;
+
+        if (c < RAFT_TRACE_SEND_REQUESTVOTE)
+        {
+            ungetc(c, me->fp);
+            break;
+        }
+        if (!(o = __push(&me->expected, &me->nexpected, &me->expected_size)))
+            return -1;
+        o->type = c;
+        o->len = 0;
+        if (!__get_varint(me->fp, &v))
+            return -1;
+        o->node = (int)v;
+        if (RAFT_TRACE_SNAPSHOT_SAVE == c)
+        {
+            if (!__get_varint(me->fp, &v))
+                return -1;
+            o->len = (int)v;
+        }
+    }
+    return 1;
+}
+
+int raft_replay_dispatch(raft_replay_t* me_, raft_trace_event_t* ev)
+{
+    raft_replay_private_t* me = (void*)me_;
+    raft_server_t* raft = me->raft;
+
+    me->nactual = 0;
+
+    switch (ev->type)
+    {
+        case RAFT_TRACE_PERIODIC:
+            raft_periodic(raft, ev->u.msec);
+            break;
+        case RAFT_TRACE_RECV_REQUESTVOTE:
+            raft_recv_requestvote(raft, ev->node, &ev->u.rv);
+            break;
+        case RAFT_TRACE_RECV_REQUESTVOTE_RESPONSE:
+            raft_recv_requestvote_response(raft, ev->node, &ev->u.rvr);
+            break;
+        case RAFT_TRACE_RECV_APPENDENTRIES:
+            raft_recv_appendentries(raft, ev->node, &ev->u.ae);
+            break;
+        case RAFT_TRACE_RECV_APPENDENTRIES_RESPONSE:
+            raft_recv_appendentries_response(raft, ev->node, &ev->u.aer);
+            break;
+        case RAFT_TRACE_RECV_INSTALLSNAPSHOT:
+            raft_recv_installsnapshot(raft, ev->node, &ev->u.is);
+            break;
+        case RAFT_TRACE_RECV_INSTALLSNAPSHOT_RESPONSE:
+            raft_recv_installsnapshot_response(raft, ev->node, &ev->u.isr);
+            break;
+        case RAFT_TRACE_RECV_ENTRY:
+            raft_recv_entry(raft, ev->node, &ev->u.entry, NULL);
+            break;
+        case RAFT_TRACE_FORWARD_ENTRY:
+            raft_forward_entry(raft, &ev->u.entry);
+            break;
+        case RAFT_TRACE_BECOME_CANDIDATE:
+            raft_become_candidate(raft);
+            break;
+        case RAFT_TRACE_CLEAR_NODE:
+            raft_clear_node(raft, ev->node);
+            break;
+        case RAFT_TRACE_SET_LEARNER:
+            raft_set_learner(raft, ev->node);
+            break;
+        case RAFT_TRACE_RTT_SAMPLE:
+            raft_add_rtt_sample(raft, ev->node, ev->u.msec);
+            break;
+    }
+
+    if (me->nactual != me->nexpected)
+        return 0;
+    return 0 == memcmp(me->actual, me->expected, sizeof(output_t) * me->nactual);
+}
+
+const char* raft_trace_type_name(int type)
+{
+    switch (type)
+    {
+        case RAFT_TRACE_PERIODIC: return "periodic";
+        case RAFT_TRACE_RECV_REQUESTVOTE: return "requestvote";
+        case RAFT_TRACE_RECV_REQUESTVOTE_RESPONSE: return "requestvote_response";
+        case RAFT_TRACE_RECV_APPENDENTRIES: return "appendentries";
+        case RAFT_TRACE_RECV_APPENDENTRIES_RESPONSE: return "appendentries_response";
+        case RAFT_TRACE_RECV_INSTALLSNAPSHOT: return "installsnapshot";
+        case RAFT_TRACE_RECV_INSTALLSNAPSHOT_RESPONSE: return "installsnapshot_response";
+        case RAFT_TRACE_RECV_ENTRY: return "entry";
+        case RAFT_TRACE_FORWARD_ENTRY: return "forward_entry";
+        case RAFT_TRACE_BECOME_CANDIDATE: return "become_candidate";
+        case RAFT_TRACE_CLEAR_NODE: return "clear_node";
+        case RAFT_TRACE_SET_LEARNER: return "set_learner";
+        case RAFT_TRACE_RTT_SAMPLE: return "rtt_sample";
+        default: return "unknown";
+    }
+}
@@ -0,0 +1,138 @@
+#ifndef RAFT_TRACE_H_
+#define RAFT_TRACE_H_
+
+/**
+ * Copyright (c) 2013, Willem-Hendrik Thiart
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * @file
+ * @brief Recording a Raft server's inputs so they can be replayed offline
+ * @version 0.1
+ *
+ * A trace holds the server's configuration, then every message, entry and
+ * timer tick handed to it, each stamped with the time since the one before.
+ * The callbacks the server makes in response are recorded too, so that a
+ * replay can tell when it has stopped doing what the traced server did.
+ */
+
+#include <stdio.h>
+
+/* Event types. Inputs are calls into the server; outputs are callbacks */
+enum {
+    RAFT_TRACE_PERIODIC = 1,
+    RAFT_TRACE_RECV_REQUESTVOTE,
+    RAFT_TRACE_RECV_REQUESTVOTE_RESPONSE,
+    RAFT_TRACE_RECV_APPENDENTRIES,
+    RAFT_TRACE_RECV_APPENDENTRIES_RESPONSE,
+    RAFT_TRACE_RECV_INSTALLSNAPSHOT,
+    RAFT_TRACE_RECV_INSTALLSNAPSHOT_RESPONSE,
+    RAFT_TRACE_RECV_ENTRY,
+    RAFT_TRACE_BECOME_CANDIDATE,
+    RAFT_TRACE_CLEAR_NODE,
+    RAFT_TRACE_SET_LEARNER,
+    RAFT_TRACE_RTT_SAMPLE,
+    RAFT_TRACE_FORWARD_ENTRY,
+    RAFT_TRACE_NINPUTS,
+
+    RAFT_TRACE_SEND_REQUESTVOTE = 64,
+    RAFT_TRACE_SEND_REQUESTVOTE_RESPONSE,
+    RAFT_TRACE_SEND_APPENDENTRIES,
+    RAFT_TRACE_SEND_APPENDENTRIES_RESPONSE,
+    RAFT_TRACE_SEND_INSTALLSNAPSHOT,
+    RAFT_TRACE_SEND_INSTALLSNAPSHOT_RESPONSE,
+    RAFT_TRACE_APPLYLOG,
+    RAFT_TRACE_SNAPSHOT_SAVE,
+    RAFT_TRACE_SNAPSHOT_LOAD,
+    RAFT_TRACE_CAPACITY,
+    RAFT_TRACE_NODE_LAGGING,
+    /* recorded once per node in the group */
+    RAFT_TRACE_SEND_APPENDENTRIES_BROADCAST,
+    RAFT_TRACE_ENTRY_DONE,
+    RAFT_TRACE_SEND_PROPOSAL,
+    RAFT_TRACE_APPLYLOG_TENTATIVE
+};
+
+typedef struct {
+    int type;
+
+    /* the peer the event concerns; -1 if none */
+    int node;
+
+    /* microseconds since the previous input */
+    long long usec;
+
+    union {
+        /* RAFT_TRACE_PERIODIC and RAFT_TRACE_RTT_SAMPLE */
+        int msec;
+        msg_requestvote_t rv;
+        msg_requestvote_response_t rvr;
+        msg_appendentries_t ae;
+        msg_appendentries_response_t aer;
+        msg_installsnapshot_t is;
+        msg_installsnapshot_response_t isr;
+        /* RAFT_TRACE_RECV_ENTRY and RAFT_TRACE_FORWARD_ENTRY */
+        msg_entry_t entry;
+    } u;
+} raft_trace_event_t;
+
+typedef void* raft_trace_t;
+
+/**
+ * Start recording a server. Call this once the server is configured and
+ * its callbacks are set, before it has been handed any messages; replays
+ * start from an empty server. The server's callbacks must not call back
+ * into it while recording
+ * @param raft The server to record
+ * @param fp Where to write the trace
+ * @return NULL on error, or if we were built with RAFT_STATIC_HOOKS */
+raft_trace_t* raft_trace_new(raft_server_t* raft, FILE* fp);
+
+/**
+ * Stop recording and restore the server's callbacks. The file is flushed
+ * but left open */
+void raft_trace_free(raft_trace_t* me_);
+
+/**
+ * Record a call into the server. The server calls this itself
+ * @param type RAFT_TRACE_* input type
+ * @param node The peer involved; -1 if none
+ * @param msg The message or entry; NULL if none */
+void raft_trace_input(raft_trace_t* me_, int type, int node, const void* msg);
+
+typedef void* raft_replay_t;
+
+/**
+ * Read a trace's header and create a server configured as the traced one
+ * was, ready to replay the trace into
+ * @param fp The trace
+ * @return NULL if this isn't a trace, or one this build can't replay
+ * because it was built with another RAFT_ENTRY_SIZE or RAFT_NUM_NODES, or
+ * with RAFT_STATIC_HOOKS */
+raft_replay_t* raft_replay_new(FILE* fp);
+
+/**
+ * Free the replay and its server. The file is left open */
+void raft_replay_free(raft_replay_t* me_);
+
+/**
+ * @return the server the trace is replayed into */
+raft_server_t* raft_replay_get_server(raft_replay_t* me_);
+
+/**
+ * Read the next input of the trace, along with the callbacks the traced
+ * server made while handling it
+ * @return 1 if ev was filled in; 0 at the end of the trace; -1 on error */
+int raft_replay_next(raft_replay_t* me_, raft_trace_event_t* ev);
+
+/**
+ * Hand an input to the server, as the traced program did
+ * @return 1 if the server made the same callbacks as the traced one; 0 if
+ * the replay has diverged */
+int raft_replay_dispatch(raft_replay_t* me_, raft_trace_event_t* ev);
+
+/**
+ * @return name of an event type */
+const char* raft_trace_type_name(int type);
+
+#endif /* RAFT_TRACE_H_ */
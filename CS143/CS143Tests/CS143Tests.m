@@ -8,6 +8,45 @@
 
 #import <UIKit/UIKit.h>
 #import <XCTest/XCTest.h>
+#import "raft.h"
+
+/* A leader of five nodes, elected with votes from nodes 1 and 2 */
+static raft_server_t* leaderOfFive(void)
+{
+    raft_server_t* r = raft_new(0);
+    msg_requestvote_response_t vote;
+    
+    raft_set_configuration(r, 5);
+    raft_become_candidate(r);
+    memset(&vote, 0, sizeof(vote));
+    vote.term = raft_get_current_term(r);
+    vote.vote_granted = 1;
+    raft_recv_requestvote_response(r, 1, &vote);
+    raft_recv_requestvote_response(r, 2, &vote);
+    return r;
+}
+
+static void propose(raft_server_t* r)
+{
+    msg_entry_t e;
+    
+    memset(&e, 0, sizeof(e));
+    raft_recv_entry(r, 0, &e, NULL);
+}
+
+/* The node acks everything the leader has */
+static void ack(raft_server_t* r, int node)
+{
+    msg_appendentries_response_t resp;
+    
+    memset(&resp, 0, sizeof(resp));
+    resp.term = raft_get_current_term(r);
+    resp.success = 1;
+    resp.current_idx = raft_get_current_idx(r);
+    resp.first_idx = resp.current_idx - 1;
+    resp.quorum_rtt = -1;
+    raft_recv_appendentries_response(r, node, &resp);
+}
 
 @interface CS143Tests : XCTestCase
 
@@ -30,6 +69,43 @@
     XCTAssert(YES, @"Pass");
 }
 
+- (void)testDemotedNodesAcksDontCount {
+    raft_server_t* r = leaderOfFive();
+    XCTAssert(raft_is_leader(r));
+    propose(r);
+    ack(r, 1);
+    ack(r, 2);
+    XCTAssertEqual(raft_get_last_applied_idx(r), 0);
+    
+    // node 1 acks entry 1, then stops voting; 2 of the 3 other voters must ack
+    propose(r);
+    ack(r, 1);
+    XCTAssert(raft_set_learner(r, 1));
+    XCTAssertEqual(raft_get_num_voting_nodes(r), 4);
+    ack(r, 2);
+    XCTAssertEqual(raft_get_last_applied_idx(r), 0);
+    
+    // one change at a time
+    XCTAssertFalse(raft_set_learner(r, 2));
+    ack(r, 3);
+    XCTAssertEqual(raft_get_last_applied_idx(r), 1);
+    raft_free(r);
+}
+
+- (void)testClearedNodesAcksDontCount {
+    raft_server_t* r = leaderOfFive();
+    propose(r);
+    ack(r, 3);
+    
+    // the device in slot 3 leaves, so its ack is gone with it
+    raft_clear_node(r, 3);
+    ack(r, 4);
+    XCTAssertEqual(raft_get_last_applied_idx(r), -1);
+    ack(r, 3);
+    XCTAssertEqual(raft_get_last_applied_idx(r), 0);
+    raft_free(r);
+}
+
 - (void)testPerformanceExample {
     // This is an example of a performance test case.
     [self measureBlock:^{
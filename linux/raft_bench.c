@@ -0,0 +1,316 @@
+/**
+ * @file
+ * @brief Measures how the leader's CPU cost per message grows with the
+ * cluster
+ *
+ * usage: raft_bench [-e ENTRIES] [NODES...]
+ *
+ * Runs a cluster of each size in this process, with messages delivered in
+ * memory and none lost. Node 0 stands for election, then has ENTRIES
+ * entries proposed to it one at a time. Prints the CPU time the leader
+ * spends per vote response and per message it sends or receives while
+ * replicating; both should stay flat as nodes are added.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "raft.h"
+
+#define DEFAULT_ENTRIES 20000
+
+/* the leader's periodic runs after this many proposals */
+#define PERIODIC_ENTRIES 100
+
+enum {
+    MSG_REQUESTVOTE,
+    MSG_REQUESTVOTE_RESPONSE,
+    MSG_APPENDENTRIES,
+    MSG_APPENDENTRIES_RESPONSE,
+    MSG_INSTALLSNAPSHOT,
+    MSG_INSTALLSNAPSHOT_RESPONSE
+};
+
+typedef struct {
+    int from;
+    int to;
+    int type;
+    union {
+        msg_requestvote_t rv;
+        msg_requestvote_response_t rvr;
+        msg_appendentries_t ae;
+        msg_appendentries_response_t aer;
+        msg_installsnapshot_t is;
+        msg_installsnapshot_response_t isr;
+    } u;
+} msg_t;
+
+typedef struct {
+    /* CPU time the leader spent on vote responses, and how many */
+    long long vote_nsec;
+    long long votes;
+
+    /* CPU time the leader spent replicating, and the messages it sent and
+     * received meanwhile */
+    long long nsec;
+    long long msgs;
+} result_t;
+
+static raft_server_t** servers;
+
+static msg_t* queue;
+static int queue_len, queue_size;
+
+/* messages the leader has sent */
+static long long leader_sent;
+
+static long long __cpu_nsec()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void __push(raft_server_t* raft, int node, int type, const void* m,
+                   size_t len)
+{
+    msg_t* msg;
+
+    if (queue_len == queue_size)
+    {
+        queue_size = queue_size ? queue_size * 2 : 1024;
+        if (!(queue = realloc(queue, sizeof(msg_t) * queue_size)))
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    msg = &queue[queue_len++];
+    msg->from = raft_get_nodeid(raft);
+    msg->to = node;
+    msg->type = type;
+    memcpy(&msg->u, m, len);
+    if (0 == msg->from)
+        leader_sent++;
+}
+
+static int __send_requestvote(raft_server_t* raft, int node,
+                              msg_requestvote_t* m)
+{
+    __push(raft, node, MSG_REQUESTVOTE, m, sizeof(*m));
+    return 0;
+}
+
+static int __send_requestvote_response(raft_server_t* raft, int node,
+                                       msg_requestvote_response_t* m)
+{
+    __push(raft, node, MSG_REQUESTVOTE_RESPONSE, m, sizeof(*m));
+    return 0;
+}
+
+static int __send_appendentries(raft_server_t* raft, int node,
+                                msg_appendentries_t* m)
+{
+    __push(raft, node, MSG_APPENDENTRIES, m, sizeof(*m));
+    return 0;
+}
+
+static int __send_appendentries_response(raft_server_t* raft, int node,
+                                         msg_appendentries_response_t* m)
+{
+    __push(raft, node, MSG_APPENDENTRIES_RESPONSE, m, sizeof(*m));
+    return 0;
+}
+
+static int __send_installsnapshot(raft_server_t* raft, int node,
+                                  msg_installsnapshot_t* m)
+{
+    __push(raft, node, MSG_INSTALLSNAPSHOT, m, sizeof(*m));
+    return 0;
+}
+
+static int __send_installsnapshot_response(raft_server_t* raft, int node,
+                                           msg_installsnapshot_response_t* m)
+{
+    __push(raft, node, MSG_INSTALLSNAPSHOT_RESPONSE, m, sizeof(*m));
+    return 0;
+}
+
+static int __applylog(raft_server_t* raft, msg_entry_t entry)
+{
+    return 1;
+}
+
+/**
+ * Deliver messages until none are left, adding the time node 0 spends on
+ * them to 'res' */
+static void __deliver(result_t* res)
+{
+    int i;
+
+    for (i = 0; i < queue_len; i++)
+    {
+        /* handlers queue more messages, which may move the queue */
+        msg_t msg = queue[i];
+        raft_server_t* raft = servers[msg.to];
+        long long start = 0;
+
+        if (0 == msg.to)
+            start = __cpu_nsec();
+
+        switch (msg.type)
+        {
+        case MSG_REQUESTVOTE:
+            raft_recv_requestvote(raft, msg.from, &msg.u.rv);
+            break;
+        case MSG_REQUESTVOTE_RESPONSE:
+            raft_recv_requestvote_response(raft, msg.from, &msg.u.rvr);
+            break;
+        case MSG_APPENDENTRIES:
+            raft_recv_appendentries(raft, msg.from, &msg.u.ae);
+            break;
+        case MSG_APPENDENTRIES_RESPONSE:
+            raft_recv_appendentries_response(raft, msg.from, &msg.u.aer);
+            break;
+        case MSG_INSTALLSNAPSHOT:
+            raft_recv_installsnapshot(raft, msg.from, &msg.u.is);
+            break;
+        case MSG_INSTALLSNAPSHOT_RESPONSE:
+            raft_recv_installsnapshot_response(raft, msg.from, &msg.u.isr);
+            break;
+        }
+
+        if (0 != msg.to)
+            continue;
+        if (MSG_REQUESTVOTE_RESPONSE == msg.type)
+        {
+            res->vote_nsec += __cpu_nsec() - start;
+            res->votes++;
+        }
+        else
+        {
+            res->nsec += __cpu_nsec() - start;
+            res->msgs++;
+        }
+    }
+    queue_len = 0;
+}
+
+static int __run(int nodes, int entries, result_t* res)
+{
+    raft_cbs_t cbs;
+    long long start, sent;
+    int i;
+
+    memset(&cbs, 0, sizeof(cbs));
+    cbs.send_requestvote = __send_requestvote;
+    cbs.send_requestvote_response = __send_requestvote_response;
+    cbs.send_appendentries = __send_appendentries;
+    cbs.send_appendentries_response = __send_appendentries_response;
+    cbs.send_installsnapshot = __send_installsnapshot;
+    cbs.send_installsnapshot_response = __send_installsnapshot_response;
+    cbs.applylog = __applylog;
+
+    if (!(servers = calloc(nodes, sizeof(raft_server_t*))))
+        return 0;
+    for (i = 0; i < nodes; i++)
+    {
+        servers[i] = raft_new(i);
+        raft_set_callbacks(servers[i], &cbs);
+        if (!raft_set_configuration(servers[i], nodes))
+        {
+            fprintf(stderr, "%d nodes: built for a different number\n", nodes);
+            return 0;
+        }
+    }
+
+    memset(res, 0, sizeof(*res));
+    raft_become_candidate(servers[0]);
+    __deliver(res);
+    if (!raft_is_leader(servers[0]))
+    {
+        fprintf(stderr, "%d nodes: node 0 wasn't elected\n", nodes);
+        return 0;
+    }
+
+    /* replication starts from here; what the election cost is counted
+     * against vote responses */
+    res->nsec = 0;
+    res->msgs = 0;
+    sent = leader_sent;
+    for (i = 0; i < entries; i++)
+    {
+        msg_entry_t e;
+
+        memset(&e, 0, sizeof(e));
+        memcpy(e.data, &i, sizeof(i));
+
+        start = __cpu_nsec();
+        raft_recv_entry(servers[0], 0, &e, NULL);
+        if (0 == (i + 1) % PERIODIC_ENTRIES)
+            raft_periodic(servers[0], 10);
+        res->nsec += __cpu_nsec() - start;
+        __deliver(res);
+    }
+    res->msgs += leader_sent - sent;
+
+    if (raft_get_last_applied_idx(servers[0]) + 1 < entries)
+    {
+        fprintf(stderr, "%d nodes: only %lld of %d entries committed\n",
+                nodes, raft_get_last_applied_idx(servers[0]) + 1, entries);
+        return 0;
+    }
+
+    for (i = 0; i < nodes; i++)
+        raft_free(servers[i]);
+    free(servers);
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    static const int default_sizes[] = { 3, 5, 7, 9, 17, 33, 51, 65, 101 };
+    int entries = DEFAULT_ENTRIES, c, i, n;
+
+    while (-1 != (c = getopt(argc, argv, "e:")))
+    {
+        if ('e' == c)
+            entries = atoi(optarg);
+        else
+            goto usage;
+    }
+    if (entries <= 0)
+        goto usage;
+
+    printf("%6s %8s %10s %12s %10s\n",
+           "nodes", "votes", "ns/vote", "messages", "ns/msg");
+
+    n = optind < argc ? argc - optind :
+        (int)(sizeof(default_sizes) / sizeof(default_sizes[0]));
+    for (i = 0; i < n; i++)
+    {
+        int nodes = optind < argc ? atoi(argv[optind + i]) : default_sizes[i];
+        result_t res;
+
+        if (nodes < 1)
+            goto usage;
+        if (!__run(nodes, entries, &res))
+            return 1;
+        printf("%6d %8lld %10lld %12lld %10lld\n", nodes, res.votes,
+               res.votes ? res.vote_nsec / res.votes : 0,
+               res.msgs, res.msgs ? res.nsec / res.msgs : 0);
+    }
+
+    free(queue);
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-e ENTRIES] [NODES...]\n", argv[0]);
+    return 1;
+}
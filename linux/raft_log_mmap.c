@@ -0,0 +1,527 @@
+/**
+ * @file
+ * @brief Log storage backend that keeps entries in memory mapped files
+ *
+ * Segment files are named after the index of their first slot, and hold a
+ * header, then the terms of every slot, then the payloads. Every segment
+ * but the last is full, so the segment holding an entry is found by
+ * division.
+ *
+ * Entries only count once synced: sync writes out the entries, then
+ * records in the header how many there are. On opening, anything past
+ * that count is ignored, so entries that were only partly written before
+ * a crash never come back. They were never acknowledged.
+ *
+ * Our term and vote are kept in a file of their own, rewritten in place,
+ * along with where the log starts: once every segment has been truncated
+ * away, there is nothing else to say the log was compacted. The file is
+ * smaller than a disk sector, so a write lands whole or not at all.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "raft.h"
+#include "raft_log_mmap.h"
+
+/* entries per segment */
+#define SEGMENT_ENTRIES 4096
+
+#define SEGMENT_MAGIC 0x4745534c54464152ULL
+
+#define HEADER_SIZE 64
+
+#define STATE_MAGIC 0x4554415354464152ULL
+
+typedef struct {
+    uint64_t magic;
+    uint32_t capacity;
+    uint32_t entry_size;
+
+    /* idx of the segment's first slot */
+    int64_t first_idx;
+
+    /* slots before this have been truncated away */
+    int64_t start;
+
+    /* slots that are durable */
+    int64_t synced;
+} header_t;
+
+typedef struct {
+    uint64_t magic;
+
+    /* -1 until saved */
+    int64_t term;
+    int64_t voted_for;
+
+    /* entries before this have been truncated away */
+    int64_t base;
+} state_t;
+
+typedef struct {
+    header_t* hdr;
+    raft_term_t* terms;
+    msg_entry_t* entries;
+    size_t size;
+
+    /* slots filled */
+    int count;
+} segment_t;
+
+typedef struct {
+    char* dir;
+    int dirfd;
+
+    /* the file holding our term, vote and where the log starts */
+    int statefd;
+    state_t state;
+
+    segment_t* segs;
+    int nsegs;
+    int segs_size;
+
+    /* segments from this one on have entries that haven't been synced */
+    int dirty;
+
+    /* we've created or removed segment files since the last sync */
+    int dir_dirty;
+} raft_log_mmap_private_t;
+
+static size_t __segment_size()
+{
+    return HEADER_SIZE + SEGMENT_ENTRIES * (sizeof(raft_term_t) + sizeof(msg_entry_t));
+}
+
+static void __segment_name(raft_log_mmap_private_t* me, raft_index_t first_idx,
+                           char* buf, size_t size)
+{
+    snprintf(buf, size, "%s/%020lld.seg", me->dir, first_idx);
+}
+
+static int __map(segment_t* s, int fd)
+{
+    void* base;
+
+    s->size = __segment_size();
+    base = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == base)
+        return 0;
+    s->hdr = base;
+    s->terms = (raft_term_t*)((char*)base + HEADER_SIZE);
+    s->entries = (msg_entry_t*)(s->terms + SEGMENT_ENTRIES);
+    return 1;
+}
+
+static void __unmap(segment_t* s)
+{
+    munmap(s->hdr, s->size);
+}
+
+/**
+ * Unmap and delete the segments from the n'th on */
+static void __remove_segments(raft_log_mmap_private_t* me, int n)
+{
+    char path[4096];
+
+    while (n < me->nsegs)
+    {
+        segment_t* s = &me->segs[--me->nsegs];
+        __segment_name(me, s->hdr->first_idx, path, sizeof(path));
+        __unmap(s);
+        unlink(path);
+        me->dir_dirty = 1;
+    }
+    if (me->nsegs < me->dirty)
+        me->dirty = me->nsegs;
+}
+
+static int __write_state(raft_log_mmap_private_t* me)
+{
+    if (sizeof(state_t) != pwrite(me->statefd, &me->state, sizeof(state_t), 0))
+        return 0;
+    return -1 != fdatasync(me->statefd);
+}
+
+static segment_t* __add_segment(raft_log_mmap_private_t* me, raft_index_t first_idx)
+{
+    char path[4096];
+    segment_t* s;
+    int fd;
+
+    if (me->nsegs == me->segs_size)
+    {
+        segment_t* temp = realloc(me->segs, sizeof(segment_t) * me->segs_size * 2);
+        if (!temp)
+            return NULL;
+        me->segs = temp;
+        me->segs_size *= 2;
+    }
+
+    /* a leftover file from a crash may already be there */
+    __segment_name(me, first_idx, path, sizeof(path));
+    if (-1 == (fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)))
+        return NULL;
+    s = &me->segs[me->nsegs];
+    if (-1 == ftruncate(fd, __segment_size()) || !__map(s, fd))
+    {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    close(fd);
+
+    s->hdr->magic = SEGMENT_MAGIC;
+    s->hdr->capacity = SEGMENT_ENTRIES;
+    s->hdr->entry_size = sizeof(msg_entry_t);
+    s->hdr->first_idx = first_idx;
+    s->count = 0;
+    me->nsegs++;
+    me->dir_dirty = 1;
+    return s;
+}
+
+/**
+ * @return the segment holding idx, with the slot in 'slot'; NULL if it
+ * isn't held */
+static segment_t* __find(raft_log_mmap_private_t* me, raft_index_t idx, int* slot)
+{
+    segment_t* s;
+    raft_index_t k;
+
+    if (0 == me->nsegs || idx < me->segs[0].hdr->first_idx)
+        return NULL;
+    k = (idx - me->segs[0].hdr->first_idx) / SEGMENT_ENTRIES;
+    if (me->nsegs <= k)
+        return NULL;
+    s = &me->segs[k];
+    *slot = (int)(idx - s->hdr->first_idx);
+    if (*slot < s->hdr->start || s->count <= *slot)
+        return NULL;
+    return s;
+}
+
+static int __append(void* me_, raft_index_t idx, raft_term_t term,
+                    const msg_entry_t* entry)
+{
+    raft_log_mmap_private_t* me = me_;
+    segment_t* s = me->nsegs ? &me->segs[me->nsegs - 1] : NULL;
+
+    if (s)
+        assert(idx == s->hdr->first_idx + s->count);
+    if (!s || SEGMENT_ENTRIES == s->count)
+    {
+        if (!(s = __add_segment(me, idx)))
+            return 0;
+    }
+
+    s->terms[s->count] = term;
+    s->entries[s->count] = *entry;
+    s->count++;
+    if (me->nsegs - 1 < me->dirty)
+        me->dirty = me->nsegs - 1;
+    return 1;
+}
+
+static msg_entry_t* __get(void* me_, raft_index_t idx, raft_term_t* term)
+{
+    int slot;
+    segment_t* s = __find(me_, idx, &slot);
+
+    if (!s)
+        return NULL;
+    *term = s->terms[slot];
+    return &s->entries[slot];
+}
+
+static void __truncate_suffix(void* me_, raft_index_t idx)
+{
+    raft_log_mmap_private_t* me = me_;
+    segment_t* s;
+    int i;
+
+    /* segments that are wholly after idx */
+    for (i = 0; i < me->nsegs && me->segs[i].hdr->first_idx + me->segs[i].hdr->start < idx; i++)
+        ;
+    __remove_segments(me, i);
+    if (0 == me->nsegs)
+        return;
+
+    s = &me->segs[me->nsegs - 1];
+    if (s->hdr->first_idx + s->count <= idx)
+        return;
+    s->count = (int)(idx - s->hdr->first_idx);
+
+    /* the slots may be filled again before the next sync, so they must
+     * stop counting as durable now */
+    if (s->count < s->hdr->synced)
+    {
+        s->hdr->synced = s->count;
+        msync(s->hdr, HEADER_SIZE, MS_SYNC);
+    }
+}
+
+static void __truncate_prefix(void* me_, raft_index_t idx)
+{
+    raft_log_mmap_private_t* me = me_;
+    char path[4096];
+    int n, i;
+
+    /* before the segments go, or a crash could leave an empty log that
+     * looks like it was never written to */
+    if (me->state.base < idx + 1)
+    {
+        me->state.base = idx + 1;
+        __write_state(me);
+    }
+
+    /* segments that are wholly before idx */
+    for (n = 0; n < me->nsegs && me->segs[n].hdr->first_idx + me->segs[n].count <= idx + 1; n++)
+        ;
+    for (i = 0; i < n; i++)
+    {
+        __segment_name(me, me->segs[i].hdr->first_idx, path, sizeof(path));
+        __unmap(&me->segs[i]);
+        unlink(path);
+        me->dir_dirty = 1;
+    }
+    memmove(me->segs, &me->segs[n], sizeof(segment_t) * (me->nsegs - n));
+    me->nsegs -= n;
+    me->dirty = me->dirty < n ? 0 : me->dirty - n;
+
+    if (0 < me->nsegs && me->segs[0].hdr->first_idx <= idx)
+        me->segs[0].hdr->start = idx + 1 - me->segs[0].hdr->first_idx;
+}
+
+static int __sync(void* me_)
+{
+    raft_log_mmap_private_t* me = me_;
+    int i;
+
+    for (i = me->dirty; i < me->nsegs; i++)
+    {
+        segment_t* s = &me->segs[i];
+
+        if (s->count == s->hdr->synced)
+            continue;
+        if (-1 == msync(s->hdr, s->size, MS_SYNC))
+            return 0;
+        s->hdr->synced = s->count;
+        if (-1 == msync(s->hdr, HEADER_SIZE, MS_SYNC))
+            return 0;
+    }
+    me->dirty = me->nsegs;
+
+    if (me->dir_dirty)
+    {
+        if (-1 == fsync(me->dirfd))
+            return 0;
+        me->dir_dirty = 0;
+    }
+    return 1;
+}
+
+static int __save_state(void* me_, raft_term_t term, int voted_for)
+{
+    raft_log_mmap_private_t* me = me_;
+
+    me->state.term = term;
+    me->state.voted_for = voted_for;
+    return __write_state(me);
+}
+
+static void __load_state(void* me_, raft_term_t* term, int* voted_for)
+{
+    raft_log_mmap_private_t* me = me_;
+
+    if (-1 == me->state.term)
+        return;
+    *term = me->state.term;
+    *voted_for = (int)me->state.voted_for;
+}
+
+static raft_index_t __range(void* me_, raft_index_t* first)
+{
+    raft_log_mmap_private_t* me = me_;
+    segment_t* last;
+
+    if (0 == me->nsegs)
+    {
+        *first = me->state.base;
+        return 0;
+    }
+    last = &me->segs[me->nsegs - 1];
+    *first = me->segs[0].hdr->first_idx + me->segs[0].hdr->start;
+    return last->hdr->first_idx + last->count - *first;
+}
+
+static void __free(void* me_)
+{
+    raft_log_mmap_private_t* me = me_;
+    int i;
+
+    __sync(me);
+    for (i = 0; i < me->nsegs; i++)
+        __unmap(&me->segs[i]);
+    close(me->statefd);
+    close(me->dirfd);
+    free(me->segs);
+    free(me->dir);
+    free(me);
+}
+
+static int __cmp_segment(const void* a, const void* b)
+{
+    int64_t x = ((const segment_t*)a)->hdr->first_idx;
+    int64_t y = ((const segment_t*)b)->hdr->first_idx;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Map the segment files in the directory, keeping only those that carry on
+ * from the one before */
+static int __load(raft_log_mmap_private_t* me)
+{
+    DIR* d;
+    struct dirent* de;
+    int i;
+
+    if (!(d = fdopendir(dup(me->dirfd))))
+        return 0;
+    while ((de = readdir(d)))
+    {
+        char path[4096];
+        long long first_idx;
+        segment_t s;
+        struct stat st;
+        int fd, len;
+
+        if (1 != sscanf(de->d_name, "%20lld.seg%n", &first_idx, &len) ||
+            24 != len || de->d_name[len])
+            continue;
+        __segment_name(me, first_idx, path, sizeof(path));
+        if (-1 == (fd = open(path, O_RDWR)))
+            continue;
+        if (-1 == fstat(fd, &st) || (size_t)st.st_size != __segment_size() ||
+            !__map(&s, fd))
+        {
+            close(fd);
+            continue;
+        }
+        close(fd);
+
+        if (SEGMENT_MAGIC != s.hdr->magic || SEGMENT_ENTRIES != s.hdr->capacity ||
+            sizeof(msg_entry_t) != s.hdr->entry_size || first_idx != s.hdr->first_idx ||
+            s.hdr->synced < s.hdr->start || SEGMENT_ENTRIES < s.hdr->synced)
+        {
+            __unmap(&s);
+            continue;
+        }
+        s.count = (int)s.hdr->synced;
+
+        if (me->nsegs == me->segs_size)
+        {
+            segment_t* temp = realloc(me->segs, sizeof(segment_t) * me->segs_size * 2);
+            if (!temp)
+            {
+                __unmap(&s);
+                closedir(d);
+                return 0;
+            }
+            me->segs = temp;
+            me->segs_size *= 2;
+        }
+        me->segs[me->nsegs++] = s;
+    }
+    closedir(d);
+
+    qsort(me->segs, me->nsegs, sizeof(segment_t), __cmp_segment);
+
+    /* drop everything after a gap, which a crash mid-truncation can leave */
+    for (i = 1; i < me->nsegs; i++)
+    {
+        segment_t* prev = &me->segs[i - 1];
+        if (SEGMENT_ENTRIES != prev->count || 0 != me->segs[i].hdr->start ||
+            prev->hdr->first_idx + SEGMENT_ENTRIES != me->segs[i].hdr->first_idx)
+            break;
+    }
+    __remove_segments(me, i);
+    if (1 == me->nsegs && me->segs[0].hdr->start == me->segs[0].count)
+        __remove_segments(me, 0);
+    me->dirty = me->nsegs;
+    return 1;
+}
+
+static int __load_state_file(raft_log_mmap_private_t* me)
+{
+    ssize_t n = pread(me->statefd, &me->state, sizeof(state_t), 0);
+
+    if (-1 == n)
+        return 0;
+    if (sizeof(state_t) != n || STATE_MAGIC != me->state.magic)
+    {
+        me->state.magic = STATE_MAGIC;
+        me->state.term = -1;
+        me->state.voted_for = -1;
+        me->state.base = 0;
+    }
+    return 1;
+}
+
+raft_log_mmap_t* raft_log_mmap_open(const char* dir)
+{
+    raft_log_mmap_private_t* me;
+    char path[4096];
+
+    if (-1 == mkdir(dir, 0755) && EEXIST != errno)
+        return NULL;
+    if (!(me = calloc(1, sizeof(raft_log_mmap_private_t))))
+        return NULL;
+    me->segs_size = 8;
+    me->dirfd = -1;
+    me->statefd = -1;
+    snprintf(path, sizeof(path), "%s/state", dir);
+    if (!(me->dir = strdup(dir)) ||
+        !(me->segs = calloc(me->segs_size, sizeof(segment_t))) ||
+        -1 == (me->dirfd = open(dir, O_RDONLY | O_DIRECTORY)) ||
+        -1 == (me->statefd = open(path, O_RDWR | O_CREAT, 0644)) ||
+        -1 == fsync(me->dirfd) ||
+        !__load_state_file(me) ||
+        !__load(me))
+    {
+        if (-1 != me->statefd)
+            close(me->statefd);
+        if (-1 != me->dirfd)
+            close(me->dirfd);
+        free(me->segs);
+        free(me->dir);
+        free(me);
+        return NULL;
+    }
+    return (void*)me;
+}
+
+void raft_log_mmap_set_ops(raft_log_mmap_t* me_, raft_log_ops_t* ops)
+{
+    memset(ops, 0, sizeof(raft_log_ops_t));
+    ops->append = __append;
+    ops->get = __get;
+    ops->truncate_suffix = __truncate_suffix;
+    ops->truncate_prefix = __truncate_prefix;
+    ops->sync = __sync;
+    ops->range = __range;
+    ops->save_state = __save_state;
+    ops->load_state = __load_state;
+    ops->free = __free;
+}
@@ -0,0 +1,41 @@
+#ifndef RAFT_LOG_MMAP_H_
+#define RAFT_LOG_MMAP_H_
+
+/**
+ * @file
+ * @brief Log storage backend that keeps entries in memory mapped files
+ *
+ * The log is split into segment files of a fixed number of entries, each
+ * mapped into memory whole. Entries are fixed size, so a segment's index is
+ * its position in the directory and the slot's position in the segment;
+ * opening a log maps the segments rather than reading them in. Pages are
+ * only brought in as they are touched, so the log may be far larger than
+ * memory.
+ *
+ * Our term and vote are kept alongside, so a restarted server doesn't vote
+ * twice in a term. Snapshots aren't kept: once the log has been compacted
+ * raft_new_with_log refuses it, and the directory must be emptied so the
+ * server rejoins with a snapshot from the leader.
+ *
+ * Usage:
+ *     raft_log_ops_t ops;
+ *     raft_log_mmap_t* store = raft_log_mmap_open("/var/lib/raft");
+ *     raft_log_mmap_set_ops(store, &ops);
+ *     raft = raft_new_with_log(nodeid, &ops, store);
+ */
+
+typedef void* raft_log_mmap_t;
+
+/**
+ * Open the log kept in a directory, creating the directory if need be.
+ * Entries appended after the last sync before a crash are discarded
+ * @param dir The directory holding the segment files
+ * @return NULL on error */
+raft_log_mmap_t* raft_log_mmap_open(const char* dir);
+
+/**
+ * Fill in the backend's functions, to pass to raft_new_with_log
+ * @param ops Functions to fill in */
+void raft_log_mmap_set_ops(raft_log_mmap_t* me_, raft_log_ops_t* ops);
+
+#endif /* RAFT_LOG_MMAP_H_ */
@@ -0,0 +1,322 @@
+/**
+ * @file
+ * @brief Proposes entries through raft::Server from coroutines, and checks
+ * that every node applies them
+ *
+ * usage: raft_propose [-e ENTRIES] [-c CLIENTS] [NODES]
+ *
+ * Runs a cluster of raft::Server in this process, with messages delivered
+ * in memory and none lost. Node 0 stands for election, then CLIENTS
+ * coroutines each propose entries with co_await until ENTRIES have
+ * committed. Prints the CPU time per committed entry, across the whole
+ * cluster, and exits non-zero if any proposal wasn't committed or any node
+ * applied something else.
+ *
+ * Built with RAFT_STATIC_HOOKS, the C server calls the transport and state
+ * machine below directly; with link time optimisation they are inlined
+ * into it:
+ *
+ *     gcc -O2 -flto -DRAFT_STATIC_HOOKS -c raft_*.c
+ *     g++ -std=c++20 -O2 -flto -DRAFT_STATIC_HOOKS raft_propose.cpp *.o
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <memory>
+#include <vector>
+
+#include <unistd.h>
+
+#include "raft.hpp"
+
+#define DEFAULT_ENTRIES 20000
+
+#define DEFAULT_CLIENTS 16
+
+#define DEFAULT_NODES 5
+
+/* give up once this many periodic calls in a row commit nothing */
+#define IDLE_PERIODICS 100
+
+namespace {
+
+enum {
+    MSG_REQUESTVOTE,
+    MSG_REQUESTVOTE_RESPONSE,
+    MSG_APPENDENTRIES,
+    MSG_APPENDENTRIES_RESPONSE,
+    MSG_INSTALLSNAPSHOT,
+    MSG_INSTALLSNAPSHOT_RESPONSE
+};
+
+struct Msg {
+    int from;
+    int to;
+    int type;
+    union {
+        msg_requestvote_t rv;
+        msg_requestvote_response_t rvr;
+        msg_appendentries_t ae;
+        msg_appendentries_response_t aer;
+        msg_installsnapshot_t is;
+        msg_installsnapshot_response_t isr;
+    } u;
+};
+
+std::vector<Msg> queue;
+
+/**
+ * Queues messages for the cluster */
+struct Net {
+    int self;
+
+    template <class M>
+    bool push(int node, int type, const M& m)
+    {
+        Msg& msg = queue.emplace_back();
+        msg.from = self;
+        msg.to = node;
+        msg.type = type;
+        std::memcpy(&msg.u, &m, sizeof(m));
+        return true;
+    }
+
+    bool send(int node, const msg_requestvote_t& m)
+    {
+        return push(node, MSG_REQUESTVOTE, m);
+    }
+
+    bool send(int node, const msg_requestvote_response_t& m)
+    {
+        return push(node, MSG_REQUESTVOTE_RESPONSE, m);
+    }
+
+    bool send(int node, const msg_appendentries_t& m)
+    {
+        return push(node, MSG_APPENDENTRIES, m);
+    }
+
+    bool send(int node, const msg_appendentries_response_t& m)
+    {
+        return push(node, MSG_APPENDENTRIES_RESPONSE, m);
+    }
+
+    bool send(int node, const msg_installsnapshot_t& m)
+    {
+        return push(node, MSG_INSTALLSNAPSHOT, m);
+    }
+
+    bool send(int node, const msg_installsnapshot_response_t& m)
+    {
+        return push(node, MSG_INSTALLSNAPSHOT_RESPONSE, m);
+    }
+};
+
+/**
+ * Sums the entries it applies, so nodes can be compared */
+struct Sum {
+    long long sum = 0;
+    long long n = 0;
+
+    bool apply(const raft::Entry& e)
+    {
+        int v;
+
+        std::memcpy(&v, e.bytes().data(), sizeof(v));
+        sum += v;
+        n++;
+        return true;
+    }
+};
+
+static_assert(raft::Transport<Net>);
+static_assert(raft::StateMachine<Sum>);
+
+using Server = raft::Server<Net, Sum>;
+
+/**
+ * A coroutine that starts at once and is never waited on */
+struct Task {
+    struct promise_type {
+        Task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+std::vector<std::unique_ptr<Server>> servers;
+
+/* proposals made, those that committed, and those that didn't */
+int proposed, committed, failed;
+
+/* sum of the values that committed */
+long long committed_sum;
+
+long long cpu_nsec()
+{
+    timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Deliver messages until none are left */
+void deliver()
+{
+    for (std::size_t i = 0; i < queue.size(); i++)
+    {
+        /* handlers queue more messages, which may move the queue */
+        Msg msg = queue[i];
+        Server& s = *servers[msg.to];
+
+        switch (msg.type)
+        {
+        case MSG_REQUESTVOTE:
+            s.recv(msg.from, msg.u.rv);
+            break;
+        case MSG_REQUESTVOTE_RESPONSE:
+            s.recv(msg.from, msg.u.rvr);
+            break;
+        case MSG_APPENDENTRIES:
+            s.recv(msg.from, msg.u.ae);
+            break;
+        case MSG_APPENDENTRIES_RESPONSE:
+            s.recv(msg.from, msg.u.aer);
+            break;
+        case MSG_INSTALLSNAPSHOT:
+            s.recv(msg.from, msg.u.is);
+            break;
+        case MSG_INSTALLSNAPSHOT_RESPONSE:
+            s.recv(msg.from, msg.u.isr);
+            break;
+        }
+    }
+    queue.clear();
+}
+
+/**
+ * Propose entries one after another until 'entries' have been proposed.
+ * Each proposal is made from where the last one resumed, which is after
+ * the server has finished with the input that committed it */
+Task client(Server& s, int entries)
+{
+    while (proposed < entries)
+    {
+        int v = ++proposed;
+        raft::Result r = co_await s.propose(std::as_bytes(std::span(&v, 1)));
+
+        if (raft::Outcome::committed != r.outcome)
+        {
+            std::fprintf(stderr, "entry %d: outcome %d\n", v,
+                         static_cast<int>(r.outcome));
+            failed++;
+            co_return;
+        }
+        committed++;
+        committed_sum += v;
+    }
+}
+
+} /* namespace */
+
+#ifdef RAFT_STATIC_HOOKS
+RAFT_HOOKS(Server)
+#endif
+
+int main(int argc, char** argv)
+{
+    int entries = DEFAULT_ENTRIES, clients = DEFAULT_CLIENTS,
+        nodes = DEFAULT_NODES, idle, c, i;
+    std::vector<Net> nets;
+    std::vector<Sum> sums;
+    long long start, nsec;
+
+    while (-1 != (c = getopt(argc, argv, "e:c:")))
+    {
+        if ('e' == c)
+            entries = atoi(optarg);
+        else if ('c' == c)
+            clients = atoi(optarg);
+        else
+            goto usage;
+    }
+    if (optind < argc)
+        nodes = atoi(argv[optind]);
+    if (entries <= 0 || clients <= 0 || nodes <= 0)
+        goto usage;
+
+    /* the servers keep references to these */
+    nets.resize(nodes);
+    sums.resize(nodes);
+    for (i = 0; i < nodes; i++)
+    {
+        nets[i].self = i;
+        servers.push_back(std::make_unique<Server>(i, nodes, nets[i], sums[i]));
+    }
+
+    servers[0]->become_candidate();
+    deliver();
+    if (!servers[0]->is_leader())
+    {
+        std::fprintf(stderr, "node 0 wasn't elected\n");
+        return 1;
+    }
+
+    start = cpu_nsec();
+    for (i = 0; i < clients; i++)
+        client(*servers[0], entries);
+    for (idle = 0; committed + failed < proposed && idle < IDLE_PERIODICS; )
+    {
+        int before = committed;
+
+        deliver();
+        for (auto& s : servers)
+            s->periodic(10);
+        deliver();
+        idle = committed == before ? idle + 1 : 0;
+    }
+    nsec = cpu_nsec() - start;
+
+    /* followers that weren't needed for the commits catch up, and learn of
+     * the last commits from later appendentries */
+    for (i = 1, idle = 0; i < nodes && idle < IDLE_PERIODICS; )
+    {
+        raft::Index applied = servers[i]->last_applied_idx();
+
+        if (servers[0]->last_applied_idx() <= applied)
+        {
+            i++;
+            continue;
+        }
+        for (auto& s : servers)
+            s->periodic(10);
+        deliver();
+        idle = applied == servers[i]->last_applied_idx() ? idle + 1 : 0;
+    }
+
+    std::printf("%d nodes, %d clients: %d of %d committed, %lld ns/entry\n",
+                nodes, clients, committed, entries,
+                committed ? nsec / committed : 0);
+    if (committed != entries)
+        return 1;
+    for (i = 0; i < nodes; i++)
+    {
+        if (sums[i].n != entries || sums[i].sum != committed_sum)
+        {
+            std::fprintf(stderr, "node %d applied %lld entries summing to %lld\n",
+                         i, sums[i].n, sums[i].sum);
+            return 1;
+        }
+    }
+    return 0;
+
+usage:
+    std::fprintf(stderr, "usage: %s [-e ENTRIES] [-c CLIENTS] [NODES]\n",
+                 argv[0]);
+    return 1;
+}
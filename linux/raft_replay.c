@@ -0,0 +1,131 @@
+/**
+ * @file
+ * @brief Replays a trace recorded with raft_trace_new
+ *
+ * usage: raft_replay [-r] TRACE
+ *
+ * Feeds every recorded input to a fresh server, as fast as it will go or,
+ * with -r, with the gaps the traced server saw between them. Stops at the
+ * first input the server handles differently than the traced one did, and
+ * prints how much CPU time each kind of input took.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "raft.h"
+#include "raft_trace.h"
+
+typedef struct {
+    long long count;
+    long long total_nsec;
+    long long max_nsec;
+} stat_t;
+
+static long long __cpu_nsec()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void __sleep_usec(long long usec)
+{
+    struct timespec ts;
+
+    if (usec <= 0)
+        return;
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = usec % 1000000 * 1000;
+    while (-1 == nanosleep(&ts, &ts))
+        ;
+}
+
+int main(int argc, char** argv)
+{
+    stat_t stats[RAFT_TRACE_NINPUTS];
+    raft_trace_event_t ev;
+    raft_replay_t* replay;
+    long long n = 0;
+    int realtime = 0, c, i, res;
+    FILE* fp;
+
+    while (-1 != (c = getopt(argc, argv, "r")))
+    {
+        if ('r' == c)
+            realtime = 1;
+        else
+            goto usage;
+    }
+    if (optind + 1 != argc)
+        goto usage;
+
+    if (!(fp = fopen(argv[optind], "rb")))
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (!(replay = raft_replay_new(fp)))
+    {
+        fprintf(stderr, "%s: not a trace, or not one this build can replay\n",
+                argv[optind]);
+        return 1;
+    }
+
+    memset(stats, 0, sizeof(stats));
+    while (1 == (res = raft_replay_next(replay, &ev)))
+    {
+        long long start, nsec;
+        int same;
+
+        if (realtime)
+            __sleep_usec(ev.usec);
+
+        start = __cpu_nsec();
+        same = raft_replay_dispatch(replay, &ev);
+        nsec = __cpu_nsec() - start;
+
+        stats[ev.type].count++;
+        stats[ev.type].total_nsec += nsec;
+        if (stats[ev.type].max_nsec < nsec)
+            stats[ev.type].max_nsec = nsec;
+
+        if (!same)
+        {
+            printf("diverged at input %lld (%s from node %d)\n",
+                   n, raft_trace_type_name(ev.type), ev.node);
+            res = 2;
+            break;
+        }
+        n++;
+    }
+    if (-1 == res)
+        fprintf(stderr, "%s: truncated or corrupt after input %lld\n",
+                argv[optind], n);
+
+    printf("%-26s %10s %12s %10s %10s\n",
+           "input", "count", "total us", "mean ns", "max ns");
+    for (i = 1; i < RAFT_TRACE_NINPUTS; i++)
+    {
+        if (!stats[i].count)
+            continue;
+        printf("%-26s %10lld %12lld %10lld %10lld\n",
+               raft_trace_type_name(i), stats[i].count,
+               stats[i].total_nsec / 1000,
+               stats[i].total_nsec / stats[i].count, stats[i].max_nsec);
+    }
+
+    raft_replay_free(replay);
+    fclose(fp);
+    return res == 0 ? 0 : 1;
+
+usage:
+    fprintf(stderr, "usage: %s [-r] TRACE\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,504 @@
+/**
+ * @file
+ * @brief Shared memory transport for Raft servers on the same host
+ *
+ * The region holds nmembers * nmembers rings; the ring carrying messages
+ * from member a to member b is number a * nmembers + b. Each ring is a
+ * power-of-two array of fixed size slots indexed by free-running head
+ * (written by the producer) and tail (written by the consumer) counters.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "raft.h"
+#include "raft_shm.h"
+
+#define CACHE_LINE 64
+
+#define PERIOD 10
+
+enum {
+    MSG_REQUESTVOTE = 1,
+    MSG_REQUESTVOTE_RESPONSE,
+    MSG_APPENDENTRIES,
+    MSG_APPENDENTRIES_RESPONSE,
+    MSG_INSTALLSNAPSHOT,
+    MSG_INSTALLSNAPSHOT_RESPONSE
+};
+
+typedef struct {
+    int type;
+    /* member number of the sender */
+    int from;
+    union {
+        msg_requestvote_t rv;
+        msg_requestvote_response_t rvr;
+        msg_appendentries_t ae;
+        msg_appendentries_response_t aer;
+        msg_installsnapshot_t is;
+        msg_installsnapshot_response_t isr;
+    } u;
+} slot_t;
+
+typedef struct {
+    /* next slot the producer will fill */
+    uint32_t head;
+    char pad1[CACHE_LINE - sizeof(uint32_t)];
+    /* next slot the consumer will read */
+    uint32_t tail;
+    char pad2[CACHE_LINE - sizeof(uint32_t)];
+    slot_t slots[];
+} ring_t;
+
+typedef struct {
+    int nmembers;
+    /* always a power of two */
+    uint32_t nslots;
+    size_t ring_size;
+
+    int fd;
+    void* base;
+    size_t size;
+
+    /* one per member */
+    int* eventfds;
+} raft_shm_region_private_t;
+
+typedef struct {
+    raft_server_t* raft;
+    raft_shm_region_private_t* region;
+    int member;
+
+    int epfd;
+    int timerfd;
+
+    int period;
+    int stop;
+    struct timespec last_periodic;
+
+    /* member number -> node index, -1 if not a peer */
+    int* member_node;
+
+    /* node index -> member number */
+    int* node_member;
+    int nnodes;
+} raft_shm_private_t;
+
+static ring_t* __ring(raft_shm_region_private_t* region, int from, int to)
+{
+    return (ring_t*)((char*)region->base +
+                     (from * region->nmembers + to) * region->ring_size);
+}
+
+static long __elapsed_msec(struct timespec* since)
+{
+    struct timespec now;
+    long msec;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    msec = (now.tv_sec - since->tv_sec) * 1000 +
+        (now.tv_nsec - since->tv_nsec) / 1000000;
+    /* carry the remainder over to the next call */
+    since->tv_sec += msec / 1000;
+    since->tv_nsec += (msec % 1000) * 1000000;
+    if (1000000000 <= since->tv_nsec)
+    {
+        since->tv_sec += 1;
+        since->tv_nsec -= 1000000000;
+    }
+    return msec;
+}
+
+raft_shm_region_t* raft_shm_region_new(int nmembers, int nslots)
+{
+    raft_shm_region_private_t* region;
+    uint32_t n = 1;
+    int i;
+
+    if (nmembers <= 0 || nslots <= 0)
+        return NULL;
+
+    while (n < (uint32_t)nslots)
+        n <<= 1;
+
+    if (!(region = calloc(1, sizeof(raft_shm_region_private_t))))
+        return NULL;
+    region->nmembers = nmembers;
+    region->nslots = n;
+    region->ring_size = sizeof(ring_t) + n * sizeof(slot_t);
+    region->ring_size = (region->ring_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    region->size = region->ring_size * nmembers * nmembers;
+    region->fd = -1;
+    region->base = MAP_FAILED;
+
+    if (!(region->eventfds = malloc(sizeof(int) * nmembers)))
+        goto fail;
+    for (i = 0; i < nmembers; i++)
+        region->eventfds[i] = -1;
+
+    if (-1 == (region->fd = memfd_create("raft_shm", MFD_CLOEXEC)))
+        goto fail;
+    if (-1 == ftruncate(region->fd, region->size))
+        goto fail;
+
+    /* ftruncate zero fills, so every ring starts out empty */
+    region->base = mmap(NULL, region->size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, region->fd, 0);
+    if (MAP_FAILED == region->base)
+        goto fail;
+
+    for (i = 0; i < nmembers; i++)
+        if (-1 == (region->eventfds[i] = eventfd(0, EFD_NONBLOCK)))
+            goto fail;
+
+    return (void*)region;
+
+fail:
+    raft_shm_region_free((void*)region);
+    return NULL;
+}
+
+void raft_shm_region_free(raft_shm_region_t* region_)
+{
+    raft_shm_region_private_t* region = (void*)region_;
+    int i;
+
+    if (region->eventfds)
+        for (i = 0; i < region->nmembers; i++)
+            if (-1 != region->eventfds[i])
+                close(region->eventfds[i]);
+    if (MAP_FAILED != region->base)
+        munmap(region->base, region->size);
+    if (-1 != region->fd)
+        close(region->fd);
+    free(region->eventfds);
+    free(region);
+}
+
+/**
+ * Reserve the next slot in the ring to a peer
+ * @return NULL if the ring is full */
+static slot_t* __reserve(raft_shm_private_t* me, int node, ring_t** ring)
+{
+    raft_shm_region_private_t* region = me->region;
+    uint32_t head, tail;
+    int to;
+
+    if (node < 0 || me->nnodes <= node || -1 == (to = me->node_member[node]))
+        return NULL;
+
+    *ring = __ring(region, me->member, to);
+    head = (*ring)->head;
+    tail = __atomic_load_n(&(*ring)->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == region->nslots)
+        /* a full ring is dropped traffic, which Raft retransmits */
+        return NULL;
+
+    return &(*ring)->slots[head & (region->nslots - 1)];
+}
+
+/**
+ * Publish the reserved slot and wake the peer if it may be asleep */
+static int __publish(raft_shm_private_t* me, ring_t* ring, int node)
+{
+    uint32_t head = ring->head;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+    /* The consumer only sleeps once it has caught up with head. If it had
+     * caught up with our previous head it might not see this message */
+    if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head)
+    {
+        uint64_t one = 1;
+        if (write(me->region->eventfds[me->node_member[node]],
+                  &one, sizeof(one)) < 0 && errno != EAGAIN)
+            return 0;
+    }
+    return 1;
+}
+
+#define SEND(field, msg_type) \
+    raft_shm_private_t* me = raft_get_udata(raft); \
+    ring_t* ring; \
+    slot_t* s = __reserve(me, node, &ring); \
+    if (!s) \
+        return 0; \
+    s->type = msg_type; \
+    s->from = me->member; \
+    s->u.field = *msg; \
+    return __publish(me, ring, node)
+
+static int __send_requestvote(raft_server_t* raft, int node,
+                              msg_requestvote_t* msg)
+{
+    SEND(rv, MSG_REQUESTVOTE);
+}
+
+static int __send_requestvote_response(raft_server_t* raft, int node,
+                                       msg_requestvote_response_t* msg)
+{
+    SEND(rvr, MSG_REQUESTVOTE_RESPONSE);
+}
+
+static int __send_appendentries(raft_server_t* raft, int node,
+                                msg_appendentries_t* msg)
+{
+    SEND(ae, MSG_APPENDENTRIES);
+}
+
+static int __send_appendentries_response(raft_server_t* raft, int node,
+                                         msg_appendentries_response_t* msg)
+{
+    SEND(aer, MSG_APPENDENTRIES_RESPONSE);
+}
+
+static int __send_installsnapshot(raft_server_t* raft, int node,
+                                  msg_installsnapshot_t* msg)
+{
+    SEND(is, MSG_INSTALLSNAPSHOT);
+}
+
+static int __send_installsnapshot_response(raft_server_t* raft, int node,
+                                           msg_installsnapshot_response_t* msg)
+{
+    SEND(isr, MSG_INSTALLSNAPSHOT_RESPONSE);
+}
+
+#undef SEND
+
+static void __dispatch(raft_shm_private_t* me, slot_t* s)
+{
+    int node;
+
+    if (s->from < 0 || me->region->nmembers <= s->from ||
+        -1 == (node = me->member_node[s->from]))
+        return;
+
+    /* the slot stays ours until tail moves past it, so the Raft server
+     * reads the message where the sender wrote it */
+    switch (s->type)
+    {
+        case MSG_REQUESTVOTE:
+            raft_recv_requestvote(me->raft, node, &s->u.rv);
+            break;
+        case MSG_REQUESTVOTE_RESPONSE:
+            raft_recv_requestvote_response(me->raft, node, &s->u.rvr);
+            break;
+        case MSG_APPENDENTRIES:
+            raft_recv_appendentries(me->raft, node, &s->u.ae);
+            break;
+        case MSG_APPENDENTRIES_RESPONSE:
+            raft_recv_appendentries_response(me->raft, node, &s->u.aer);
+            break;
+        case MSG_INSTALLSNAPSHOT:
+            raft_recv_installsnapshot(me->raft, node, &s->u.is);
+            break;
+        case MSG_INSTALLSNAPSHOT_RESPONSE:
+            raft_recv_installsnapshot_response(me->raft, node, &s->u.isr);
+            break;
+    }
+}
+
+/**
+ * Drain every ring addressed to us */
+static void __recv(raft_shm_private_t* me)
+{
+    raft_shm_region_private_t* region = me->region;
+    int i;
+
+    for (i = 0; i < region->nmembers; i++)
+    {
+        ring_t* ring;
+        uint32_t tail, head;
+
+        if (i == me->member || -1 == me->member_node[i])
+            continue;
+
+        ring = __ring(region, i, me->member);
+        tail = ring->tail;
+        while (tail != (head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)))
+        {
+            for (; tail != head; tail++)
+                __dispatch(me, &ring->slots[tail & (region->nslots - 1)]);
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+raft_shm_t* raft_shm_new(raft_server_t* raft, raft_shm_region_t* region_,
+                         int member)
+{
+    raft_shm_region_private_t* region = (void*)region_;
+    raft_shm_private_t* me;
+    struct epoll_event ev;
+    int i;
+
+    if (member < 0 || region->nmembers <= member)
+        return NULL;
+
+    if (!(me = calloc(1, sizeof(raft_shm_private_t))))
+        return NULL;
+
+    me->raft = raft;
+    me->region = region;
+    me->member = member;
+    me->epfd = me->timerfd = -1;
+
+    if (!(me->member_node = malloc(sizeof(int) * region->nmembers)))
+        goto fail;
+    for (i = 0; i < region->nmembers; i++)
+        me->member_node[i] = -1;
+
+    if (-1 == (me->epfd = epoll_create1(0)))
+        goto fail;
+    if (-1 == (me->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)))
+        goto fail;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = region->eventfds[member];
+    if (-1 == epoll_ctl(me->epfd, EPOLL_CTL_ADD, ev.data.fd, &ev))
+        goto fail;
+    ev.data.fd = me->timerfd;
+    if (-1 == epoll_ctl(me->epfd, EPOLL_CTL_ADD, me->timerfd, &ev))
+        goto fail;
+
+    raft_shm_set_period((void*)me, PERIOD);
+    raft_set_udata(raft, me);
+    return (void*)me;
+
+fail:
+    raft_shm_free((void*)me);
+    return NULL;
+}
+
+void raft_shm_free(raft_shm_t* me_)
+{
+    raft_shm_private_t* me = (void*)me_;
+
+    if (-1 != me->timerfd)
+        close(me->timerfd);
+    if (-1 != me->epfd)
+        close(me->epfd);
+    free(me->member_node);
+    free(me->node_member);
+    free(me);
+}
+
+int raft_shm_add_peer(raft_shm_t* me_, int node, int member)
+{
+    raft_shm_private_t* me = (void*)me_;
+    int i;
+
+    if (node < 0 || member < 0 || me->region->nmembers <= member ||
+        member == me->member)
+        return 0;
+
+    if (me->nnodes <= node)
+    {
+        int* temp = realloc(me->node_member, sizeof(int) * (node + 1));
+        if (!temp)
+            return 0;
+        for (i = me->nnodes; i <= node; i++)
+            temp[i] = -1;
+        me->node_member = temp;
+        me->nnodes = node + 1;
+    }
+    me->node_member[node] = member;
+    me->member_node[member] = node;
+    return 1;
+}
+
+void raft_shm_set_callbacks(raft_shm_t* me_, raft_cbs_t* funcs)
+{
+    funcs->send_requestvote = __send_requestvote;
+    funcs->send_requestvote_response = __send_requestvote_response;
+    funcs->send_appendentries = __send_appendentries;
+    funcs->send_appendentries_response = __send_appendentries_response;
+    funcs->send_installsnapshot = __send_installsnapshot;
+    funcs->send_installsnapshot_response = __send_installsnapshot_response;
+}
+
+void raft_shm_set_period(raft_shm_t* me_, int msec)
+{
+    raft_shm_private_t* me = (void*)me_;
+    struct itimerspec its;
+
+    me->period = msec;
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_sec = msec / 1000;
+    its.it_interval.tv_nsec = (msec % 1000) * 1000000;
+    its.it_value = its.it_interval;
+    timerfd_settime(me->timerfd, 0, &its, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &me->last_periodic);
+}
+
+int raft_shm_poll(raft_shm_t* me_, int timeout_msec)
+{
+    raft_shm_private_t* me = (void*)me_;
+    struct epoll_event events[2];
+    int i, n;
+
+    n = epoll_wait(me->epfd, events, 2, timeout_msec);
+    if (n < 0)
+        return errno == EINTR;
+
+    for (i = 0; i < n; i++)
+    {
+        uint64_t count;
+
+        /* both are counters that we just reset */
+        if (read(events[i].data.fd, &count, sizeof(count)) < 0)
+            continue;
+
+        if (events[i].data.fd == me->timerfd)
+        {
+            /* use the real time elapsed, in case we fell behind */
+            if (0 == raft_periodic(me->raft, __elapsed_msec(&me->last_periodic)))
+                return 0;
+        }
+    }
+
+    /* always drain; sends only signal when a ring was empty, so messages
+     * can be waiting even when our eventfd wasn't signalled */
+    __recv(me);
+    return 1;
+}
+
+int raft_shm_run(raft_shm_t* me_)
+{
+    raft_shm_private_t* me = (void*)me_;
+
+    me->stop = 0;
+    while (!me->stop)
+    {
+        if (0 == raft_shm_poll(me_, -1))
+            return 0;
+    }
+    return 1;
+}
+
+void raft_shm_stop(raft_shm_t* me_)
+{
+    raft_shm_private_t* me = (void*)me_;
+    me->stop = 1;
+}
+
+int raft_shm_get_fd(raft_shm_t* me_)
+{
+    raft_shm_private_t* me = (void*)me_;
+    return me->region->eventfds[me->member];
+}
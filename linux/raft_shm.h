@@ -0,0 +1,85 @@
+#ifndef RAFT_SHM_H_
+#define RAFT_SHM_H_
+
+/**
+ * @file
+ * @brief Shared memory transport for Raft servers on the same host
+ *
+ * Every ordered pair of members gets a single-producer/single-consumer ring
+ * in one memfd mapping. Senders write messages straight into a ring slot,
+ * and receivers hand a pointer to the slot to the Raft server, so nothing
+ * is encoded or copied on the way in. Each member has an eventfd that is
+ * signalled when one of its rings goes from empty to non-empty.
+ *
+ * Create the region before forking (or before starting threads), then
+ * attach one transport per member.
+ */
+
+typedef void* raft_shm_region_t;
+
+typedef void* raft_shm_t;
+
+/**
+ * Create the shared region for a group of members
+ * @param nmembers Number of members that will attach
+ * @param nslots Messages each ring can hold; rounded up to a power of two
+ * @return NULL on error */
+raft_shm_region_t* raft_shm_region_new(int nmembers, int nslots);
+
+/**
+ * Unmap the region and close its file descriptors */
+void raft_shm_region_free(raft_shm_region_t* region);
+
+/**
+ * Attach a Raft server to the region as one of its members.
+ * Sets the server's udata to the transport
+ * @param raft The Raft server this transport carries messages for
+ * @param region Region created with raft_shm_region_new
+ * @param member This server's member number in the region
+ * @return NULL on error */
+raft_shm_t* raft_shm_new(raft_server_t* raft, raft_shm_region_t* region,
+                         int member);
+
+/**
+ * Free the transport. The region is left alone */
+void raft_shm_free(raft_shm_t* me_);
+
+/**
+ * Map a peer's member number to its node index
+ * @param node The peer's node index
+ * @param member The peer's member number in the region
+ * @return 0 on error */
+int raft_shm_add_peer(raft_shm_t* me_, int node, int member);
+
+/**
+ * Fill in the send callbacks. The caller provides the rest (applylog etc.)
+ * and passes the result to raft_set_callbacks
+ * @param funcs Callbacks to fill in */
+void raft_shm_set_callbacks(raft_shm_t* me_, raft_cbs_t* funcs);
+
+/**
+ * Run one iteration of the event loop: wait for messages or the periodic
+ * timer, then dispatch everything waiting in our rings to the Raft server
+ * @param timeout_msec Most time to wait; -1 waits indefinitely
+ * @return 0 on error */
+int raft_shm_poll(raft_shm_t* me_, int timeout_msec);
+
+/**
+ * Run the event loop until raft_shm_stop is called
+ * @return 0 on error */
+int raft_shm_run(raft_shm_t* me_);
+
+/**
+ * Make raft_shm_run return after the current iteration */
+void raft_shm_stop(raft_shm_t* me_);
+
+/**
+ * Set how often raft_periodic is called
+ * @param msec Period in milliseconds */
+void raft_shm_set_period(raft_shm_t* me_, int msec);
+
+/**
+ * @return the eventfd that is signalled when messages arrive */
+int raft_shm_get_fd(raft_shm_t* me_);
+
+#endif /* RAFT_SHM_H_ */
@@ -0,0 +1,508 @@
+/**
+ * @file
+ * @brief Simulates a cluster over lossy, delayed links and reports commit
+ * latency and message counts
+ *
+ * usage: raft_sim [-n NODES] [-e ENTRIES] [-i INTERVAL] [-p PERIOD]
+ *                 [-d DELAY] [-j JITTER] [-s SLOW] [-l LOSS]
+ *                 [-a ACK_DELAY] [-c THRESHOLD:RATE] [-f EVERY] [-w TIMEOUT]
+ *                 [-r SEED] [-m MAX]
+ *
+ * Runs NODES servers in this process on a simulated clock. Messages take
+ * DELAY ms, plus up to JITTER ms, to cross a link, or SLOW ms on the links
+ * to the last node; LOSS percent of them are dropped. Every server's
+ * raft_periodic runs each PERIOD ms. Shortly after a leader is elected,
+ * ENTRIES entries are proposed to it, one every INTERVAL ms, or all at once if
+ * INTERVAL is 0. With -f, every EVERY'th entry is proposed to a follower
+ * instead, which forwards it with raft_forward_entry; the forward timeout
+ * is set with -w.
+ *
+ * Prints how long entries took from proposal to being applied on the
+ * leader and on the followers, and how many of each message were sent
+ * from the first proposal until the leader had committed the last entry.
+ * Runs are deterministic for a seed, so settings can be compared. Exits
+ * non-zero if an entry wasn't committed or, with -m, if the leader's p99
+ * latency is over MAX ms:
+ *
+ *     raft_sim -n 3 -i 100 -d 20 -j 5 -l 10 -p 5     loss tail latency
+ *     raft_sim -e 400 -i 0 -d 1 -p 1 -c 4:2000 -a 5   ack coalescing
+ *     raft_sim -e 100 -i 300 -d 5 -p 1 -a 100 -m 10   held acks, lone entries
+ *     raft_sim -i 20 -s 400                           a distant follower
+ *     raft_sim -i 10 -f 3                             forwarded proposals
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "raft.h"
+
+#define MAX_NODES 64
+
+/* start proposing this long after a leader is elected, once it has heard
+ * from its followers */
+#define WARMUP_MSEC 50
+
+/* give up on entries this long after the last was proposed */
+#define DRAIN_MSEC 60000
+
+enum {
+    MSG_REQUESTVOTE,
+    MSG_REQUESTVOTE_RESPONSE,
+    MSG_APPENDENTRIES,
+    MSG_APPENDENTRIES_RESPONSE,
+    MSG_INSTALLSNAPSHOT,
+    MSG_INSTALLSNAPSHOT_RESPONSE,
+    MSG_PROPOSAL,
+    MSG_TYPES
+};
+
+static const char* msg_names[MSG_TYPES] = {
+    "requestvote",
+    "requestvote_response",
+    "appendentries",
+    "appendentries_response",
+    "installsnapshot",
+    "installsnapshot_response",
+    "proposal"
+};
+
+typedef struct {
+    /* when it arrives, and ties broken by when it was sent */
+    long long t;
+    long long seq;
+    int from;
+    int to;
+    int type;
+    union {
+        msg_requestvote_t rv;
+        msg_requestvote_response_t rvr;
+        msg_appendentries_t ae;
+        msg_appendentries_response_t aer;
+        msg_installsnapshot_t is;
+        msg_installsnapshot_response_t isr;
+        msg_entry_t e;
+    } u;
+} msg_t;
+
+static int nodes = 5, entries = 1000, interval = 20, period = 10;
+static int delay = 10, jitter, slow = -1, loss;
+
+static raft_server_t* servers[MAX_NODES];
+
+/* messages in flight, a heap ordered by arrival */
+static msg_t* heap;
+static int heap_len, heap_size;
+static long long seq;
+
+static long long now;
+
+/* messages of each type sent while counting, and those sent to the last
+ * node */
+static int counting;
+static long long sent[MSG_TYPES];
+static long long sent_last[MSG_TYPES];
+
+/* when each entry was proposed, and when it was applied on the leader and
+ * on each follower; -1 until then */
+static long long* proposed_at;
+static long long* leader_at;
+static long long* follower_at;
+static int nfollower_at;
+
+static int __before(const msg_t* a, const msg_t* b)
+{
+    return a->t < b->t || (a->t == b->t && a->seq < b->seq);
+}
+
+static void __heap_push(const msg_t* m)
+{
+    int i;
+
+    if (heap_len == heap_size)
+    {
+        heap_size = heap_size ? heap_size * 2 : 1024;
+        if (!(heap = realloc(heap, sizeof(msg_t) * heap_size)))
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    for (i = heap_len++; 0 < i && __before(m, &heap[(i - 1) / 2]); i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i] = *m;
+}
+
+static void __heap_pop(msg_t* m)
+{
+    msg_t last;
+    int i = 0;
+
+    *m = heap[0];
+    last = heap[--heap_len];
+    for (;;)
+    {
+        int c = 2 * i + 1;
+
+        if (heap_len <= c)
+            break;
+        if (c + 1 < heap_len && __before(&heap[c + 1], &heap[c]))
+            c++;
+        if (!__before(&heap[c], &last))
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+}
+
+static void __push(raft_server_t* raft, int node, int type, const void* m,
+                   size_t len)
+{
+    msg_t msg;
+    int from = raft_get_nodeid(raft);
+
+    if (counting)
+    {
+        sent[type]++;
+        if (nodes - 1 == node)
+            sent_last[type]++;
+    }
+    if (rand() % 100 < loss)
+        return;
+
+    msg.t = now + (0 <= slow && (nodes - 1 == node || nodes - 1 == from) ? slow : delay);
+    if (0 < jitter)
+        msg.t += rand() % (jitter + 1);
+    msg.seq = seq++;
+    msg.from = from;
+    msg.to = node;
+    msg.type = type;
+    memcpy(&msg.u, m, len);
+    __heap_push(&msg);
+}
+
+static int __send_requestvote(raft_server_t* raft, int node,
+                              msg_requestvote_t* m)
+{
+    __push(raft, node, MSG_REQUESTVOTE, m, sizeof(*m));
+    return 1;
+}
+
+static int __send_requestvote_response(raft_server_t* raft, int node,
+                                       msg_requestvote_response_t* m)
+{
+    __push(raft, node, MSG_REQUESTVOTE_RESPONSE, m, sizeof(*m));
+    return 1;
+}
+
+static int __send_appendentries(raft_server_t* raft, int node,
+                                msg_appendentries_t* m)
+{
+    __push(raft, node, MSG_APPENDENTRIES, m, sizeof(*m));
+    return 1;
+}
+
+static int __send_appendentries_response(raft_server_t* raft, int node,
+                                         msg_appendentries_response_t* m)
+{
+    __push(raft, node, MSG_APPENDENTRIES_RESPONSE, m, sizeof(*m));
+    return 1;
+}
+
+static int __send_installsnapshot(raft_server_t* raft, int node,
+                                  msg_installsnapshot_t* m)
+{
+    __push(raft, node, MSG_INSTALLSNAPSHOT, m, sizeof(*m));
+    return 1;
+}
+
+static int __send_installsnapshot_response(raft_server_t* raft, int node,
+                                           msg_installsnapshot_response_t* m)
+{
+    __push(raft, node, MSG_INSTALLSNAPSHOT_RESPONSE, m, sizeof(*m));
+    return 1;
+}
+
+static int __send_proposal(raft_server_t* raft, int node, msg_entry_t* e)
+{
+    __push(raft, node, MSG_PROPOSAL, e, sizeof(*e));
+    return 1;
+}
+
+/**
+ * Entries carry the number they were proposed as, from 1; heartbeats and
+ * the like carry 0 */
+static int __applylog(raft_server_t* raft, msg_entry_t e)
+{
+    int k;
+
+    memcpy(&k, e.data, sizeof(k));
+    if (k <= 0 || entries < k)
+        return 1;
+    k--;
+    if (raft_is_leader(raft))
+    {
+        if (-1 == leader_at[k])
+            leader_at[k] = now;
+    }
+    else
+    {
+        follower_at[nfollower_at++] = now - proposed_at[k];
+    }
+    return 1;
+}
+
+static void __deliver(const msg_t* m)
+{
+    raft_server_t* raft = servers[m->to];
+    msg_t msg = *m;
+
+    switch (msg.type)
+    {
+    case MSG_REQUESTVOTE:
+        raft_recv_requestvote(raft, msg.from, &msg.u.rv);
+        break;
+    case MSG_REQUESTVOTE_RESPONSE:
+        raft_recv_requestvote_response(raft, msg.from, &msg.u.rvr);
+        break;
+    case MSG_APPENDENTRIES:
+        raft_recv_appendentries(raft, msg.from, &msg.u.ae);
+        break;
+    case MSG_APPENDENTRIES_RESPONSE:
+        raft_recv_appendentries_response(raft, msg.from, &msg.u.aer);
+        break;
+    case MSG_INSTALLSNAPSHOT:
+        raft_recv_installsnapshot(raft, msg.from, &msg.u.is);
+        break;
+    case MSG_INSTALLSNAPSHOT_RESPONSE:
+        raft_recv_installsnapshot_response(raft, msg.from, &msg.u.isr);
+        break;
+    case MSG_PROPOSAL:
+        /* a leader that has stepped down drops it, as a real one would */
+        if (raft_is_leader(raft))
+            raft_recv_entry(raft, msg.from, &msg.u.e, NULL);
+        break;
+    }
+}
+
+static int __leader()
+{
+    int i;
+
+    for (i = 0; i < nodes; i++)
+        if (raft_is_leader(servers[i]))
+            return i;
+    return -1;
+}
+
+/**
+ * Propose the k'th entry, to the leader or, if it is one to forward, to
+ * the node after it
+ * @return 0 if it was turned away */
+static int __propose(int k, int forward)
+{
+    int leader = __leader();
+    msg_entry_t e;
+    int n = k + 1;
+
+    if (-1 == leader)
+        return 0;
+    memset(&e, 0, sizeof(e));
+    memcpy(e.data, &n, sizeof(n));
+    proposed_at[k] = now;
+    if (0 < forward && 0 == k % forward && 1 < nodes)
+        return 1 == raft_forward_entry(servers[(leader + 1) % nodes], &e);
+    return 1 == raft_recv_entry(servers[leader], leader, &e, NULL);
+}
+
+static int __cmp(const void* a, const void* b)
+{
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void __print_latency(const char* name, long long* lat, int n)
+{
+    if (0 == n)
+    {
+        printf("%-9s none applied\n", name);
+        return;
+    }
+    qsort(lat, n, sizeof(long long), __cmp);
+    printf("%-9s n=%-7d p50=%-6lld p90=%-6lld p99=%-6lld max=%lld ms\n", name,
+           n, lat[n / 2], lat[n * 9 / 10], lat[n * 99 / 100], lat[n - 1]);
+}
+
+int main(int argc, char** argv)
+{
+    int ack_delay = 0, catchup_entries = -1, catchup_rate = 0, forward = 0,
+        forward_timeout = -1, seed = 1, max_p99 = -1, c, i, k, nturned = 0,
+        ncommitted, rc;
+    long long elected = -1, start = -1, end, last_commit = -1, *lat;
+    raft_cbs_t cbs;
+
+    while (-1 != (c = getopt(argc, argv, "n:e:i:p:d:j:s:l:a:c:f:w:r:m:")))
+    {
+        switch (c)
+        {
+        case 'n': nodes = atoi(optarg); break;
+        case 'e': entries = atoi(optarg); break;
+        case 'i': interval = atoi(optarg); break;
+        case 'p': period = atoi(optarg); break;
+        case 'd': delay = atoi(optarg); break;
+        case 'j': jitter = atoi(optarg); break;
+        case 's': slow = atoi(optarg); break;
+        case 'l': loss = atoi(optarg); break;
+        case 'a': ack_delay = atoi(optarg); break;
+        case 'c':
+            if (2 != sscanf(optarg, "%d:%d", &catchup_entries, &catchup_rate))
+                goto usage;
+            break;
+        case 'f': forward = atoi(optarg); break;
+        case 'w': forward_timeout = atoi(optarg); break;
+        case 'r': seed = atoi(optarg); break;
+        case 'm': max_p99 = atoi(optarg); break;
+        default: goto usage;
+        }
+    }
+    if (nodes < 1 || MAX_NODES < nodes || entries < 1 || interval < 0 ||
+        period < 1 || delay < 0 || jitter < 0 || loss < 0 || 100 <= loss ||
+        forward < 0)
+        goto usage;
+    srand(seed);
+
+    proposed_at = calloc(entries, sizeof(long long));
+    leader_at = malloc(sizeof(long long) * entries);
+    follower_at = malloc(sizeof(long long) * entries * nodes);
+    lat = malloc(sizeof(long long) * entries);
+    if (!proposed_at || !leader_at || !follower_at || !lat)
+    {
+        perror("malloc");
+        return 1;
+    }
+    for (k = 0; k < entries; k++)
+        leader_at[k] = -1;
+
+    memset(&cbs, 0, sizeof(cbs));
+    cbs.send_requestvote = __send_requestvote;
+    cbs.send_requestvote_response = __send_requestvote_response;
+    cbs.send_appendentries = __send_appendentries;
+    cbs.send_appendentries_response = __send_appendentries_response;
+    cbs.send_installsnapshot = __send_installsnapshot;
+    cbs.send_installsnapshot_response = __send_installsnapshot_response;
+    cbs.send_proposal = __send_proposal;
+    cbs.applylog = __applylog;
+
+    for (i = 0; i < nodes; i++)
+    {
+        servers[i] = raft_new(i);
+        raft_set_callbacks(servers[i], &cbs);
+        if (!raft_set_configuration(servers[i], nodes))
+        {
+            fprintf(stderr, "%d nodes: built for a different number\n", nodes);
+            return 1;
+        }
+        /* keep every entry in the log, and take a burst whole */
+        raft_set_snapshot_threshold(servers[i], 0);
+        raft_set_uncommitted_limit(servers[i], 0);
+        raft_set_ack_delay(servers[i], ack_delay, 0);
+        if (0 <= catchup_entries)
+            raft_set_catchup(servers[i], catchup_entries, catchup_rate);
+        if (0 <= forward_timeout)
+            raft_set_forward_timeout(servers[i], forward_timeout);
+    }
+
+    raft_become_candidate(servers[0]);
+    for (now = 0, k = 0; ; now++)
+    {
+        msg_t m;
+
+        while (0 < heap_len && heap[0].t <= now)
+        {
+            __heap_pop(&m);
+            __deliver(&m);
+        }
+        if (0 == now % period)
+            for (i = 0; i < nodes; i++)
+                raft_periodic(servers[i], period);
+
+        if (-1 == elected && -1 != __leader())
+            elected = now;
+        if (-1 == start && -1 != elected && elected + WARMUP_MSEC <= now)
+        {
+            start = now;
+            counting = 1;
+        }
+        for (; 0 <= start && k < entries &&
+             (0 == interval || now == start + (long long)k * interval); k++)
+            if (!__propose(k, forward))
+                nturned++;
+
+        if (k == entries)
+        {
+            for (ncommitted = 0, i = 0; i < entries; i++)
+                if (-1 != leader_at[i])
+                    ncommitted++;
+            if (ncommitted + nturned == entries)
+                counting = 0;
+            if (ncommitted + nturned == entries &&
+                nfollower_at == ncommitted * (nodes - 1))
+                break;
+            if (proposed_at[entries - 1] + DRAIN_MSEC < now)
+                break;
+        }
+    }
+    end = now;
+
+    for (ncommitted = 0, i = 0; i < entries; i++)
+    {
+        if (-1 == leader_at[i])
+            continue;
+        lat[ncommitted++] = leader_at[i] - proposed_at[i];
+        if (last_commit < leader_at[i])
+            last_commit = leader_at[i];
+    }
+
+    printf("%d nodes: %d entries proposed, %d committed, %d turned away; "
+           "last committed %lld ms after the first proposal\n",
+           nodes, entries, ncommitted, nturned,
+           -1 == last_commit ? -1 : last_commit - start);
+    __print_latency("leader", lat, ncommitted);
+    __print_latency("followers", follower_at, nfollower_at);
+    printf("%-24s %10s %14s\n", "sent", "all", "to last node");
+    for (i = 0; i < MSG_TYPES; i++)
+        if (sent[i])
+            printf("%-24s %10lld %14lld\n", msg_names[i], sent[i], sent_last[i]);
+    printf("simulated %lld ms\n", end);
+
+    /* __print_latency sorted them */
+    rc = ncommitted + nturned == entries ? 0 : 1;
+    if (-1 != max_p99 && 0 < ncommitted &&
+        max_p99 < lat[ncommitted * 99 / 100])
+    {
+        fprintf(stderr, "leader p99 %lld ms is over %d ms\n",
+                lat[ncommitted * 99 / 100], max_p99);
+        rc = 1;
+    }
+
+    for (i = 0; i < nodes; i++)
+        raft_free(servers[i]);
+    free(heap);
+    free(proposed_at);
+    free(leader_at);
+    free(follower_at);
+    free(lat);
+    return rc;
+
+usage:
+    fprintf(stderr,
+            "usage: %s [-n NODES] [-e ENTRIES] [-i INTERVAL] [-p PERIOD]\n"
+            "       [-d DELAY] [-j JITTER] [-s SLOW] [-l LOSS]\n"
+            "       [-a ACK_DELAY] [-c THRESHOLD:RATE] [-f EVERY] [-w TIMEOUT]\n"
+            "       [-r SEED] [-m MAX]\n", argv[0]);
+    return 1;
+}
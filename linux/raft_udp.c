@@ -0,0 +1,614 @@
+/**
+ * @file
+ * @brief UDP transport for running the Raft core on Linux
+ *
+ * Each datagram is a one byte message type followed by the message in
+ * the compact wire encoding (raft_codec.c).
+ *
+ * Followers only ever talk to the leader, so we ping every peer once in a
+ * while and report the round trips with raft_add_rtt_sample. That is what
+ * lets the servers judge which of them is best placed to lead.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "raft.h"
+#include "raft_udp.h"
+
+/* datagrams per sendmmsg/recvmmsg */
+#define BATCH 64
+
+/* must be a power of two, and larger than the cluster */
+#define PEER_TABLE_SIZE 256
+
+#define DATAGRAM_MAX (RAFT_WIRE_MAX + 1)
+
+#define PERIOD 10
+
+#define PING_INTERVAL 1000
+
+enum {
+    MSG_REQUESTVOTE = 1,
+    MSG_REQUESTVOTE_RESPONSE,
+    MSG_APPENDENTRIES,
+    MSG_APPENDENTRIES_RESPONSE,
+    MSG_INSTALLSNAPSHOT,
+    MSG_INSTALLSNAPSHOT_RESPONSE,
+    MSG_PING,
+    MSG_PONG
+};
+
+typedef struct {
+    /* network byte order */
+    uint32_t addr;
+    uint16_t port;
+    int node;
+    int used;
+} peer_t;
+
+typedef struct {
+    /* when the ping went out; from __now_msec */
+    uint32_t sent;
+    int outstanding;
+} link_t;
+
+typedef struct {
+    raft_server_t* raft;
+
+    int fd;
+    int epfd;
+    int timerfd;
+
+    int period;
+    int stop;
+    struct timespec last_periodic;
+
+    /* address -> node index, open addressing */
+    peer_t peers[PEER_TABLE_SIZE];
+
+    /* node index -> address */
+    struct sockaddr_in* addrs;
+    link_t* links;
+    int naddrs;
+
+    int ping_elapsed;
+
+    /* queued outgoing datagrams */
+    int nout;
+    struct mmsghdr out[BATCH];
+    struct iovec out_iov[BATCH];
+    unsigned char out_buf[BATCH][DATAGRAM_MAX];
+
+    struct mmsghdr in[BATCH];
+    struct iovec in_iov[BATCH];
+    struct sockaddr_in in_addr[BATCH];
+    unsigned char in_buf[BATCH][DATAGRAM_MAX];
+} raft_udp_private_t;
+
+static unsigned int __hash(uint32_t addr, uint16_t port)
+{
+    return ((addr * 2654435761u) ^ (port * 40503u)) & (PEER_TABLE_SIZE - 1);
+}
+
+static int __lookup(raft_udp_private_t* me, struct sockaddr_in* sa)
+{
+    unsigned int i, h = __hash(sa->sin_addr.s_addr, sa->sin_port);
+
+    for (i = 0; i < PEER_TABLE_SIZE; i++)
+    {
+        peer_t* p = &me->peers[(h + i) & (PEER_TABLE_SIZE - 1)];
+        if (!p->used)
+            return -1;
+        if (p->addr == sa->sin_addr.s_addr && p->port == sa->sin_port)
+            return p->node;
+    }
+    return -1;
+}
+
+static long __elapsed_msec(struct timespec* since)
+{
+    struct timespec now;
+    long msec;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    msec = (now.tv_sec - since->tv_sec) * 1000 +
+        (now.tv_nsec - since->tv_nsec) / 1000000;
+    /* carry the remainder over to the next call */
+    since->tv_sec += msec / 1000;
+    since->tv_nsec += (msec % 1000) * 1000000;
+    if (1000000000 <= since->tv_nsec)
+    {
+        since->tv_sec += 1;
+        since->tv_nsec -= 1000000000;
+    }
+    return msec;
+}
+
+static uint32_t __now_msec()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void __flush(raft_udp_private_t* me)
+{
+    int sent = 0;
+
+    while (sent < me->nout)
+    {
+        int n = sendmmsg(me->fd, &me->out[sent], me->nout - sent, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            /* the socket buffer is full; Raft retransmits what we drop */
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            /* only the first datagram failed, e.g. its node is unreachable.
+             * Drop it rather than the datagrams for everyone else */
+            sent++;
+            continue;
+        }
+        sent += n;
+    }
+    me->nout = 0;
+}
+
+/**
+ * @return buffer for a datagram to node, with the type byte filled in */
+static unsigned char* __queue(raft_udp_private_t* me, int node, int type)
+{
+    struct mmsghdr* m;
+
+    if (node < 0 || me->naddrs <= node || 0 == me->addrs[node].sin_port)
+        return NULL;
+
+    if (BATCH == me->nout)
+        __flush(me);
+
+    m = &me->out[me->nout];
+    m->msg_hdr.msg_name = &me->addrs[node];
+    m->msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    m->msg_hdr.msg_iov = &me->out_iov[me->nout];
+    m->msg_hdr.msg_iovlen = 1;
+    me->out_iov[me->nout].iov_base = me->out_buf[me->nout];
+    me->out_buf[me->nout][0] = type;
+    return me->out_buf[me->nout];
+}
+
+static int __commit(raft_udp_private_t* me, int len)
+{
+    me->out_iov[me->nout].iov_len = len;
+    me->nout++;
+    return 1;
+}
+
+#define SEND(msg_type, encode) \
+    raft_udp_private_t* me = raft_get_udata(raft); \
+    unsigned char* buf; \
+    int len; \
+    if (!(buf = __queue(me, node, msg_type))) \
+        return 0; \
+    if (0 == (len = encode(raft, node, msg, buf + 1, DATAGRAM_MAX - 1))) \
+        return 0; \
+    return __commit(me, len + 1)
+
+static int __send_requestvote(raft_server_t* raft, int node,
+                              msg_requestvote_t* msg)
+{
+    SEND(MSG_REQUESTVOTE, raft_encode_requestvote);
+}
+
+static int __send_requestvote_response(raft_server_t* raft, int node,
+                                       msg_requestvote_response_t* msg)
+{
+    SEND(MSG_REQUESTVOTE_RESPONSE, raft_encode_requestvote_response);
+}
+
+static int __send_appendentries(raft_server_t* raft, int node,
+                                msg_appendentries_t* msg)
+{
+    SEND(MSG_APPENDENTRIES, raft_encode_appendentries);
+}
+
+static int __send_appendentries_response(raft_server_t* raft, int node,
+                                         msg_appendentries_response_t* msg)
+{
+    SEND(MSG_APPENDENTRIES_RESPONSE, raft_encode_appendentries_response);
+}
+
+/* encoded once and queued for each peer, so the whole group goes out in
+ * the same sendmmsg */
+static int __send_appendentries_broadcast(raft_server_t* raft,
+                                          const int* nodes, int nnodes,
+                                          msg_appendentries_t* msg)
+{
+    raft_udp_private_t* me = raft_get_udata(raft);
+    unsigned char encoded[DATAGRAM_MAX];
+    int i, len;
+
+    if (0 == (len = raft_encode_appendentries(raft, nodes[0], msg,
+                                              encoded + 1, DATAGRAM_MAX - 1)))
+        return 0;
+    encoded[0] = MSG_APPENDENTRIES;
+
+    for (i = 0; i < nnodes; i++)
+    {
+        unsigned char* buf;
+
+        if (!(buf = __queue(me, nodes[i], MSG_APPENDENTRIES)))
+            continue;
+        memcpy(buf, encoded, len + 1);
+        __commit(me, len + 1);
+    }
+    return 1;
+}
+
+static int __send_installsnapshot(raft_server_t* raft, int node,
+                                  msg_installsnapshot_t* msg)
+{
+    SEND(MSG_INSTALLSNAPSHOT, raft_encode_installsnapshot);
+}
+
+static int __send_installsnapshot_response(raft_server_t* raft, int node,
+                                           msg_installsnapshot_response_t* msg)
+{
+    SEND(MSG_INSTALLSNAPSHOT_RESPONSE, raft_encode_installsnapshot_response);
+}
+
+#undef SEND
+
+static void __send_ping(raft_udp_private_t* me, int node, int type,
+                        uint32_t stamp)
+{
+    unsigned char* buf;
+
+    if (!(buf = __queue(me, node, type)))
+        return;
+    memcpy(buf + 1, &stamp, sizeof(stamp));
+    __commit(me, 1 + sizeof(stamp));
+}
+
+static void __ping_peers(raft_udp_private_t* me)
+{
+    uint32_t now = __now_msec();
+    int i;
+
+    for (i = 0; i < me->naddrs; i++)
+    {
+        link_t* l = &me->links[i];
+
+        if (0 == me->addrs[i].sin_port)
+            continue;
+        /* the last one never came back */
+        if (l->outstanding)
+            raft_add_rtt_sample(me->raft, i, -1);
+        l->outstanding = 1;
+        l->sent = now;
+        __send_ping(me, i, MSG_PING, now);
+    }
+}
+
+static void __recv_pong(raft_udp_private_t* me, int node, uint32_t stamp)
+{
+    link_t* l = &me->links[node];
+
+    /* a late pong for a ping we've already counted as lost */
+    if (!l->outstanding || stamp != l->sent)
+        return;
+    l->outstanding = 0;
+    raft_add_rtt_sample(me->raft, node, __now_msec() - stamp);
+}
+
+static void __dispatch(raft_udp_private_t* me, int node,
+                       unsigned char* buf, int len)
+{
+    union {
+        msg_requestvote_t rv;
+        msg_requestvote_response_t rvr;
+        msg_appendentries_t ae;
+        msg_appendentries_response_t aer;
+        msg_installsnapshot_t is;
+        msg_installsnapshot_response_t isr;
+    } m;
+    unsigned char* body = buf + 1;
+    uint32_t stamp;
+
+    len -= 1;
+
+    switch (buf[0])
+    {
+        case MSG_PING:
+        case MSG_PONG:
+            if (len != sizeof(stamp))
+                break;
+            memcpy(&stamp, body, sizeof(stamp));
+            if (MSG_PING == buf[0])
+                __send_ping(me, node, MSG_PONG, stamp);
+            else
+                __recv_pong(me, node, stamp);
+            break;
+        case MSG_REQUESTVOTE:
+            if (raft_decode_requestvote(me->raft, node, body, len, &m.rv))
+                raft_recv_requestvote(me->raft, node, &m.rv);
+            break;
+        case MSG_REQUESTVOTE_RESPONSE:
+            if (raft_decode_requestvote_response(me->raft, node, body, len, &m.rvr))
+                raft_recv_requestvote_response(me->raft, node, &m.rvr);
+            break;
+        case MSG_APPENDENTRIES:
+            if (raft_decode_appendentries(me->raft, node, body, len, &m.ae))
+                raft_recv_appendentries(me->raft, node, &m.ae);
+            break;
+        case MSG_APPENDENTRIES_RESPONSE:
+            if (raft_decode_appendentries_response(me->raft, node, body, len, &m.aer))
+                raft_recv_appendentries_response(me->raft, node, &m.aer);
+            break;
+        case MSG_INSTALLSNAPSHOT:
+            if (raft_decode_installsnapshot(me->raft, node, body, len, &m.is))
+                raft_recv_installsnapshot(me->raft, node, &m.is);
+            break;
+        case MSG_INSTALLSNAPSHOT_RESPONSE:
+            if (raft_decode_installsnapshot_response(me->raft, node, body, len, &m.isr))
+                raft_recv_installsnapshot_response(me->raft, node, &m.isr);
+            break;
+    }
+}
+
+static int __recv(raft_udp_private_t* me)
+{
+    int i, n;
+
+    while (1)
+    {
+        for (i = 0; i < BATCH; i++)
+            me->in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+        n = recvmmsg(me->fd, me->in, BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            int node = __lookup(me, &me->in_addr[i]);
+            if (-1 == node || me->in[i].msg_len < 1)
+                continue;
+            __dispatch(me, node, me->in_buf[i], me->in[i].msg_len);
+        }
+
+        if (n < BATCH)
+            return 1;
+    }
+}
+
+raft_udp_t* raft_udp_new(raft_server_t* raft, int port)
+{
+    raft_udp_private_t* me;
+    struct sockaddr_in sa;
+    struct epoll_event ev;
+    int i;
+
+    if (!(me = calloc(1, sizeof(raft_udp_private_t))))
+        return NULL;
+
+    me->raft = raft;
+    me->fd = me->epfd = me->timerfd = -1;
+
+    if (-1 == (me->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)))
+        goto fail;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(port);
+    if (-1 == bind(me->fd, (struct sockaddr*)&sa, sizeof(sa)))
+        goto fail;
+
+    if (-1 == (me->epfd = epoll_create1(0)))
+        goto fail;
+    if (-1 == (me->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)))
+        goto fail;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = me->fd;
+    if (-1 == epoll_ctl(me->epfd, EPOLL_CTL_ADD, me->fd, &ev))
+        goto fail;
+    ev.data.fd = me->timerfd;
+    if (-1 == epoll_ctl(me->epfd, EPOLL_CTL_ADD, me->timerfd, &ev))
+        goto fail;
+
+    for (i = 0; i < BATCH; i++)
+    {
+        me->in_iov[i].iov_base = me->in_buf[i];
+        me->in_iov[i].iov_len = DATAGRAM_MAX;
+        me->in[i].msg_hdr.msg_iov = &me->in_iov[i];
+        me->in[i].msg_hdr.msg_iovlen = 1;
+        me->in[i].msg_hdr.msg_name = &me->in_addr[i];
+    }
+
+    raft_udp_set_period((void*)me, PERIOD);
+    raft_set_udata(raft, me);
+    return (void*)me;
+
+fail:
+    raft_udp_free((void*)me);
+    return NULL;
+}
+
+void raft_udp_free(raft_udp_t* me_)
+{
+    raft_udp_private_t* me = (void*)me_;
+
+    if (-1 != me->timerfd)
+        close(me->timerfd);
+    if (-1 != me->epfd)
+        close(me->epfd);
+    if (-1 != me->fd)
+        close(me->fd);
+    free(me->addrs);
+    free(me->links);
+    free(me);
+}
+
+int raft_udp_add_peer(raft_udp_t* me_, int node, const char* host, int port)
+{
+    raft_udp_private_t* me = (void*)me_;
+    struct sockaddr_in sa;
+    link_t* links;
+    unsigned int i, h;
+
+    if (node < 0)
+        return 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    if (1 != inet_pton(AF_INET, host, &sa.sin_addr))
+        return 0;
+
+    if (me->naddrs <= node)
+    {
+        struct sockaddr_in* temp = realloc(me->addrs, sizeof(sa) * (node + 1));
+        if (!temp)
+            return 0;
+        memset(temp + me->naddrs, 0, sizeof(sa) * (node + 1 - me->naddrs));
+        me->addrs = temp;
+
+        links = realloc(me->links, sizeof(link_t) * (node + 1));
+        if (!links)
+            return 0;
+        memset(links + me->naddrs, 0, sizeof(link_t) * (node + 1 - me->naddrs));
+        me->links = links;
+        me->naddrs = node + 1;
+    }
+    me->addrs[node] = sa;
+
+    h = __hash(sa.sin_addr.s_addr, sa.sin_port);
+    for (i = 0; i < PEER_TABLE_SIZE; i++)
+    {
+        peer_t* p = &me->peers[(h + i) & (PEER_TABLE_SIZE - 1)];
+        if (!p->used ||
+            (p->addr == sa.sin_addr.s_addr && p->port == sa.sin_port))
+        {
+            p->addr = sa.sin_addr.s_addr;
+            p->port = sa.sin_port;
+            p->node = node;
+            p->used = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void raft_udp_set_callbacks(raft_udp_t* me_, raft_cbs_t* funcs)
+{
+    funcs->send_requestvote = __send_requestvote;
+    funcs->send_requestvote_response = __send_requestvote_response;
+    funcs->send_appendentries = __send_appendentries;
+    funcs->send_appendentries_response = __send_appendentries_response;
+    funcs->send_appendentries_broadcast = __send_appendentries_broadcast;
+    funcs->send_installsnapshot = __send_installsnapshot;
+    funcs->send_installsnapshot_response = __send_installsnapshot_response;
+}
+
+void raft_udp_set_period(raft_udp_t* me_, int msec)
+{
+    raft_udp_private_t* me = (void*)me_;
+    struct itimerspec its;
+
+    me->period = msec;
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_sec = msec / 1000;
+    its.it_interval.tv_nsec = (msec % 1000) * 1000000;
+    its.it_value = its.it_interval;
+    timerfd_settime(me->timerfd, 0, &its, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &me->last_periodic);
+}
+
+int raft_udp_poll(raft_udp_t* me_, int timeout_msec)
+{
+    raft_udp_private_t* me = (void*)me_;
+    struct epoll_event events[2];
+    int i, n;
+
+    n = epoll_wait(me->epfd, events, 2, timeout_msec);
+    if (n < 0)
+        return errno == EINTR;
+
+    for (i = 0; i < n; i++)
+    {
+        if (events[i].data.fd == me->fd)
+        {
+            if (0 == __recv(me))
+                return 0;
+        }
+        else if (events[i].data.fd == me->timerfd)
+        {
+            uint64_t expirations;
+            int msec;
+
+            if (read(me->timerfd, &expirations, sizeof(expirations)) < 0)
+                continue;
+            /* use the real time elapsed, in case we fell behind */
+            msec = __elapsed_msec(&me->last_periodic);
+            if (0 == raft_periodic(me->raft, msec))
+                return 0;
+
+            me->ping_elapsed += msec;
+            if (PING_INTERVAL <= me->ping_elapsed)
+            {
+                me->ping_elapsed = 0;
+                __ping_peers(me);
+            }
+        }
+    }
+
+    __flush(me);
+    return 1;
+}
+
+int raft_udp_run(raft_udp_t* me_)
+{
+    raft_udp_private_t* me = (void*)me_;
+
+    me->stop = 0;
+    while (!me->stop)
+    {
+        if (0 == raft_udp_poll(me_, -1))
+            return 0;
+    }
+    return 1;
+}
+
+void raft_udp_stop(raft_udp_t* me_)
+{
+    raft_udp_private_t* me = (void*)me_;
+    me->stop = 1;
+}
+
+int raft_udp_get_fd(raft_udp_t* me_)
+{
+    return ((raft_udp_private_t*)me_)->fd;
+}
@@ -0,0 +1,68 @@
+#ifndef RAFT_UDP_H_
+#define RAFT_UDP_H_
+
+/**
+ * @file
+ * @brief UDP transport for running the Raft core on Linux
+ *
+ * Implements the send callbacks of raft_cbs_t over a single UDP socket.
+ * Outgoing messages are queued and flushed with one sendmmsg per event loop
+ * iteration; incoming datagrams are read with recvmmsg. An epoll loop drives
+ * both the socket and raft_periodic.
+ */
+
+typedef void* raft_udp_t;
+
+/**
+ * Create a transport for a Raft server and bind it to a UDP port.
+ * Sets the server's udata to the transport
+ * @param raft The Raft server this transport carries messages for
+ * @param port Local port to bind to
+ * @return NULL on error */
+raft_udp_t* raft_udp_new(raft_server_t* raft, int port);
+
+/**
+ * Close the socket and free all memory */
+void raft_udp_free(raft_udp_t* me_);
+
+/**
+ * Map a peer's address to its node index. Datagrams from addresses that
+ * aren't in the table are dropped
+ * @param node The peer's node index
+ * @param host Dotted IPv4 address of the peer
+ * @param port UDP port of the peer
+ * @return 0 on error */
+int raft_udp_add_peer(raft_udp_t* me_, int node, const char* host, int port);
+
+/**
+ * Fill in the send callbacks. The caller provides the rest (applylog etc.)
+ * and passes the result to raft_set_callbacks
+ * @param funcs Callbacks to fill in */
+void raft_udp_set_callbacks(raft_udp_t* me_, raft_cbs_t* funcs);
+
+/**
+ * Run one iteration of the event loop: wait for datagrams or the periodic
+ * timer, dispatch them to the Raft server, then flush queued messages
+ * @param timeout_msec Most time to wait; -1 waits indefinitely
+ * @return 0 on error */
+int raft_udp_poll(raft_udp_t* me_, int timeout_msec);
+
+/**
+ * Run the event loop until raft_udp_stop is called
+ * @return 0 on error */
+int raft_udp_run(raft_udp_t* me_);
+
+/**
+ * Make raft_udp_run return after the current iteration */
+void raft_udp_stop(raft_udp_t* me_);
+
+/**
+ * Set how often raft_periodic is called
+ * @param msec Period in milliseconds */
+void raft_udp_set_period(raft_udp_t* me_, int msec);
+
+/**
+ * @return the socket's file descriptor */
+int raft_udp_get_fd(raft_udp_t* me_);
+
+#endif /* RAFT_UDP_H_ */